@@ -0,0 +1,91 @@
+#ifndef SEQLIB_BAM_CONCATENATOR_H
+#define SEQLIB_BAM_CONCATENATOR_H
+
+#include <string>
+#include <vector>
+
+#include "SeqLib/BamReader.h"
+#include "SeqLib/BamWriter.h"
+
+namespace SeqLib {
+
+  /** Concatenate or merge BAM files without re-encoding the alignments
+   *
+   * Inputs must share the same sequence dictionary (names and lengths of
+   * the SQ lines). The compressed BGZF blocks of each input are copied
+   * directly to the output, so that only the header and the EOF marker
+   * are re-written. The only data that is decompressed is the block holding
+   * the end of each input header and, for Merge, the first and last block
+   * of each input.
+   */
+class BamConcatenator {
+
+ public:
+
+  /** Construct an empty concatenator */
+  BamConcatenator() {}
+
+  /** Add a BAM to the list of inputs
+   *
+   * Inputs are concatenated in the order they are added.
+   * @param f Path to a BAM file (SAM and CRAM are not supported)
+   * @return False if the file cannot be opened, is not a BAM,
+   * or has a sequence dictionary that differs from the first input
+   */
+  bool Add(const std::string& f);
+
+  /** Add a set of BAM files to the list of inputs
+   * @param f Paths to BAM files
+   * @return False if any of the inputs could not be added
+   */
+  bool Add(const std::vector<std::string>& f);
+
+  /** Provide the header to write to the output.
+   *
+   * If not set, the header of the first input is used.
+   * @param h Header with the same sequence dictionary as the inputs
+   */
+  void SetHeader(const BamHeader& h) { m_hdr = h; }
+
+  /** Concatenate the inputs, in order, by copying raw BGZF blocks
+   * @param out Path to the output BAM
+   * @return False if an input could not be read or the output could not be written
+   */
+  bool Concatenate(const std::string& out) const;
+
+  /** Merge coordinate-sorted inputs into a single coordinate-sorted BAM
+   *
+   * Inputs are ordered by their first alignment. If each input ends
+   * at or before the start of the next one (e.g. inputs are shards of
+   * distinct genomic regions), the raw BGZF blocks are copied as in
+   * Concatenate, decoding only the first and last block of each input
+   * to check this. Otherwise (or if the first or last record of an input
+   * spans two BGZF blocks), falls back to a full merge of the records, in
+   * coordinate order with unplaced reads last.
+   * @param out Path to the output BAM
+   * @return False if an input could not be read or the output could not be written
+   */
+  bool Merge(const std::string& out) const;
+
+  /** Return the number of inputs */
+  size_t size() const { return m_files.size(); }
+
+ private:
+
+  std::vector<std::string> m_files;
+
+  BamHeader m_hdr;
+
+  // header of the first input, used to check the others
+  BamHeader m_first_hdr;
+
+  // copy the raw blocks of the inputs (in order) to the output
+  bool concat(const std::string& out, const std::vector<std::string>& files) const;
+
+  // record-level merge of all of the inputs
+  bool merge_records(const std::string& out) const;
+
+};
+
+}
+#endif
@@ -105,6 +105,15 @@ namespace SeqLib {
     /** Return the reference sequences as vector of HeaderSequence objects */
     HeaderSequenceVector GetHeaderSequenceVector() const;
 
+    /** Return a checksum of the sequence dictionary (names and lengths, in order)
+     *
+     * Two headers with the same checksum map sequence names to the same IDs,
+     * so this can be stored with data keyed on sequence ID (e.g.
+     * GenomicRegionCollection::WriteBinary) to check it is used with a matching header.
+     * Returns the checksum of an empty dictionary if the header is uninitialized.
+     */
+    uint64_t SequenceDictionaryChecksum() const;
+
   private:
 
     // adapted from sam.c - bam_nam2id
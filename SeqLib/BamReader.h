@@ -174,6 +174,19 @@ class BamReader {
    */
   bool SetMultipleRegions(const GRC& grc);
 
+  /** Read only the regions in which reads can pass a filter collection
+   *
+   * Sets the regions (as SetMultipleRegions) to those from
+   * ReadFilterCollection::GetAcceptedRegions, so that an indexed file
+   * skips the rest entirely. The reads returned still need to be
+   * checked against the filters.
+   * @param rfc Filters that the reads will be checked against
+   * @param pad Extra bases on each side of the regions (see GetAcceptedRegions)
+   * @return False if the regions are unchanged, because reads from anywhere
+   * can pass (or none can), or if the regions are not found in the index
+   */
+  bool SetFilterRegions(const Filter::ReadFilterCollection& rfc, int pad = 0);
+
   /** Return if the reader has opened the first file */
   bool IsOpen() const { if (m_bams.size()) return m_bams.begin()->second.fp.get() != NULL; return false; }
 
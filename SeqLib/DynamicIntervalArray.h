@@ -0,0 +1,306 @@
+#ifndef SEQLIB_DYNAMIC_INTERVAL_ARRAY_H__
+#define SEQLIB_DYNAMIC_INTERVAL_ARRAY_H__
+
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <iterator>
+
+#include "SeqLib/SeqLibUtils.h"
+#include "SeqLib/IntervalArray.h"
+
+// inserts held unsorted before they become a sorted run
+#define DYNAMIC_INTERVAL_BUFFER 64
+
+namespace SeqLib {
+
+  /** @brief Interval index with insert and erase, and the same queries as TIntervalArray
+   *
+   * Intervals are held in a set of sorted runs (each a TIntervalArray),
+   * where run i holds at most DYNAMIC_INTERVAL_BUFFER * 2^i intervals,
+   * plus a small unsorted buffer of the newest inserts. When the buffer
+   * is full it is sorted, and merged with the runs below it until it
+   * fits in an empty run, as in a binary counter (a log-structured merge).
+   * Each interval is merged at most O(log n) times, so insert is
+   * amortized O(log n), and a query looks at O(log n) runs.
+   *
+   * Erased intervals in a run are marked (by value and range), skipped
+   * by queries, and dropped when their run is next merged. When half of
+   * the stored intervals are erased, all runs are merged into one.
+   *
+   * Values identify intervals for erase, so should be unique among
+   * the stored intervals (e.g. the index of a region), and T must be
+   * hashable. Intervals are closed, as in TIntervalTree.
+   */
+template <class T, typename K = std::size_t>
+class TDynamicIntervalArray {
+
+public:
+    typedef TInterval<T,K> interval;
+    typedef std::vector<interval> intervalVector;
+    typedef TIntervalArray<T,K> run;
+
+    TDynamicIntervalArray() : n_dead(0) {}
+
+    /** Build from a set of intervals, as a single run
+     * @param ivals Intervals to index. Contents are moved into the index, leaving ivals empty.
+     */
+    TDynamicIntervalArray(intervalVector& ivals) : n_dead(0) {
+        size_t level = 0;
+        while (capacity(level) < ivals.size())
+            ++level;
+        runs.resize(level + 1);
+        run r(ivals);
+        runs[level].swap(r);
+    }
+
+    /** Exchange contents with another index, without copying */
+    void swap(TDynamicIntervalArray& other) {
+        runs.swap(other.runs);
+        buffer.swap(other.buffer);
+        dead.swap(other.dead);
+        std::swap(n_dead, other.n_dead);
+    }
+
+    /** Number of intervals stored (not counting erased ones) */
+    size_t size() const {
+        size_t n = buffer.size();
+        for (size_t i = 0; i < runs.size(); ++i)
+            n += runs[i].size();
+        return n - n_dead;
+    }
+
+    bool empty() const { return size() == 0; }
+
+    /** Number of sorted runs that hold intervals */
+    size_t numRuns() const {
+        size_t n = 0;
+        for (size_t i = 0; i < runs.size(); ++i)
+            n += !runs[i].empty();
+        return n;
+    }
+
+    void insert(const interval& iv) {
+        // same as an erased interval that is still stored, so just unmark it
+        if (n_dead && unmark(iv))
+            return;
+        buffer.push_back(iv);
+        if (buffer.size() >= DYNAMIC_INTERVAL_BUFFER)
+            flush();
+    }
+
+    void insert(K start, K stop, const T& value) {
+        insert(interval(start, stop, value));
+    }
+
+    /** Erase an interval
+     * @return False if no interval with this range and value is stored
+     */
+    bool erase(K start, K stop, const T& value) {
+
+        for (size_t i = 0; i < buffer.size(); ++i)
+            if (same(buffer[i], start, stop, value)) {
+                buffer[i] = buffer.back();
+                buffer.pop_back();
+                return true;
+            }
+
+        _Finder f(start, stop, value);
+        _LiveFilter<_Finder> lf(*this, f);
+        for (size_t i = 0; i < runs.size() && !f.found; ++i)
+            runs[i].visitOverlapping(start, stop, lf);
+        if (!f.found)
+            return false;
+
+        dead[value].push_back(std::make_pair(start, stop));
+        ++n_dead;
+        if (2 * n_dead > size() + n_dead)
+            compact();
+        return true;
+    }
+
+    intervalVector findOverlapping(K start, K stop) const {
+        intervalVector ov;
+        this->findOverlapping(start, stop, ov);
+        return ov;
+    }
+
+    void findOverlapping(K start, K stop, intervalVector& overlapping) const {
+        _Collector c(overlapping);
+        visitOverlapping(start, stop, c);
+    }
+
+    // call f(interval) on each overlapping interval, stopping early
+    // if f returns false. Returns false if stopped early
+    template <class F>
+    bool visitOverlapping(K start, K stop, F& f) const {
+
+        for (size_t i = 0; i < buffer.size(); ++i)
+            if (buffer[i].start <= stop && buffer[i].stop >= start && !f(buffer[i]))
+                return false;
+
+        if (!n_dead) {
+            for (size_t i = 0; i < runs.size(); ++i)
+                if (!runs[i].visitOverlapping(start, stop, f))
+                    return false;
+            return true;
+        }
+
+        _LiveFilter<F> lf(*this, f);
+        for (size_t i = 0; i < runs.size(); ++i)
+            if (!runs[i].visitOverlapping(start, stop, lf))
+                return false;
+        return true;
+    }
+
+    intervalVector findContained(K start, K stop) const {
+        intervalVector contained;
+        this->findContained(start, stop, contained);
+        return contained;
+    }
+
+    void findContained(K start, K stop, intervalVector& contained) const {
+
+        for (size_t i = 0; i < buffer.size(); ++i)
+            if (buffer[i].start >= start && buffer[i].stop <= stop)
+                contained.push_back(buffer[i]);
+
+        for (size_t i = 0; i < runs.size(); ++i) {
+            size_t first = contained.size();
+            runs[i].findContained(start, stop, contained);
+            if (n_dead)
+                contained.erase(std::remove_if(contained.begin() + first, contained.end(), _IsDead(*this)), contained.end());
+        }
+    }
+
+private:
+
+    struct _Collector {
+        _Collector(intervalVector& v) : out(v) {}
+        bool operator()(const interval& i) { out.push_back(i); return true; }
+        intervalVector& out;
+    };
+
+    struct _Finder {
+        _Finder(K s, K e, const T& v) : start(s), stop(e), value(v), found(false) {}
+        bool operator()(const interval& i) {
+            found = same(i, start, stop, value);
+            return !found;
+        }
+        K start, stop;
+        const T& value;
+        bool found;
+    };
+
+    // passes only intervals that are not erased on to f
+    template <class F>
+    struct _LiveFilter {
+        _LiveFilter(const TDynamicIntervalArray& d, F& func) : a(d), f(func) {}
+        bool operator()(const interval& i) { return a.is_dead(i) || f(i); }
+        const TDynamicIntervalArray& a;
+        F& f;
+    };
+
+    struct _IsDead {
+        _IsDead(const TDynamicIntervalArray& d) : a(d) {}
+        bool operator()(const interval& i) const { return a.is_dead(i); }
+        const TDynamicIntervalArray& a;
+    };
+
+    typedef std::vector<std::pair<K,K> > rangeVector;
+
+    // run i is empty, or holds at most capacity(i) intervals
+    std::vector<run> runs;
+
+    // newest inserts, unsorted
+    intervalVector buffer;
+
+    // ranges of erased intervals that are still in a run, by value
+    SeqHashMap<T, rangeVector> dead;
+
+    size_t n_dead;
+
+    static size_t capacity(size_t level) {
+        return static_cast<size_t>(DYNAMIC_INTERVAL_BUFFER) << level;
+    }
+
+    static bool same(const interval& i, K start, K stop, const T& value) {
+        return i.start == start && i.stop == stop && i.value == value;
+    }
+
+    bool is_dead(const interval& i) const {
+        typename SeqHashMap<T, rangeVector>::const_iterator ff = dead.find(i.value);
+        if (ff == dead.end())
+            return false;
+        for (typename rangeVector::const_iterator r = ff->second.begin(); r != ff->second.end(); ++r)
+            if (r->first == i.start && r->second == i.stop)
+                return true;
+        return false;
+    }
+
+    // remove the erase mark of an interval. Returns false if not marked
+    bool unmark(const interval& i) {
+        typename SeqHashMap<T, rangeVector>::iterator ff = dead.find(i.value);
+        if (ff == dead.end())
+            return false;
+        for (typename rangeVector::iterator r = ff->second.begin(); r != ff->second.end(); ++r)
+            if (r->first == i.start && r->second == i.stop) {
+                ff->second.erase(r);
+                if (ff->second.empty())
+                    dead.erase(ff);
+                --n_dead;
+                return true;
+            }
+        return false;
+    }
+
+    // move the intervals of a run that are not erased into out, and drop their marks
+    void take_live(run& r, intervalVector& out) {
+        const interval* d = r.Data();
+        for (size_t i = 0; i < r.size(); ++i)
+            if (!n_dead || !unmark(d[i]))
+                out.push_back(d[i]);
+        run empty;
+        r.swap(empty);
+    }
+
+    // sort the buffer into a run, merging with full runs on the way up
+    void flush() {
+
+        IntervalStartSorter<T,K> intervalStartSorter;
+        intervalVector carry;
+        carry.swap(buffer);
+        std::stable_sort(carry.begin(), carry.end(), intervalStartSorter);
+
+        for (size_t level = 0; ; ++level) {
+            if (level == runs.size())
+                runs.resize(level + 1);
+            if (runs[level].empty() && carry.size() <= capacity(level)) {
+                run r(carry);
+                runs[level].swap(r);
+                return;
+            }
+            // older intervals go first, so equal starts stay in insert order
+            intervalVector older, merged;
+            take_live(runs[level], older);
+            merged.reserve(older.size() + carry.size());
+            std::merge(older.begin(), older.end(), carry.begin(), carry.end(),
+                       std::back_inserter(merged), intervalStartSorter);
+            carry.swap(merged);
+        }
+    }
+
+    // merge everything into one run, dropping the erased intervals
+    void compact() {
+        intervalVector all;
+        all.swap(buffer);
+        for (size_t i = 0; i < runs.size(); ++i)
+            take_live(runs[i], all);
+        TDynamicIntervalArray d(all);
+        swap(d);
+    }
+
+};
+
+}
+#endif
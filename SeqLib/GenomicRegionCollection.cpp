@@ -7,9 +7,17 @@
 #include <set>
 #include <stdexcept>
 #include <algorithm>
-#include <zlib.h>
+#include <queue>
+#include <functional>
+#include <cstdio>
+#include <cstring>
+#include <sys/stat.h>
 
-#define GZBUFFER 65472
+// bytes read from a BED / VCF at a time
+#define GRC_READ_BLOCK 4194304
+
+// rough gzip compression ratio of a BED / VCF, to guess the number of lines
+#define GRC_GZ_RATIO 4
 
 //#define DEBUG_OVERLAPS 1
 
@@ -70,12 +78,16 @@ namespace SeqLib {
     if (m_grv) {
       std::sort(m_grv->begin(), m_grv->end());
       m_sorted = true;
+      if (m_dynamic)
+	CreateDynamicMap();
     }
   }
   
   template<class T>
   void GenomicRegionCollection<T>::Shuffle() {
     std::random_shuffle ( m_grv->begin(), m_grv->end() );
+    if (m_dynamic)
+      CreateDynamicMap();
   }
 
   template<class T>
@@ -118,121 +130,151 @@ namespace SeqLib {
 
 template<class T>
 bool GenomicRegionCollection<T>::ReadBED(const std::string & file, const BamHeader& hdr) {
+  return read_text(file, hdr, false, ThreadPool());
+}
+
+template<class T>
+bool GenomicRegionCollection<T>::ReadBED(const std::string & file, const BamHeader& hdr, ThreadPool tp) {
+  return read_text(file, hdr, false, tp);
+}
+
+template<class T>
+bool GenomicRegionCollection<T>::ReadVCF(const std::string & file, const BamHeader& hdr) {
+  return read_text(file, hdr, true, ThreadPool());
+}
+
+template<class T>
+bool GenomicRegionCollection<T>::ReadVCF(const std::string & file, const BamHeader& hdr, ThreadPool tp) {
+  return read_text(file, hdr, true, tp);
+}
+
+template<class T>
+bool GenomicRegionCollection<T>::read_text(const std::string & file, const BamHeader& hdr, bool vcf, ThreadPool tp) {
 
   m_sorted = false;
   idx = 0;
 
-  gzFile fp = NULL;
-  fp = strcmp(file.c_str(), "-")? gzopen(file.c_str(), "r") : gzdopen(fileno(stdin), "r");
+  // BGZF reads plain, gzipped and bgzipped text
+  // closed on return, or if a line can't be parsed
+  SeqPointer<BGZF> fp;
+  if (!file.empty())
+    fp = SeqPointer<BGZF>(strcmp(file.c_str(), "-") ? bgzf_open(file.c_str(), "r") : bgzf_dopen(fileno(stdin), "r"), bgzf_delete());
 
-  if (file.empty() || !fp) {
-    std::cerr << "BED file not readable: " << file << std::endl;
+  if (!fp) {
+    std::cerr << (vcf ? "VCF" : "BED") << " file not readable: " << file << std::endl;
     return false;
   }
 
-  // http://www.lemoda.net/c/gzfile-read/
-  while (1) {
+  // decompress blocks on other threads while this one parses
+  if (tp.IsOpen() && fp->is_compressed)
+    bgzf_thread_pool(fp.get(), tp.p.pool, 0);
 
-    int err;                    
-    char buffer[GZBUFFER];
-    gzgets(fp, buffer, GZBUFFER);
-    int bytes_read = strlen(buffer);
+  _ChrNameCache chrs(hdr);
+  std::vector<char> buf(GRC_READ_BLOCK);
+  size_t have = 0;
+  bool first = true;
 
-    // get one line
-    if (bytes_read < GZBUFFER - 1) {
-      if (gzeof (fp)) break;
-      else {
-	const char * error_string;
-	error_string = gzerror (fp, &err);
-	if (err) {
-	  fprintf (stderr, "Error: %s.\n", error_string);
-	  exit (EXIT_FAILURE);
-	}
+  while (true) {
+
+    // a line longer than the buffer
+    if (have == buf.size())
+      buf.resize(2 * buf.size());
+
+    ssize_t n = bgzf_read(fp.get(), &buf[have], buf.size() - have);
+    if (n < 0) {
+      std::cerr << "Error reading " << file << std::endl;
+      return false;
+    }
+    have += n;
+    const bool eof = n == 0;
+
+    // parse the complete lines, or all of it at the end of the file
+    const char* p = &buf[0];
+    const char* end = p + have;
+    size_t lines = 0;
+    while (p < end) {
+      const char* nl = static_cast<const char*>(memchr(p, '\n', end - p));
+      if (!nl) {
+	if (!eof)
+	  break;
+	nl = end;
       }
+      if (vcf)
+	parse_vcf_line(p, nl, chrs);
+      else
+	parse_bed_line(p, nl, chrs);
+      p = nl + 1;
+      ++lines;
     }
 
-    // prepare to loop through each field of BED line
-    //size_t counter = 0;
-    std::string chr, pos1, pos2;
-    std::string line(buffer);
-    std::istringstream iss_line(line);
-    std::string val;
-    if (line.find("#") != std::string::npos) 
-      continue;
-    
-    // read first three BED columns
-    iss_line >> chr >> pos1 >> pos2;
+    // guess the number of lines from the first block, to size the vector once
+    if (first && !eof && lines) {
+      first = false;
+      struct stat st;
+      if (strcmp(file.c_str(), "-") && !stat(file.c_str(), &st)) {
+	double bytes = static_cast<double>(st.st_size) * (fp->is_compressed ? GRC_GZ_RATIO : 1);
+	size_t est = m_grv->size() + static_cast<size_t>(bytes / (p - &buf[0]) * lines);
+	if (est > m_grv->capacity())
+	  m_grv->reserve(est);
+      }
+    }
 
-    // construct the GenomicRegion
-    T gr(chr, pos1, pos2, hdr);
-    
-    if (gr.chr >= 0)
-      m_grv->push_back(gr);
+    if (eof)
+      break;
+
+    // keep the partial last line for the next block
+    have = end - p;
+    if (have && p != &buf[0])
+      memmove(&buf[0], p, have);
   }
 
   return true;
 }
 
 template<class T>
-bool GenomicRegionCollection<T>::ReadVCF(const std::string & file, const BamHeader& hdr) {
+void GenomicRegionCollection<T>::parse_bed_line(const char* p, const char* end, _ChrNameCache& chrs) {
 
-  m_sorted = false;
-  idx = 0;
+  // skip comments, and blank lines
+  if (memchr(p, '#', end - p))
+    return;
+  const char *chr, *chr_end, *pos1, *pos1_end, *pos2, *pos2_end;
+  if (!grc_next_field(p, end, chr, chr_end))
+    return;
+  if (!grc_next_field(p, end, pos1, pos1_end) || !grc_next_field(p, end, pos2, pos2_end))
+    throw std::invalid_argument("GenomicRegionCollection::ReadBED - BED line has fewer than 3 columns: " + std::string(chr, end));
 
-  gzFile fp = NULL;
-  fp = strcmp(file.c_str(), "-")? gzopen(file.c_str(), "r") : gzdopen(fileno(stdin), "r");
-  
-  if (file.empty() || !fp) {
-    std::cerr << "VCF file not readable: " << file << std::endl;
-    return false;
-  }
+  T gr;
+  gr.pos1 = grc_parse_int(pos1, pos1_end);
+  gr.pos2 = grc_parse_int(pos2, pos2_end);
+  gr.chr = chrs.ID(chr, chr_end);
 
-  // http://www.lemoda.net/c/gzfile-read/
-  while (1) {
+  if (gr.chr >= 0)
+    m_grv->push_back(gr);
+}
 
-    int err;                    
-    char buffer[GZBUFFER];
-    gzgets(fp, buffer, GZBUFFER);
-    int bytes_read = strlen(buffer);
+template<class T>
+void GenomicRegionCollection<T>::parse_vcf_line(const char* p, const char* end, _ChrNameCache& chrs) {
 
-    // get one line
-    if (bytes_read < GZBUFFER - 1) {
-      if (gzeof (fp)) break;
-      else {
-	const char * error_string;
-	error_string = gzerror (fp, &err);
-	if (err) {
-	  fprintf (stderr, "Error: %s.\n", error_string);
-	  exit (EXIT_FAILURE);
-	}
-      }
-    }
+  if (p == end || *p == '#')
+    return;
+  const char *chr, *chr_end, *pos = end, *pos_end = end;
+  if (!grc_next_field(p, end, chr, chr_end))
+    return;
 
-    // prepare to loop through each field of BED line
-    std::string chr, pos;
-    std::string line(buffer);
-    std::istringstream iss_line(line);
-    std::string val;
-    if (line.empty() || line.at(0) == '#')
-      continue;
-
-    // read first two columnes
-    iss_line >> chr >> pos;
-
-    // construct the GenomicRegion
-    T gr;
-    try {
-      gr = T(chr, pos, pos, hdr);
-    } catch (...) {
-      std::cerr << "...Could not parse pos: " << pos << std::endl << std::endl
-		<< "...on line " << line << std::endl;
-      
-    }
-    if (gr.chr >= 0) 
-      m_grv->push_back(gr);
+  T gr;
+  try {
+    if (!grc_next_field(p, end, pos, pos_end))
+      throw std::invalid_argument("no POS");
+    gr.pos1 = gr.pos2 = grc_parse_int(pos, pos_end);
+    gr.chr = chrs.ID(chr, chr_end);
+  } catch (...) {
+    std::cerr << "...Could not parse pos: " << std::string(pos, pos_end) << std::endl << std::endl
+	      << "...on line " << std::string(chr, end) << std::endl;
+    return;
   }
 
-  return true;
+  if (gr.chr >= 0) 
+    m_grv->push_back(gr);
 }
 
 template<class T>
@@ -260,6 +302,148 @@ GenomicRegionCollection<T>::GenomicRegionCollection(const std::string &file, con
 
 }
 
+template<class T>
+bool GenomicRegionCollection<T>::WriteBinary(const std::string& file, const BamHeader& hdr) const {
+
+  // write the flat index, making it on a (sorted) copy if needed
+  const GenomicRegionCollection<T>* src = this;
+  GenomicRegionCollection<T> tmp;
+  if (m_array->empty() && !m_grv->empty()) {
+    tmp.m_grv->assign(m_grv->begin(), m_grv->end());
+    tmp.m_sorted = m_sorted;
+    tmp.CreateIntervalArrayMap();
+    src = &tmp;
+  }
+
+  // chromosomes in order, so the same collection gives the same file
+  std::vector<int> chrs;
+  for (GenomicIntervalArrayMap::const_iterator it = src->m_array->begin(); it != src->m_array->end(); ++it)
+    chrs.push_back(it->first);
+  std::sort(chrs.begin(), chrs.end());
+
+  _GRCBinaryHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, GRC_BINARY_MAGIC, sizeof(h.magic));
+  h.version = GRC_BINARY_VERSION;
+  h.byte_order = GRC_BINARY_BYTE_ORDER;
+  h.region_size = sizeof(T);
+  h.interval_size = sizeof(GenomicInterval);
+  h.dict_checksum = hdr.SequenceDictionaryChecksum();
+  h.num_regions = src->m_grv->size();
+  h.num_chr = chrs.size();
+
+  // lay out the index blocks after the regions and the chromosome table
+  std::vector<_GRCBinaryChr> table(chrs.size());
+  uint64_t off = grc_binary_align(sizeof(h) + h.num_regions * sizeof(T))
+    + grc_binary_align(table.size() * sizeof(_GRCBinaryChr));
+  for (size_t i = 0; i < chrs.size(); ++i) {
+    const GenomicIntervalArray& a = src->m_array->find(chrs[i])->second;
+    memset(&table[i], 0, sizeof(_GRCBinaryChr));
+    table[i].chr = chrs[i];
+    table[i].num = a.size();
+    table[i].offset = off;
+    off = grc_binary_align(off + a.size() * (sizeof(GenomicInterval) + sizeof(size_t)));
+  }
+
+  FILE* fp = fopen(file.c_str(), "wb");
+  if (!fp) {
+    std::cerr << "Binary region file not writable: " << file << std::endl;
+    return false;
+  }
+
+  static const char zeros[8] = {0};
+  bool ok = fwrite(&h, sizeof(h), 1, fp) == 1;
+  uint64_t pos = sizeof(h);
+  if (h.num_regions)
+    ok = ok && fwrite(&(*src->m_grv)[0], sizeof(T), h.num_regions, fp) == h.num_regions;
+  pos += h.num_regions * sizeof(T);
+  ok = ok && fwrite(zeros, 1, grc_binary_align(pos) - pos, fp) == grc_binary_align(pos) - pos;
+  pos = grc_binary_align(pos);
+  if (!table.empty())
+    ok = ok && fwrite(&table[0], sizeof(_GRCBinaryChr), table.size(), fp) == table.size();
+  pos += table.size() * sizeof(_GRCBinaryChr);
+  for (size_t i = 0; i < chrs.size() && ok; ++i) {
+    ok = fwrite(zeros, 1, table[i].offset - pos, fp) == table[i].offset - pos;
+    const GenomicIntervalArray& a = src->m_array->find(chrs[i])->second;
+    ok = ok && fwrite(a.Data(), sizeof(GenomicInterval), a.size(), fp) == a.size();
+    ok = ok && fwrite(a.MaxStops(), sizeof(size_t), a.size(), fp) == a.size();
+    pos = table[i].offset + a.size() * (sizeof(GenomicInterval) + sizeof(size_t));
+  }
+
+  if (fclose(fp) || !ok) {
+    std::cerr << "Error writing binary region file: " << file << std::endl;
+    return false;
+  }
+  return true;
+}
+
+template<class T>
+bool GenomicRegionCollection<T>::ReadBinary(const std::string& file, const BamHeader& hdr) {
+
+  SeqPointer<MappedFile> map(new MappedFile());
+  if (!map->Open(file))
+    return false;
+
+  const char* d = map->Data();
+  const uint64_t size = map->Size();
+
+  _GRCBinaryHeader h;
+  if (size < sizeof(h)) {
+    std::cerr << "Binary region file is truncated: " << file << std::endl;
+    return false;
+  }
+  memcpy(&h, d, sizeof(h));
+
+  if (memcmp(h.magic, GRC_BINARY_MAGIC, sizeof(h.magic))) {
+    std::cerr << "Not a binary region file: " << file << std::endl;
+    return false;
+  }
+  if (h.version != GRC_BINARY_VERSION || h.byte_order != GRC_BINARY_BYTE_ORDER ||
+      h.region_size != sizeof(T) || h.interval_size != sizeof(GenomicInterval)) {
+    std::cerr << "Binary region file " << file << " was written by a different version of SeqLib, "
+	      << "or on a different platform. Re-make it with WriteBinary" << std::endl;
+    return false;
+  }
+  if (h.dict_checksum != hdr.SequenceDictionaryChecksum()) {
+    std::cerr << "Binary region file " << file << " was made with a different sequence dictionary" << std::endl;
+    return false;
+  }
+
+  // check all of the blocks are inside the file before touching them
+  const uint64_t table_off = grc_binary_align(sizeof(h) + h.num_regions * sizeof(T));
+  if (h.num_regions > size / sizeof(T) || h.num_chr > size / sizeof(_GRCBinaryChr) ||
+      table_off + h.num_chr * sizeof(_GRCBinaryChr) > size) {
+    std::cerr << "Binary region file is truncated: " << file << std::endl;
+    return false;
+  }
+  const _GRCBinaryChr* table = reinterpret_cast<const _GRCBinaryChr*>(d + table_off);
+  const uint64_t entry = sizeof(GenomicInterval) + sizeof(size_t);
+  for (uint64_t i = 0; i < h.num_chr; ++i)
+    if (table[i].offset % 8 || table[i].num > size / entry || table[i].offset > size - table[i].num * entry) {
+      std::cerr << "Binary region file is truncated: " << file << std::endl;
+      return false;
+    }
+
+  clear();
+  m_dynamic = SeqPointer<GenomicIntervalDynamicMap>();
+
+  // regions are copied in one block. The index is used in place
+  const T* regions = reinterpret_cast<const T*>(d + sizeof(h));
+  m_grv->assign(regions, regions + h.num_regions);
+  m_sorted = true;
+
+  for (uint64_t i = 0; i < h.num_chr; ++i) {
+    const char* b = d + table[i].offset;
+    const GenomicInterval* ivals = reinterpret_cast<const GenomicInterval*>(b);
+    const size_t* max_stops = reinterpret_cast<const size_t*>(b + table[i].num * sizeof(GenomicInterval));
+    GenomicIntervalArray a(ivals, max_stops, table[i].num);
+    (*m_array)[table[i].chr].swap(a);
+  }
+
+  m_map = map;
+  return true;
+}
+
 // reduce a set of GenomicRegions into the minium overlapping set (same as GenomicRanges "reduce")
 template <class T>
 void GenomicRegionCollection<T>::MergeOverlappingIntervals() {
@@ -301,6 +485,9 @@ void GenomicRegionCollection<T>::MergeOverlappingIntervals() {
 
   // clear the old interval tree
   m_tree->clear();
+  m_array->clear();
+  m_map = SeqPointer<MappedFile>();
+  m_dynamic = SeqPointer<GenomicIntervalDynamicMap>();
 }
 
 template <class T>
@@ -312,34 +499,203 @@ GenomicRegionVector GenomicRegionCollection<T>::AsGenomicRegionVector() const {
 } 
   
 template <class T>
-void GenomicRegionCollection<T>::CreateTreeMap() {
-
-  if (!m_grv->size())
-    return;
+void GenomicRegionCollection<T>::make_interval_map(GenomicIntervalMap& map) {
 
   // sort the genomic intervals
   if (!m_sorted)
     CoordinateSort();
 
   // loop through and make the intervals for each chromosome
-  GenomicIntervalMap map;
   for (size_t i = 0; i < m_grv->size(); ++i) {
     map[m_grv->at(i).chr].push_back(GenomicInterval(m_grv->at(i).pos1, m_grv->at(i).pos2, i));
   }
+}
+
+template <class T>
+void GenomicRegionCollection<T>::CreateTreeMap() {
+
+  if (!m_grv->size())
+    return;
+
+  GenomicIntervalMap map;
+  make_interval_map(map);
+  m_tree->clear();
+  m_array->clear();
+  m_map = SeqPointer<MappedFile>();
+  m_dynamic = SeqPointer<GenomicIntervalDynamicMap>();
 
   // for each chr, make the tree from the intervals
   //for (auto it : map) {
   for (GenomicIntervalMap::iterator it = map.begin(); it != map.end(); ++it) {
-    GenomicIntervalTreeMap::iterator ff = m_tree->find(it->first);
-    if (ff != m_tree->end())
-      ff->second = GenomicIntervalTree(it->second);
-    else
-      m_tree->insert(std::pair<int, GenomicIntervalTree>(it->first, GenomicIntervalTree(it->second)));
-    //old //m_tree[it.first] = GenomicIntervalTree(it.second);
+    GenomicIntervalTree tree(it->second);
+    (*m_tree)[it->first].swap(tree);
+  }
+
+}
+
+template <class T>
+void GenomicRegionCollection<T>::CreateIntervalArrayMap() {
+
+  if (!m_grv->size())
+    return;
+
+  GenomicIntervalMap map;
+  make_interval_map(map);
+  m_tree->clear();
+  m_array->clear();
+  m_map = SeqPointer<MappedFile>();
+  m_dynamic = SeqPointer<GenomicIntervalDynamicMap>();
+
+  // intervals are moved into the index, so the map is emptied as we go
+  for (GenomicIntervalMap::iterator it = map.begin(); it != map.end(); ++it) {
+    GenomicIntervalArray arr(it->second);
+    (*m_array)[it->first].swap(arr);
+  }
+
+}
+
+template <class T>
+void GenomicRegionCollection<T>::CreateDynamicMap() {
+
+  m_tree->clear();
+  m_array->clear();
+  m_map = SeqPointer<MappedFile>();
+
+  // IDs are the current positions, so no sort
+  GenomicIntervalMap map;
+  for (size_t i = 0; i < m_grv->size(); ++i) 
+    map[m_grv->at(i).chr].push_back(GenomicInterval(m_grv->at(i).pos1, m_grv->at(i).pos2, i));
+
+  m_dynamic = SeqPointer<GenomicIntervalDynamicMap>(new GenomicIntervalDynamicMap());
+  for (GenomicIntervalMap::iterator it = map.begin(); it != map.end(); ++it) {
+    GenomicIntervalDynamicArray d(it->second);
+    (*m_dynamic)[it->first].swap(d);
   }
 
 }
 
+template <class T>
+void GenomicRegionCollection<T>::Erase(size_t i) {
+
+  if (i >= m_grv->size())
+    throw std::out_of_range("GenomicRegionCollection::Erase - index out of range");
+
+  const size_t last = m_grv->size() - 1;
+  if (m_dynamic) {
+    const T& l = (*m_grv)[last];
+    (*m_dynamic)[l.chr].erase(l.pos1, l.pos2, static_cast<int32_t>(last));
+    if (i != last) {
+      const T& g = (*m_grv)[i];
+      (*m_dynamic)[g.chr].erase(g.pos1, g.pos2, static_cast<int32_t>(i));
+      (*m_dynamic)[l.chr].insert(l.pos1, l.pos2, static_cast<int32_t>(i));
+    }
+  }
+
+  if (i != last) {
+    (*m_grv)[i] = (*m_grv)[last];
+    m_sorted = false;
+  }
+  m_grv->pop_back();
+}
+
+#ifdef HAVE_C11
+template <class T>
+void GenomicRegionCollection<T>::CreateTreeMap(ThreadPool tp) {
+
+  if (!m_grv->size())
+    return;
+
+  GenomicIntervalMap map;
+  make_interval_map(map);
+  m_tree->clear();
+  m_array->clear();
+  m_map = SeqPointer<MappedFile>();
+  m_dynamic = SeqPointer<GenomicIntervalDynamicMap>();
+
+  // make all of the (empty) trees first, so the map is not changed
+  // while they are filled in
+  std::vector<GenomicIntervalVector*> ivals;
+  std::vector<GenomicIntervalTree*> trees;
+  for (GenomicIntervalMap::iterator it = map.begin(); it != map.end(); ++it) {
+    ivals.push_back(&it->second);
+    trees.push_back(&(*m_tree)[it->first]);
+  }
+
+  tp.ParallelFor(0, trees.size(), [&](size_t i) {
+      GenomicIntervalTree tree(*ivals[i]);
+      trees[i]->swap(tree);
+    });
+
+}
+
+template <class T>
+void GenomicRegionCollection<T>::CreateIntervalArrayMap(ThreadPool tp) {
+
+  if (!m_grv->size())
+    return;
+
+  GenomicIntervalMap map;
+  make_interval_map(map);
+  m_tree->clear();
+  m_array->clear();
+  m_map = SeqPointer<MappedFile>();
+  m_dynamic = SeqPointer<GenomicIntervalDynamicMap>();
+
+  std::vector<GenomicIntervalVector*> ivals;
+  std::vector<GenomicIntervalArray*> arrs;
+  for (GenomicIntervalMap::iterator it = map.begin(); it != map.end(); ++it) {
+    ivals.push_back(&it->second);
+    arrs.push_back(&(*m_array)[it->first]);
+  }
+
+  tp.ParallelFor(0, arrs.size(), [&](size_t i) {
+      GenomicIntervalArray arr(*ivals[i]);
+      arrs[i]->swap(arr);
+    });
+
+}
+#endif
+
+template <class T>
+void GenomicRegionCollection<T>::find_overlapping(int32_t chr, int32_t pos1, int32_t pos2, GenomicIntervalVector& giv) const {
+
+  if (m_dynamic) {
+    GenomicIntervalDynamicMap::const_iterator ff = m_dynamic->find(chr);
+    if (ff != m_dynamic->end())
+      ff->second.findOverlapping(pos1, pos2, giv);
+    return;
+  }
+
+  if (!m_array->empty()) {
+    GenomicIntervalArrayMap::const_iterator ff = m_array->find(chr);
+    if (ff != m_array->end())
+      ff->second.findOverlapping(pos1, pos2, giv);
+    return;
+  }
+
+  GenomicIntervalTreeMap::const_iterator ff = m_tree->find(chr);
+  if (ff != m_tree->end())
+    ff->second.findOverlapping(pos1, pos2, giv);
+}
+
+template <class T>
+template <class F>
+bool GenomicRegionCollection<T>::visit_overlapping(int32_t chr, int32_t pos1, int32_t pos2, F& f) const {
+
+  if (m_dynamic) {
+    GenomicIntervalDynamicMap::const_iterator ff = m_dynamic->find(chr);
+    return ff == m_dynamic->end() || ff->second.visitOverlapping(pos1, pos2, f);
+  }
+
+  if (!m_array->empty()) {
+    GenomicIntervalArrayMap::const_iterator ff = m_array->find(chr);
+    return ff == m_array->end() || ff->second.visitOverlapping(pos1, pos2, f);
+  }
+
+  GenomicIntervalTreeMap::const_iterator ff = m_tree->find(chr);
+  return ff == m_tree->end() || ff->second.visitOverlapping(pos1, pos2, f);
+}
+
 template<class T>
 int GenomicRegionCollection<T>::TotalWidth() const { 
   int wid = 0; 
@@ -395,19 +751,15 @@ GenomicRegionCollection<T>::GenomicRegionCollection(int width, int ovlp, const T
 template<class T>
 size_t GenomicRegionCollection<T>::CountOverlaps(const T &gr) const {
 
-  if (m_tree->size() == 0 && m_grv->size() != 0) 
+  if (missing_index())
     {
       std::cerr << "!!!!!! WARNING: Trying to find overlaps on empty tree. Need to run this->createTreeMap() somewhere " << std::endl;
       return 0;
     }
 
-  GenomicIntervalVector giv;
-
-  GenomicIntervalTreeMap::const_iterator ff = m_tree->find(gr.chr);
-  if (ff == m_tree->end())
-    return 0;
-  ff->second.findOverlapping(gr.pos1, gr.pos2, giv);
-  return (giv.size());
+  _OverlapCounter c;
+  visit_overlapping(gr.chr, gr.pos1, gr.pos2, c);
+  return c.count;
 }
 
   template<class T>
@@ -418,20 +770,15 @@ size_t GenomicRegionCollection<T>::CountOverlaps(const T &gr) const {
     if (gr1.chr != gr2.chr)
       return false;
     
-    if (m_tree->size() == 0 && m_grv->size() != 0) {
+    if (missing_index()) {
       std::cerr << "!!!!!! WARNING: Trying to find overlaps on empty tree. Need to run this->createTreeMap() somewhere " << std::endl;
       return false;
     }
     
-    GenomicIntervalTreeMap::const_iterator ff1 = m_tree->find(gr1.chr);
-    GenomicIntervalTreeMap::const_iterator ff2 = m_tree->find(gr2.chr);
-  if (ff1 == m_tree->end() || ff2 == m_tree->end())
-    return false;
-
   // do the interval tree query
    GenomicIntervalVector giv1, giv2;
-   ff1->second.findOverlapping(gr1.pos1, gr1.pos2, giv1);
-   ff2->second.findOverlapping(gr2.pos1, gr2.pos2, giv2);
+   find_overlapping(gr1.chr, gr1.pos1, gr1.pos2, giv1);
+   find_overlapping(gr2.chr, gr2.pos1, gr2.pos2, giv2);
 
    if (!giv1.size() || !giv2.size())
      return false;
@@ -476,6 +823,13 @@ void GenomicRegionCollection<T>::Concat(const GenomicRegionCollection<T>& g)
   if (!g.size())
     return;
   m_sorted = false;
+  // g may be this collection, so add by index
+  const size_t n = g.size();
+  if (m_dynamic) {
+    for (size_t i = 0; i < n; ++i)
+      add((*g.m_grv)[i]);
+    return;
+  }
   m_grv->insert(m_grv->end(), g.m_grv->begin(), g.m_grv->end());
 }
 
@@ -495,6 +849,7 @@ void GenomicRegionCollection<T>::allocate_grc() {
   m_sorted = false;
   m_grv =  SeqPointer<std::vector<T> >(new std::vector<T>()) ;
   m_tree = SeqPointer<GenomicIntervalTreeMap>(new GenomicIntervalTreeMap()) ;
+  m_array = SeqPointer<GenomicIntervalArrayMap>(new GenomicIntervalArrayMap()) ;
 }
 
 template<class T>
@@ -523,27 +878,42 @@ template<class T>
 template<class K>
 std::vector<int> GenomicRegionCollection<T>::FindOverlappedIntervals(const K& gr, bool ignore_strand) const {  
 
-  if (m_tree->size() == 0 && m_grv->size() != 0) 
-    throw std::logic_error("Need to run CreateTreeMap to make the interval tree before doing range queries");
-  
-  // which chr (if any) are common between query and subject
-  GenomicIntervalTreeMap::const_iterator ff = m_tree->find(gr.chr);
-
   std::vector<int> output;  
+  FindOverlappedIntervals(gr, output, ignore_strand);
+  return output;
 
-  //must as least share a chromosome  
-  if (ff == m_tree->end())
-    return output;
+}
 
-  // get the subject hits
-  GenomicIntervalVector giv;
-  ff->second.findOverlapping(gr.pos1, gr.pos2, giv);
+template<class T>
+template<class K>
+size_t GenomicRegionCollection<T>::FindOverlappedIntervals(const K& gr, std::vector<int>& ids, bool ignore_strand) const {  
 
-  for (GenomicIntervalVector::const_iterator i = giv.begin(); i != giv.end(); ++i)
-    if (ignore_strand || m_grv->at(i->value).strand == gr.strand) 
-      output.push_back(i->value);
+  ids.clear();
+  _OverlapIDs v(ids);
+  VisitOverlaps(gr, v, ignore_strand);
+  return ids.size();
 
-  return output;
+}
+
+template<class T>
+template<class K, class F>
+bool GenomicRegionCollection<T>::VisitOverlaps(const K& gr, F& f, bool ignore_strand) const {  
+
+  if (missing_index()) 
+    throw std::logic_error("Need to run CreateTreeMap to make the interval tree before doing range queries");
+
+  _OverlapVisitor<T, F> v(*m_grv, f, gr.strand, ignore_strand);
+  return visit_overlapping(gr.chr, gr.pos1, gr.pos2, v);
+
+}
+
+template<class T>
+template<class K>
+bool GenomicRegionCollection<T>::AnyOverlap(const K& gr, bool ignore_strand) const {  
+
+  _OverlapFound v;
+  VisitOverlaps(gr, v, ignore_strand);
+  return v.found;
 
 }
 
@@ -573,24 +943,14 @@ GenomicRegionCollection<GenomicRegion> GenomicRegionCollection<T>::FindOverlaps(
 
   GenomicRegionCollection<GenomicRegion> output;
 
-  if (m_tree->size() == 0 && m_grv->size() != 0) 
+  if (missing_index()) 
     throw std::logic_error("Need to run CreateTreeMap to make the interval tree before doing range queries");
   
-  // which chr (if any) are common between query and subject
-  GenomicIntervalTreeMap::const_iterator ff = m_tree->find(gr.chr);
-
-  //must as least share a chromosome  
-  if (ff == m_tree->end())
-    return output;
-
   // get the subject hits
   GenomicIntervalVector giv;
-  ff->second.findOverlapping(gr.pos1, gr.pos2, giv);
+  find_overlapping(gr.chr, gr.pos1, gr.pos2, giv);
   
 #ifdef DEBUG_OVERLAPS
-  std::cerr << "ff->second.intervals.size() " << ff->second.intervals.size() << std::endl;
-  for (auto& k : ff->second.intervals)
-    std::cerr << " intervals " << k.start << " to " << k.stop << " value " << k.value << std::endl;
   std::cerr << "GIV NUMBER OF HITS " << giv.size() << " for query " << gr << std::endl;
 #endif
 
@@ -616,7 +976,14 @@ GenomicRegionCollection<GenomicRegion> GenomicRegionCollection<T>::FindOverlaps(
 {  
 
   GenomicRegionCollection<GenomicRegion> output;
-  if (subject.NumTree() == 0 && subject.size() != 0) {
+
+  // both sorted, so can sweep through without the tree
+  if (is_start_sorted() && subject.is_start_sorted()) {
+    sweep_overlaps(subject, 0, m_grv->size(), query_id, subject_id, output, ignore_strand);
+    return output;
+  }
+
+  if (subject.missing_index()) {
     std::cerr << "!!!!!! findOverlaps: WARNING: Trying to find overlaps on empty tree. Need to run this->createTreeMap() somewhere " << std::endl;
     return output;
   }
@@ -631,48 +998,161 @@ GenomicRegionCollection<GenomicRegion> GenomicRegionCollection<T>::FindOverlaps(
     std::cerr << i << std::endl;
 #endif
 
+  tree_overlaps(subject, 0, m_grv->size(), query_id, subject_id, output, ignore_strand);
+  return output;
+  
+}
+
+#ifdef HAVE_C11
+  // this is query
+  template<class T>
+  template<class K>
+GenomicRegionCollection<GenomicRegion> GenomicRegionCollection<T>::FindOverlaps(const GenomicRegionCollection<K>& subject, std::vector<int32_t>& query_id, std::vector<int32_t>& subject_id, bool ignore_strand, ThreadPool tp) const
+{  
+
+  GenomicRegionCollection<GenomicRegion> output;
+
+  bool sweep = is_start_sorted() && subject.is_start_sorted();
+  if (!sweep && subject.missing_index()) {
+    std::cerr << "!!!!!! findOverlaps: WARNING: Trying to find overlaps on empty tree. Need to run this->createTreeMap() somewhere " << std::endl;
+    return output;
+  }
+
+  // cut the queries into pieces. The sweep starts over at each
+  // chromosome, so for that only cut between chromosomes
+  const size_t n = m_grv->size();
+  const size_t step = std::max<size_t>(1, n / (tp.nthreads * 4));
+  std::vector<size_t> cuts(1, 0);
+  while (cuts.back() < n) {
+    size_t c = std::min(n, cuts.back() + step);
+    if (sweep)
+      while (c < n && (*m_grv)[c].chr == (*m_grv)[c-1].chr)
+	++c;
+    cuts.push_back(c);
+  }
+
+  const size_t nchunks = cuts.size() - 1;
+  std::vector<std::vector<int32_t> > qids(nchunks), sids(nchunks);
+  std::vector<GenomicRegionCollection<GenomicRegion> > outs(nchunks);
+  tp.ParallelFor(0, nchunks, [&](size_t c) {
+      if (sweep)
+	sweep_overlaps(subject, cuts[c], cuts[c+1], qids[c], sids[c], outs[c], ignore_strand);
+      else
+	tree_overlaps(subject, cuts[c], cuts[c+1], qids[c], sids[c], outs[c], ignore_strand);
+    });
+
+  // put back together in query order
+  for (size_t c = 0; c < nchunks; ++c) {
+    query_id.insert(query_id.end(), qids[c].begin(), qids[c].end());
+    subject_id.insert(subject_id.end(), sids[c].begin(), sids[c].end());
+    output.Concat(outs[c]);
+  }
+
+  return output;
+  
+}
+#endif
+
+  template<class T>
+  template<class K>
+void GenomicRegionCollection<T>::tree_overlaps(const GenomicRegionCollection<K>& subject, size_t begin, size_t end, std::vector<int32_t>& query_id, std::vector<int32_t>& subject_id, GenomicRegionCollection<GenomicRegion>& output, bool ignore_strand) const
+{
+
+  GenomicIntervalVector giv;
+
   // loop through the query GRanges (this) and overlap with subject
-  for (size_t i = 0; i < m_grv->size(); ++i) 
+  for (size_t i = begin; i < end; ++i) 
     {
-      // which chr (if any) are common between query and subject
-      GenomicIntervalTreeMap::const_iterator ff = subject.GetTree()->find(m_grv->at(i).chr);
-
-      GenomicIntervalVector giv;
+      giv.clear();
 
 #ifdef DEBUG_OVERLAPS
       std::cerr << "TRYING OVERLAP ON QUERY " << m_grv->at(i) << std::endl;
 #endif
-      //must as least share a chromosome
-      if (ff != m_tree->end())
-	{
-	  // get the subject hits
-	  ff->second.findOverlapping(m_grv->at(i).pos1, m_grv->at(i).pos2, giv);
+      // get the subject hits
+      subject.find_overlapping(m_grv->at(i).chr, m_grv->at(i).pos1, m_grv->at(i).pos2, giv);
 
 #ifdef DEBUG_OVERLAPS
-	  std::cerr << "ff->second.intervals.size() " << ff->second.intervals.size() << std::endl;
-	  for (auto& k : ff->second.intervals)
-	    std::cerr << " intervals " << k.start << " to " << k.stop << " value " << k.value << std::endl;
-	  std::cerr << "GIV NUMBER OF HITS " << giv.size() << " for query " << m_grv->at(i) << std::endl;
+      std::cerr << "GIV NUMBER OF HITS " << giv.size() << " for query " << m_grv->at(i) << std::endl;
 #endif
-	  // loop through the hits and define the GenomicRegion
-	  for (GenomicIntervalVector::const_iterator j = giv.begin(); j != giv.end(); ++j) {
-	    //for (auto& j : giv) { // giv points to positions on subject
-	    if (ignore_strand || (subject.at(j->value).strand == m_grv->at(i).strand) ) {
-	      query_id.push_back(i);
-	      subject_id.push_back(j->value);
+      // loop through the hits and define the GenomicRegion
+      for (GenomicIntervalVector::const_iterator j = giv.begin(); j != giv.end(); ++j) {
+	//for (auto& j : giv) { // giv points to positions on subject
+	if (ignore_strand || (subject.at(j->value).strand == m_grv->at(i).strand) ) {
+	  query_id.push_back(i);
+	  subject_id.push_back(j->value);
 #ifdef DEBUG_OVERLAPS
-	      std::cerr << "find overlaps hit " << j->start << " " << j->stop << " -- " << j->value << std::endl;
+	  std::cerr << "find overlaps hit " << j->start << " " << j->stop << " -- " << j->value << std::endl;
 #endif
-	      output.add(GenomicRegion(m_grv->at(i).chr, std::max(static_cast<int32_t>(j->start), m_grv->at(i).pos1), std::min(static_cast<int32_t>(j->stop), m_grv->at(i).pos2)));
-	    }
-	  }
+	  output.add(GenomicRegion(m_grv->at(i).chr, std::max(static_cast<int32_t>(j->start), m_grv->at(i).pos1), std::min(static_cast<int32_t>(j->stop), m_grv->at(i).pos2)));
 	}
+      }
     }
 
-  return output;
-  
 }
 
+template<class T>
+bool GenomicRegionCollection<T>::is_start_sorted() const {
+  for (size_t i = 1; i < m_grv->size(); ++i) {
+    const T& a = (*m_grv)[i-1];
+    const T& b = (*m_grv)[i];
+    if (b.chr < a.chr || (b.chr == a.chr && b.pos1 < a.pos1))
+      return false;
+  }
+  return true;
+}
+
+  // this is query
+  template<class T>
+  template<class K>
+void GenomicRegionCollection<T>::sweep_overlaps(const GenomicRegionCollection<K>& subject, size_t begin, size_t end, std::vector<int32_t>& query_id, std::vector<int32_t>& subject_id, GenomicRegionCollection<GenomicRegion>& output, bool ignore_strand) const
+{
+
+  // subjects that started before the end of a query, and may still
+  // overlap the next one. Held in subject order
+  std::vector<size_t> active;
+  size_t next = 0; // next subject to become active
+  int32_t chr = -1;
+
+  for (size_t i = begin; i < end; ++i) {
+
+    const T& q = (*m_grv)[i];
+
+    // new chromosome, so start over from its first subject
+    if (i == begin || q.chr != chr) {
+      chr = q.chr;
+      active.clear();
+      size_t lo = next, hi = subject.size();
+      while (lo < hi) {
+	size_t mid = lo + (hi - lo) / 2;
+	if (subject[mid].chr < chr)
+	  lo = mid + 1;
+	else
+	  hi = mid;
+      }
+      next = lo;
+    }
+
+    while (next < subject.size() && subject[next].chr == chr && subject[next].pos1 <= q.pos2)
+      active.push_back(next++);
+
+    // drop subjects that end before this query, as all later queries start after it.
+    // Report the rest that overlap
+    size_t keep = 0;
+    for (size_t j = 0; j < active.size(); ++j) {
+      const K& sub = subject[active[j]];
+      if (sub.pos2 < q.pos1)
+	continue;
+      active[keep++] = active[j];
+      if (sub.pos1 <= q.pos2 && (ignore_strand || sub.strand == q.strand)) {
+	query_id.push_back(i);
+	subject_id.push_back(active[j]);
+	output.add(GenomicRegion(q.chr, std::max(sub.pos1, q.pos1), std::min(sub.pos2, q.pos2)));
+      }
+    }
+    active.resize(keep);
+  }
+
+}
 
 template<class T>
 GenomicRegionCollection<T>::GenomicRegionCollection(const T& gr)
@@ -696,12 +1176,217 @@ GRC GenomicRegionCollection<T>::Intersection(const GenomicRegionCollection<K>& s
   return out;
 }
 
+// add a region to the end of sorted, merged regions, merging it with the last one if they overlap
+inline void grc_append_merged(GenomicRegionVector& out, int32_t chr, int32_t pos1, int32_t pos2) {
+  if (!out.empty() && out.back().chr == chr && out.back().pos2 >= pos1) {
+    out.back().pos2 = std::max(out.back().pos2, pos2);
+    return;
+  }
+  out.push_back(GenomicRegion(chr, pos1, pos2));
+}
+
+// true if a comes before b, by chromosome then start
+inline bool grc_start_before(const GenomicRegion& a, const GenomicRegion& b) {
+  return a.chr < b.chr || (a.chr == b.chr && a.pos1 < b.pos1);
+}
+
+template<class T>
+void GenomicRegionCollection<T>::reduced(GenomicRegionVector& out) const
+{
+  out.clear();
+  out.reserve(m_grv->size());
+
+  if (is_start_sorted()) {
+    for (typename std::vector<T>::const_iterator i = m_grv->begin(); i != m_grv->end(); ++i)
+      grc_append_merged(out, i->chr, i->pos1, i->pos2);
+    return;
+  }
+
+  GenomicRegionVector sorted = AsGenomicRegionVector();
+  std::sort(sorted.begin(), sorted.end());
+  for (GenomicRegionVector::const_iterator i = sorted.begin(); i != sorted.end(); ++i)
+    grc_append_merged(out, i->chr, i->pos1, i->pos2);
+}
+
+template<class T>
+template<class K>
+GRC GenomicRegionCollection<T>::SetUnion(const GenomicRegionCollection<K>& other) const
+{
+  GenomicRegionVector a, b, u;
+  reduced(a);
+  other.reduced(b);
+  u.reserve(a.size() + b.size());
+
+  size_t i = 0, j = 0;
+  while (i < a.size() || j < b.size()) {
+    const GenomicRegion& r = (j == b.size() || (i < a.size() && !grc_start_before(b[j], a[i]))) ? a[i++] : b[j++];
+    grc_append_merged(u, r.chr, r.pos1, r.pos2);
+  }
+
+  GRC out;
+  out.m_grv->swap(u);
+  return out;
+}
+
+template<class T>
+template<class K>
+GRC GenomicRegionCollection<T>::SetIntersection(const GenomicRegionCollection<K>& other) const
+{
+  GenomicRegionVector a, b, x;
+  reduced(a);
+  other.reduced(b);
+
+  size_t i = 0, j = 0;
+  while (i < a.size() && j < b.size()) {
+    if (a[i].chr == b[j].chr) {
+      int32_t lo = std::max(a[i].pos1, b[j].pos1);
+      int32_t hi = std::min(a[i].pos2, b[j].pos2);
+      if (lo <= hi)
+	grc_append_merged(x, a[i].chr, lo, hi);
+    }
+    // drop whichever ends first, as it can't overlap anything else
+    if (a[i].chr < b[j].chr || (a[i].chr == b[j].chr && a[i].pos2 < b[j].pos2))
+      ++i;
+    else
+      ++j;
+  }
+
+  GRC out;
+  out.m_grv->swap(x);
+  return out;
+}
+
+template<class T>
+template<class K>
+GRC GenomicRegionCollection<T>::SetDifference(const GenomicRegionCollection<K>& other) const
+{
+  GenomicRegionVector a, b, d;
+  reduced(a);
+  other.reduced(b);
+  d.reserve(a.size());
+
+  size_t j = 0;
+  for (GenomicRegionVector::const_iterator i = a.begin(); i != a.end(); ++i) {
+
+    // skip removed regions that end before this one. The last one
+    // checked may also cover the next region, so is kept
+    while (j < b.size() && (b[j].chr < i->chr || (b[j].chr == i->chr && b[j].pos2 < i->pos1)))
+      ++j;
+
+    int32_t cur = i->pos1;
+    for (size_t k = j; k < b.size() && b[k].chr == i->chr && b[k].pos1 <= i->pos2; ++k) {
+      if (b[k].pos1 > cur)
+	d.push_back(GenomicRegion(i->chr, cur, b[k].pos1 - 1));
+      cur = std::max(cur, b[k].pos2 + 1);
+    }
+    if (cur <= i->pos2)
+      d.push_back(GenomicRegion(i->chr, cur, i->pos2));
+  }
+
+  GRC out;
+  out.m_grv->swap(d);
+  return out;
+}
+
+template<class T>
+GRC GenomicRegionCollection<T>::Complement(const HeaderSequenceVector& h) const
+{
+  GenomicRegionVector a, c;
+  reduced(a);
+
+  size_t i = 0;
+  for (size_t chr = 0; chr < h.size(); ++chr) {
+
+    while (i < a.size() && a[i].chr < static_cast<int32_t>(chr))
+      ++i;
+
+    int32_t cur = 0;
+    const int32_t len = h[chr].Length;
+    for (; i < a.size() && a[i].chr == static_cast<int32_t>(chr); ++i) {
+      if (a[i].pos1 > cur)
+	c.push_back(GenomicRegion(chr, cur, std::min(a[i].pos1 - 1, len)));
+      cur = std::max(cur, a[i].pos2 + 1);
+      if (cur > len)
+	break;
+    }
+    if (cur <= len)
+      c.push_back(GenomicRegion(chr, cur, len));
+  }
+
+  GRC out;
+  out.m_grv->swap(c);
+  return out;
+}
+
+template<class T>
+GRC GenomicRegionCollection<T>::Complement(const BamHeader& h) const
+{
+  return Complement(h.GetHeaderSequenceVector());
+}
+
+// add a run of constant depth, joining it to the last run if they touch and have the same depth
+inline void grc_append_depth(GenomicRegionVector& out, std::vector<int32_t>& depth, int32_t chr, int32_t pos1, int32_t pos2, int32_t d) {
+  if (!d || pos1 > pos2)
+    return;
+  if (!out.empty() && out.back().chr == chr && out.back().pos2 + 1 == pos1 && depth.back() == d) {
+    out.back().pos2 = pos2;
+    return;
+  }
+  out.push_back(GenomicRegion(chr, pos1, pos2));
+  depth.push_back(d);
+}
+
+template<class T>
+GRC GenomicRegionCollection<T>::CoverageDepth(std::vector<int32_t>& depth) const
+{
+  depth.clear();
+
+  GenomicRegionVector sorted = AsGenomicRegionVector();
+  if (!is_start_sorted())
+    std::sort(sorted.begin(), sorted.end());
+
+  GenomicRegionVector runs;
+
+  // ends of the regions covering the current base, smallest first
+  std::priority_queue<int32_t, std::vector<int32_t>, std::greater<int32_t> > ends;
+  int32_t d = 0;
+  int32_t cur = 0; // start of the current run
+  int32_t chr = -1;
+
+  for (size_t i = 0; i <= sorted.size(); ++i) {
+
+    // close runs up to the start of the next region (or all of them, on a new chromosome)
+    const bool flush = i == sorted.size() || sorted[i].chr != chr;
+    while (!ends.empty() && (flush || ends.top() < sorted[i].pos1)) {
+      int32_t e = ends.top();
+      grc_append_depth(runs, depth, chr, cur, e, d);
+      for (; !ends.empty() && ends.top() == e; ends.pop())
+	--d;
+      cur = e + 1;
+    }
+    if (i == sorted.size())
+      break;
+
+    chr = sorted[i].chr;
+    grc_append_depth(runs, depth, chr, cur, sorted[i].pos1 - 1, d);
+    cur = sorted[i].pos1;
+    ends.push(sorted[i].pos2);
+    ++d;
+  }
+
+  GRC out;
+  out.m_grv->swap(runs);
+  return out;
+}
+
 template<class T>
 void GenomicRegionCollection<T>::Pad(int v)
 {
   //for (auto& i : *m_grv)
   for (typename std::vector<T>::iterator i = m_grv->begin(); i != m_grv->end(); ++i)
     i->Pad(v);
+  if (m_dynamic)
+    CreateDynamicMap();
 }
 
 }
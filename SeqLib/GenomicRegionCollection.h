@@ -5,8 +5,13 @@
 #include <string>
 #include <cstdlib>
 #include <list>
+#include <limits>
 
 #include "SeqLib/IntervalTree.h"
+#include "SeqLib/IntervalArray.h"
+#include "SeqLib/DynamicIntervalArray.h"
+#include "SeqLib/ThreadPool.h"
+#include "SeqLib/MappedFile.h"
 #include "SeqLib/GenomicRegionCollection.h"
 #include "SeqLib/BamRecord.h"
 
@@ -22,6 +27,132 @@ typedef SeqHashMap<int, std::vector<GenomicInterval> > GenomicIntervalMap;
 typedef TIntervalTree<int32_t> GenomicIntervalTree;
 typedef SeqHashMap<int, GenomicIntervalTree> GenomicIntervalTreeMap;
 typedef std::vector<GenomicInterval> GenomicIntervalVector;
+typedef TIntervalArray<int32_t> GenomicIntervalArray;
+typedef SeqHashMap<int, GenomicIntervalArray> GenomicIntervalArrayMap;
+typedef TDynamicIntervalArray<int32_t> GenomicIntervalDynamicArray;
+typedef SeqHashMap<int, GenomicIntervalDynamicArray> GenomicIntervalDynamicMap;
+
+  // passes the index of each hit on to a visitor, skipping other strands
+  template<class T, class F>
+  struct _OverlapVisitor {
+  _OverlapVisitor(const std::vector<T>& g, F& func, char s, bool ignore)
+  : grv(g), f(func), strand(s), ignore_strand(ignore) {}
+    bool operator()(const GenomicInterval& iv) {
+      if (!ignore_strand && grv[iv.value].strand != strand)
+	return true;
+      return f(static_cast<size_t>(iv.value));
+    }
+    const std::vector<T>& grv;
+    F& f;
+    char strand;
+    bool ignore_strand;
+  };
+
+  // visitors for the overlap queries
+  struct _OverlapCounter {
+  _OverlapCounter() : count(0) {}
+    bool operator()(size_t) { ++count; return true; }
+    bool operator()(const GenomicInterval&) { ++count; return true; }
+    size_t count;
+  };
+
+  struct _OverlapFound {
+  _OverlapFound() : found(false) {}
+    bool operator()(size_t) { found = true; return false; }
+    bool found;
+  };
+
+  struct _OverlapIDs {
+  _OverlapIDs(std::vector<int>& v) : ids(v) {}
+    bool operator()(size_t i) { ids.push_back(i); return true; }
+    std::vector<int>& ids;
+  };
+
+  // format of the files from GenomicRegionCollection::WriteBinary
+#define GRC_BINARY_MAGIC "SLGRCBIN"
+#define GRC_BINARY_VERSION 1
+#define GRC_BINARY_BYTE_ORDER 0x01020304
+
+  // start of the file, followed by the regions, the chromosome table and
+  // the index of each chromosome. Blocks start on 8-byte boundaries
+  struct _GRCBinaryHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;      // written as GRC_BINARY_BYTE_ORDER, to catch endian mismatch
+    uint32_t region_size;     // sizeof(T)
+    uint32_t interval_size;   // sizeof(GenomicInterval)
+    uint64_t dict_checksum;   // BamHeader::SequenceDictionaryChecksum
+    uint64_t num_regions;
+    uint64_t num_chr;
+  };
+
+  // one chromosome of the index: num intervals then num max stops, at offset
+  struct _GRCBinaryChr {
+    int32_t chr;
+    uint32_t pad;
+    uint64_t num;
+    uint64_t offset;
+  };
+
+  inline uint64_t grc_binary_align(uint64_t x) { return (x + 7) & ~static_cast<uint64_t>(7); }
+
+  class TabixRegionCollection;
+
+  // chromosome IDs for names read from a text file. IDs are the same
+  // as from the GenomicRegion string constructor, but that is only
+  // called once per name
+  class _ChrNameCache {
+  public:
+  _ChrNameCache(const BamHeader& h) : hdr(h), last_id(-1) {}
+
+    // throws as the GenomicRegion constructor does, if the name can't be converted
+    int ID(const char* s, const char* e) {
+      if (static_cast<size_t>(e - s) == last.size() && !last.compare(0, last.size(), s, e - s))
+	return last_id;
+      std::string name(s, e);
+      SeqHashMap<std::string, int>::const_iterator ff = ids.find(name);
+      int id = ff != ids.end() ? ff->second : GenomicRegion(name, "0", "0", hdr).chr;
+      ids[name] = id;
+      last.swap(name);
+      last_id = id;
+      return id;
+    }
+
+  private:
+    const BamHeader& hdr;
+    SeqHashMap<std::string, int> ids;
+    std::string last;
+    int last_id;
+  };
+
+  // find the next tab or space separated field in [p, e), and move p past it
+  inline bool grc_next_field(const char*& p, const char* e, const char*& fs, const char*& fe) {
+    while (p < e && (*p == '\t' || *p == ' ' || *p == '\r'))
+      ++p;
+    if (p == e)
+      return false;
+    fs = p;
+    while (p < e && *p != '\t' && *p != ' ' && *p != '\r')
+      ++p;
+    fe = p;
+    return true;
+  }
+
+  // parse a leading integer, ignoring anything after it (as std::stoi)
+  inline int32_t grc_parse_int(const char* s, const char* e) {
+    bool neg = s < e && *s == '-';
+    if (s < e && (*s == '-' || *s == '+'))
+      ++s;
+    if (s == e || *s < '0' || *s > '9')
+      throw std::invalid_argument("GenomicRegionCollection - Could not parse position " + std::string(s, e));
+    int64_t v = 0;
+    for (; s < e && *s >= '0' && *s <= '9'; ++s) {
+      v = v * 10 + (*s - '0');
+      if (v > static_cast<int64_t>(std::numeric_limits<int32_t>::max()) + neg)
+	throw std::out_of_range("GenomicRegionCollection - Position is too large");
+    }
+    return static_cast<int32_t>(neg ? -v : v);
+  }
 
   /** @brief Template class to store / query a collection of genomic intervals
    *
@@ -32,6 +163,11 @@ typedef std::vector<GenomicInterval> GenomicIntervalVector;
 template<typename T=GenomicRegion>
 class GenomicRegionCollection {
 
+  template<typename> friend class GenomicRegionCollection;
+
+  // reads windows of a text file with the same line parsers
+  friend class TabixRegionCollection;
+
  public:
 
   /** Construct an empty GenomicRegionCollection 
@@ -87,12 +223,56 @@ class GenomicRegionCollection {
    */
    bool ReadBED(const std::string &file, const SeqLib::BamHeader& hdr);
 
+  /** Read in a BED file, decompressing it on a thread pool
+   *
+   * Same as ReadBED(file, hdr), but BGZF blocks of a bgzipped file are
+   * decompressed on tp while this thread parses.
+   * @param tp Pool to decompress on
+   */
+   bool ReadBED(const std::string &file, const SeqLib::BamHeader& hdr, ThreadPool tp);
+
   /** Read in a VCF file and adds to GenomicRegionCollection object
    * @param file Path to VCF file. All elements will be width = 1 (just read start point)
    * @param hdr Dictionary for converting chromosome strings in BED file to chr indicies
    */
   bool ReadVCF(const std::string &file, const SeqLib::BamHeader& hdr);
 
+  /** Read in a VCF file, decompressing it on a thread pool
+   *
+   * Same as ReadVCF(file, hdr), but BGZF blocks of a bgzipped file are
+   * decompressed on tp while this thread parses.
+   * @param tp Pool to decompress on
+   */
+  bool ReadVCF(const std::string &file, const SeqLib::BamHeader& hdr, ThreadPool tp);
+
+  /** Write the collection and its flat interval index to a binary file
+   *
+   * The file can be loaded with ReadBinary with no parsing and no
+   * rebuilding of the index, which is much faster than ReadBED and
+   * CreateTreeMap for a large annotation that is loaded at each run.
+   * The index from CreateIntervalArrayMap is written if it has been made,
+   * otherwise one is made on a sorted copy. The file is for the machine
+   * (and SeqLib version) that wrote it, and stores a checksum of hdr.
+   * @param file Path to write to
+   * @param hdr Dictionary that the chromosome IDs of the regions refer to
+   * @return False if the file could not be written
+   * @note T is written as raw bytes, so must not hold pointers (e.g. a std::string member)
+   */
+  bool WriteBinary(const std::string& file, const BamHeader& hdr) const;
+
+  /** Load a collection written by WriteBinary, replacing the current contents
+   *
+   * The file is memory mapped, and its index is queried in place, so the
+   * collection is ready for overlap queries with no call to CreateTreeMap.
+   * The regions are copied out of the map in one block. The map is
+   * released when the last copy of this collection is destroyed or cleared.
+   * @param file Path to a file from WriteBinary
+   * @param hdr Dictionary to check against the one the file was written with
+   * @return False if the file can't be read, is from a different version or platform,
+   * or hdr has a different sequence dictionary. The collection is unchanged on failure.
+   */
+  bool ReadBinary(const std::string& file, const BamHeader& hdr);
+
   /** Shuffle the order of the intervals */
  void Shuffle();
 
@@ -115,6 +295,43 @@ class GenomicRegionCollection {
    * defined by the genomic interval, with cargo set at the same GenomicRegion object.
    */
   void CreateTreeMap();
+
+  /** Create a flat interval index (one per chromosome), in place of the interval trees
+   *
+   * Gives the same results as CreateTreeMap for all of the overlap queries,
+   * but stores each chromosome as a single sorted array (see TIntervalArray),
+   * which is faster to build and query and uses less memory for large
+   * collections (e.g. millions of sites). Replaces any tree map already made.
+   */
+  void CreateIntervalArrayMap();
+
+  /** Create an index that is kept up to date as regions are added and erased
+   *
+   * Unlike CreateTreeMap, the collection is not sorted, so the IDs
+   * returned by the queries are simply positions in the collection, and
+   * add, Concat and Erase update the index (amortized O(log n) per region,
+   * see TDynamicIntervalArray) with no rebuild. Pad, CoordinateSort and
+   * Shuffle remake it. Other changes (e.g. through operator[]) need
+   * another call to CreateDynamicMap. Replaces any other index, and is
+   * itself replaced by CreateTreeMap or CreateIntervalArrayMap.
+   */
+  void CreateDynamicMap();
+
+#ifdef HAVE_C11
+  /** Create the set of interval trees, building the chromosomes in parallel
+   *
+   * Same result as CreateTreeMap()
+   * @param tp Pool to build on
+   */
+  void CreateTreeMap(ThreadPool tp);
+
+  /** Create the flat interval index, building the chromosomes in parallel
+   *
+   * Same result as CreateIntervalArrayMap()
+   * @param tp Pool to build on
+   */
+  void CreateIntervalArrayMap(ThreadPool tp);
+#endif
   
   /** Reduces the GenomicRegion objects to minimal set by merging overlapping intervals
    * @note This will merge intervals that touch. eg [4,6] and [6,8]
@@ -127,8 +344,23 @@ class GenomicRegionCollection {
   size_t size() const { return m_grv->size(); }
 
   /** Add a new GenomicRegion (or child of) to end
+   *
+   * If CreateDynamicMap has been called, it is also added to the index,
+   * with an ID of size() - 1.
    */
- void add(const T& g) { m_grv->push_back(g); /*createTreeMap();*/ }
+ void add(const T& g) { 
+   m_grv->push_back(g); /*createTreeMap();*/ 
+   if (m_dynamic)
+     (*m_dynamic)[g.chr].insert(g.pos1, g.pos2, static_cast<int32_t>(m_grv->size() - 1));
+ }
+
+ /** Remove the i'th GenomicRegion, moving the last one into its place
+  *
+  * If CreateDynamicMap has been called, the index is updated, and
+  * the last region takes the ID i.
+  * @exception Throws an out_of_range if i >= size()
+  */
+ void Erase(size_t i);
 
   /** Is this object empty?
    */
@@ -138,11 +370,16 @@ class GenomicRegionCollection {
    */
   void clear() { m_grv->clear(); 
 		 m_tree->clear(); 
+		 m_array->clear();
+		 if (m_dynamic)
+		   m_dynamic->clear();
+		 m_map = SeqPointer<MappedFile>();
 		 idx = 0;
   }
 
- /** Get the number of trees (eg number of chromosomes, each with own tree */
- int NumTree() const { return m_tree->size(); }
+ /** Get the number of trees (eg number of chromosomes, each with own tree
+  * or interval array) */
+ int NumTree() const { return m_tree->size() + m_array->size() + (m_dynamic ? m_dynamic->size() : 0); }
 
  /** Get the IDs of all intervals that overlap with a query range
   *
@@ -158,9 +395,51 @@ class GenomicRegionCollection {
  template<class K>
  std::vector<int> FindOverlappedIntervals(const K& gr, bool ignore_strand) const;
 
+ /** Get the IDs of all intervals that overlap with a query range, into a caller-owned buffer
+  *
+  * Same as FindOverlappedIntervals(gr, ignore_strand), but reuses ids
+  * to avoid allocating a new vector for each query.
+  * @param gr Query range to check overlaps against
+  * @param ids Cleared, then filled with the IDs of overlapping intervals
+  * @param ignore_strand Should strandedness be ignore when doing overlaps 
+  * @return Number of overlapping intervals
+  */
+ template<class K>
+ size_t FindOverlappedIntervals(const K& gr, std::vector<int>& ids, bool ignore_strand) const;
+
+ /** Call a visitor on each interval that overlaps a query range
+  *
+  * Nothing is allocated, so this is the fastest way to run many queries
+  * (e.g. one per read). The visitor is called as f(id), with the id
+  * of the interval as in FindOverlappedIntervals, and returns false
+  * to stop the query early.
+  * @param gr Query range to check overlaps against
+  * @param f Visitor with bool operator()(size_t id)
+  * @param ignore_strand Should strandedness be ignore when doing overlaps
+  * @return False if the visitor stopped the query early
+  * @exception Throws a logic_error if the collection is non-empty, but no tree has been made
+  */
+ template<class K, class F>
+ bool VisitOverlaps(const K& gr, F& f, bool ignore_strand) const;
+
+ /** Check if any interval overlaps a query range, stopping at the first hit
+  * @param gr Query range to check overlaps against
+  * @param ignore_strand Should strandedness be ignore when doing overlaps
+  * @return True if at least one interval overlaps gr
+  * @exception Throws a logic_error if the collection is non-empty, but no tree has been made
+  */
+ template<class K>
+ bool AnyOverlap(const K& gr, bool ignore_strand) const;
+
  /** Get a const pointer to the genomic interval tree map */
  const GenomicIntervalTreeMap* GetTree() const { return m_tree.get(); }
 
+ /** Get a const pointer to the flat interval index map (see CreateIntervalArrayMap) */
+ const GenomicIntervalArrayMap* GetIntervalArray() const { return m_array.get(); }
+
+ /** Get a const pointer to the dynamic index map, or NULL if not made (see CreateDynamicMap) */
+ const GenomicIntervalDynamicMap* GetDynamicIndex() const { return m_dynamic.get(); }
+
   /** Retrieve a GenomicRegion at given index. 
    * 
    * Note that this does not move the idx iterator, which is 
@@ -187,6 +466,12 @@ class GenomicRegionCollection {
  size_t CountContained(const T &gr);
 
  /** Return the overlaps between the collection and the query collection
+  *
+  * If both collections are ordered by chromosome and start (e.g. after
+  * CoordinateSort, or read from sorted BED files), the overlaps are found
+  * with a single linear sweep over both, and the subject does not need an
+  * interval tree. Otherwise each interval of this collection is looked
+  * up in the interval tree of the subject.
   * @param subject Subject collection of intervals
   * @param query_id Indices of the queries that have an overlap. Will be same size as output and subject_id and in same order
   * @param subject_id Indices of the subject that have an overlap. Will be same size as output and query_id and in same order
@@ -195,10 +480,25 @@ class GenomicRegionCollection {
   * @exception Throws a logic_error if this tree is non-empty, but the interval tree has not been made with 
   * CreateTreeMap
   * inside the query collection
+  * @note Pairs come out grouped by query in the order of this collection. Within a query,
+  * order is by subject index for the sweep, and unspecified for the tree lookup.
   */
  template<class K>
  GenomicRegionCollection<GenomicRegion> FindOverlaps(const GenomicRegionCollection<K> &subject, std::vector<int32_t>& query_id, std::vector<int32_t>& subject_id, bool ignore_strand) const;
 
+#ifdef HAVE_C11
+ /** Return the overlaps between the collection and the query collection, using a thread pool
+  *
+  * The queries are split into batches (whole chromosomes when both
+  * collections are sorted) that are run in parallel, and the results
+  * are joined in query order. Output is the same as the single threaded
+  * FindOverlaps.
+  * @param tp Pool to run the batches on
+  */
+ template<class K>
+ GenomicRegionCollection<GenomicRegion> FindOverlaps(const GenomicRegionCollection<K> &subject, std::vector<int32_t>& query_id, std::vector<int32_t>& subject_id, bool ignore_strand, ThreadPool tp) const;
+#endif
+
  /** Return the overlaps between the collection and the query interval
   * @param gr Query region 
   * @param ignore_strand If true, won't exclude overlap if on different strand
@@ -285,16 +585,76 @@ class GenomicRegionCollection {
    */
   template <class K>
   GenomicRegionCollection<GenomicRegion> Intersection(const GenomicRegionCollection<K>& subject, bool ignore_strand) const;
- 
+
+  /** Return the bases covered by this collection or another
+   *
+   * This and the set operations below treat each collection as the set
+   * of bases it covers, ignoring strand, and return the result as
+   * sorted, merged regions (as from MergeOverlappingIntervals). They are
+   * single merges over the two collections, so are linear if both are
+   * already ordered by chromosome and start (otherwise a sorted copy is made
+   * first). No interval tree is needed.
+   * @param other Collection to take the union with
+   */
+  template <class K>
+  GenomicRegionCollection<GenomicRegion> SetUnion(const GenomicRegionCollection<K>& other) const;
+
+  /** Return the bases covered by both this collection and another
+   *
+   * Unlike Intersection, each base is returned once, however many
+   * regions of either collection cover it.
+   * @param other Collection to intersect with
+   */
+  template <class K>
+  GenomicRegionCollection<GenomicRegion> SetIntersection(const GenomicRegionCollection<K>& other) const;
+
+  /** Return the bases covered by this collection, but not by another
+   * @param other Collection of bases to remove
+   */
+  template <class K>
+  GenomicRegionCollection<GenomicRegion> SetDifference(const GenomicRegionCollection<K>& other) const;
+
+  /** Return the bases of a genome that are not covered by this collection
+   *
+   * Each chromosome spans [0, Length], as in the GenomicRegionCollection(width, ovlp, h)
+   * constructor, so the complement of an empty collection is the whole genome.
+   * Regions on chromosomes not in the genome are ignored.
+   * @param h Sequences of the genome, in chromosome ID order
+   */
+  GenomicRegionCollection<GenomicRegion> Complement(const HeaderSequenceVector& h) const;
+
+  /** Return the bases of a genome that are not covered by this collection
+   * @param h Header of the genome
+   */
+  GenomicRegionCollection<GenomicRegion> Complement(const BamHeader& h) const;
+
+  /** Return the number of regions covering each base, as runs of equal depth
+   *
+   * Runs are sorted, and bases with no coverage are left out (as with
+   * bedtools genomecov -bg). Strand is ignored.
+   * @param depth Cleared, then filled with the depth of each returned region
+   * @return Regions of constant, non-zero depth
+   */
+  GenomicRegionCollection<GenomicRegion> CoverageDepth(std::vector<int32_t>& depth) const;
+
  protected:
 
  bool m_sorted;
  
  // always construct this object any time m_grv is modifed
  SeqPointer<GenomicIntervalTreeMap> m_tree;
+
+ // flat alternative to m_tree. At most one of the two is built
+ SeqPointer<GenomicIntervalArrayMap> m_array;
  
  // hold the genomic regions
  SeqPointer<std::vector<T> > m_grv; 
+
+ // index updated by add and Erase. NULL unless CreateDynamicMap was called
+ SeqPointer<GenomicIntervalDynamicMap> m_dynamic;
+
+ // file that m_array is a view of, if loaded with ReadBinary
+ SeqPointer<MappedFile> m_map;
  
  // index for current GenomicRegion
  size_t idx;
@@ -302,6 +662,40 @@ class GenomicRegionCollection {
  // open the memory
  void allocate_grc();
 
+ // read a BED or VCF in large blocks, and parse the lines in place
+ bool read_text(const std::string& file, const BamHeader& hdr, bool vcf, ThreadPool tp);
+
+ void parse_bed_line(const char* p, const char* end, _ChrNameCache& chrs);
+
+ void parse_vcf_line(const char* p, const char* end, _ChrNameCache& chrs);
+
+ // split the (sorted) regions into intervals for each chromosome
+ void make_interval_map(GenomicIntervalMap& map);
+
+ // true if there are regions, but no index has been made to query them
+ bool missing_index() const { return m_tree->empty() && m_array->empty() && !m_dynamic && !m_grv->empty(); }
+
+ // query whichever index has been made
+ void find_overlapping(int32_t chr, int32_t pos1, int32_t pos2, GenomicIntervalVector& giv) const;
+
+ // visit each hit in whichever index has been made
+ template<class F>
+ bool visit_overlapping(int32_t chr, int32_t pos1, int32_t pos2, F& f) const;
+
+ // true if ordered by chromosome then start, so a sweep can be used
+ bool is_start_sorted() const;
+
+ // the covered bases, as sorted and merged regions. Sorts a copy if not start sorted
+ void reduced(GenomicRegionVector& out) const;
+
+ // overlap the queries in [begin, end) with a start sorted subject, with a single sweep
+ template<class K>
+ void sweep_overlaps(const GenomicRegionCollection<K> &subject, size_t begin, size_t end, std::vector<int32_t>& query_id, std::vector<int32_t>& subject_id, GenomicRegionCollection<GenomicRegion>& output, bool ignore_strand) const;
+
+ // overlap the queries in [begin, end) with the subject, using its index
+ template<class K>
+ void tree_overlaps(const GenomicRegionCollection<K> &subject, size_t begin, size_t end, std::vector<int32_t>& query_id, std::vector<int32_t>& subject_id, GenomicRegionCollection<GenomicRegion>& output, bool ignore_strand) const;
+
 };
 
 typedef GenomicRegionCollection<GenomicRegion> GRC;
@@ -0,0 +1,153 @@
+#ifndef SEQLIB_GENOMIC_TILING_H
+#define SEQLIB_GENOMIC_TILING_H
+
+#include <vector>
+#include <iterator>
+#include <cstddef>
+
+#include "SeqLib/GenomicRegion.h"
+#include "SeqLib/GenomicRegionCollection.h"
+#include "SeqLib/BamHeader.h"
+
+namespace SeqLib {
+
+  /** @brief Tiles of a genome, made on demand instead of stored
+   *
+   * Gives the same tiles, in the same order, as the
+   * GenomicRegionCollection(width, ovlp, h) constructor, but only
+   * stores the number of tiles on each chromosome. Memory does not depend
+   * on the number of tiles, and any tile can be made from its index in
+   * O(log number of chromosomes).
+   *
+   * Use Slice to make a bounded batch of tiles as a GRC (e.g. for a
+   * RegionScheduler), and FindTile to bin positions (e.g. for coverage).
+   */
+class GenomicTiling {
+
+ public:
+
+  /** @brief Random access iterator over the tiles
+   *
+   * Tiles are made when dereferenced, so are returned by value.
+   */
+  class const_iterator {
+
+    friend class GenomicTiling;
+
+  public:
+
+    typedef std::random_access_iterator_tag iterator_category;
+    typedef GenomicRegion value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef const GenomicRegion* pointer;
+    typedef GenomicRegion reference;
+
+    const_iterator() : m_tiles(NULL), m_i(0) {}
+
+    GenomicRegion operator*() const { return (*m_tiles)[m_i]; }
+
+    GenomicRegion operator[](difference_type n) const { return (*m_tiles)[m_i + n]; }
+
+    /** Index of the current tile */
+    size_t Index() const { return m_i; }
+
+    const_iterator& operator++() { ++m_i; return *this; }
+    const_iterator operator++(int) { const_iterator t(*this); ++m_i; return t; }
+    const_iterator& operator--() { --m_i; return *this; }
+    const_iterator operator--(int) { const_iterator t(*this); --m_i; return t; }
+    const_iterator& operator+=(difference_type n) { m_i += n; return *this; }
+    const_iterator& operator-=(difference_type n) { m_i -= n; return *this; }
+    const_iterator operator+(difference_type n) const { const_iterator t(*this); return t += n; }
+    const_iterator operator-(difference_type n) const { const_iterator t(*this); return t -= n; }
+    difference_type operator-(const const_iterator& o) const { return static_cast<difference_type>(m_i) - static_cast<difference_type>(o.m_i); }
+
+    bool operator==(const const_iterator& o) const { return m_i == o.m_i; }
+    bool operator!=(const const_iterator& o) const { return m_i != o.m_i; }
+    bool operator<(const const_iterator& o) const { return m_i < o.m_i; }
+    bool operator>(const const_iterator& o) const { return m_i > o.m_i; }
+    bool operator<=(const const_iterator& o) const { return m_i <= o.m_i; }
+    bool operator>=(const const_iterator& o) const { return m_i >= o.m_i; }
+
+  private:
+
+    const_iterator(const GenomicTiling* t, size_t i) : m_tiles(t), m_i(i) {}
+
+    const GenomicTiling* m_tiles;
+
+    size_t m_i;
+
+  };
+
+  /** Construct an empty tiling */
+  GenomicTiling() : m_width(0), m_step(1) { m_first.push_back(0); }
+
+  /** Tile a genome
+   * @param width Width of each tile
+   * @param ovlp Overlap between neighbouring tiles
+   * @param h Sequences of the genome, in chromosome ID order
+   * @exception Throws an invalid_argument if width <= ovlp
+   */
+  GenomicTiling(int width, int ovlp, const HeaderSequenceVector& h);
+
+  /** Tile the sequences of a BAM header
+   * @param width Width of each tile
+   * @param ovlp Overlap between neighbouring tiles
+   * @param h Header of the genome
+   * @exception Throws an invalid_argument if width <= ovlp
+   */
+  GenomicTiling(int width, int ovlp, const BamHeader& h);
+
+  /** Total number of tiles */
+  size_t size() const { return m_first.back(); }
+
+  /** Are there no tiles? */
+  bool empty() const { return size() == 0; }
+
+  /** Number of tiles on a chromosome, or 0 if not in the genome */
+  size_t NumTiles(int32_t chr) const;
+
+  /** Make the tile at index i, without bounds checking */
+  GenomicRegion operator[](size_t i) const;
+
+  /** Make the tile at index i
+   * @exception Throws an out_of_range if i >= size()
+   */
+  GenomicRegion at(size_t i) const;
+
+  /** Index of the first tile that contains a position
+   * @param chr Chromosome ID
+   * @param pos Position on the chromosome
+   * @return Tile index, or size() if no tile contains the position
+   */
+  size_t FindTile(int32_t chr, int32_t pos) const;
+
+  /** Make a range of tiles
+   * @param begin Index of the first tile
+   * @param end Index one past the last tile
+   * @exception Throws an out_of_range if begin > end or end > size()
+   */
+  GRC Slice(size_t begin, size_t end) const;
+
+  const_iterator begin() const { return const_iterator(this, 0); }
+
+  const_iterator end() const { return const_iterator(this, size()); }
+
+ private:
+
+  int32_t m_width;
+
+  int32_t m_step;
+
+  // index of the first tile of each chromosome, plus the total at the end
+  std::vector<size_t> m_first;
+
+  // length of each chromosome
+  std::vector<int32_t> m_len;
+
+  void init(int width, int ovlp, const HeaderSequenceVector& h);
+
+};
+
+}
+
+#endif
@@ -0,0 +1,252 @@
+#ifndef SEQLIB_INTERVAL_ARRAY_H__
+#define SEQLIB_INTERVAL_ARRAY_H__
+
+#include <vector>
+#include <algorithm>
+
+#include "SeqLib/IntervalTree.h"
+
+namespace SeqLib {
+
+  /** @brief Flat interval index, with the same queries as TIntervalTree
+   *
+   * Intervals are kept in one array sorted by start, which is also
+   * read as an implicit binary search tree (the layout used by cgranges):
+   * a node at level k sits at an index whose lowest k bits are set,
+   * with children at index -/+ 2^(k-1). Each node stores the largest stop
+   * in its subtree, in a second array. There are no pointers or per-node
+   * allocations, building is a sort plus a linear pass, and memory is
+   * that of the intervals plus one K per interval.
+   *
+   * The index can also be a view of arrays it does not own (e.g. a
+   * memory mapped file written from Data() and MaxStops()), which are
+   * queried in place. The caller keeps that memory alive.
+   *
+   * Intervals are closed, as in TIntervalTree.
+   */
+template <class T, typename K = std::size_t>
+class TIntervalArray {
+
+public:
+    typedef TInterval<T,K> interval;
+    typedef std::vector<interval> intervalVector;
+
+    TIntervalArray() : iv(NULL), ms(NULL), n(0), max_level(-1) {}
+
+    /** Build from a set of intervals
+     * @param ivals Intervals to index. Contents are moved into the index, leaving ivals empty.
+     */
+    TIntervalArray(intervalVector& ivals) : iv(NULL), ms(NULL), n(0), max_level(-1) {
+        intervals.swap(ivals);
+        // skip the sort if already in order, e.g. from a sorted GRC
+        IntervalStartSorter<T,K> intervalStartSorter;
+        for (size_t i = 1; i < intervals.size(); ++i)
+            if (intervalStartSorter(intervals[i], intervals[i-1])) {
+                std::stable_sort(intervals.begin(), intervals.end(), intervalStartSorter);
+                break;
+            }
+        index();
+    }
+
+    /** View an index that is already built, without copying it
+     * @param ivals n intervals, sorted by start, as from Data()
+     * @param max_stops n subtree maxima, as from MaxStops()
+     * @param num Number of intervals
+     */
+    TIntervalArray(const interval* ivals, const K* max_stops, size_t num)
+        : iv(ivals), ms(max_stops), n(num), max_level(root_level(num)) {}
+
+    TIntervalArray(const TIntervalArray& other)
+        : intervals(other.intervals), max_stop(other.max_stop),
+          iv(other.iv), ms(other.ms), n(other.n), max_level(other.max_level) {
+        if (other.owns())
+            point_to_owned();
+    }
+
+    TIntervalArray& operator=(const TIntervalArray& other) {
+        if (this != &other) {
+            TIntervalArray tmp(other);
+            swap(tmp);
+        }
+        return *this;
+    }
+
+    /** Exchange contents with another index, without copying */
+    void swap(TIntervalArray& other) {
+        // vector buffers move with the swap, so the pointers stay valid
+        intervals.swap(other.intervals);
+        max_stop.swap(other.max_stop);
+        std::swap(iv, other.iv);
+        std::swap(ms, other.ms);
+        std::swap(n, other.n);
+        std::swap(max_level, other.max_level);
+    }
+
+    size_t size() const { return n; }
+
+    bool empty() const { return n == 0; }
+
+    intervalVector findOverlapping(K start, K stop) const {
+        intervalVector ov;
+        this->findOverlapping(start, stop, ov);
+        return ov;
+    }
+
+    void findOverlapping(K start, K stop, intervalVector& overlapping) const {
+        _Collector c(overlapping);
+        visitOverlapping(start, stop, c);
+    }
+
+    // call f(interval) on each overlapping interval, stopping early
+    // if f returns false. Returns false if stopped early
+    template <class F>
+    bool visitOverlapping(K start, K stop, F& f) const {
+
+        if (max_level < 0)
+            return true;
+
+        _StackItem stack[64];
+        int t = 0;
+
+        // start at the root
+        stack[t].level = max_level;
+        stack[t].x = (1L << max_level) - 1;
+        stack[t++].left_done = false;
+
+        while (t) {
+            _StackItem z = stack[--t];
+            if (z.level <= 3) {
+                // small subtree, scan it
+                long i0 = z.x >> z.level << z.level;
+                long i1 = std::min(n, i0 + (1L << (z.level + 1)) - 1);
+                for (long i = i0; i < i1 && iv[i].start <= stop; ++i)
+                    if (iv[i].stop >= start && !f(iv[i]))
+                        return false;
+            } else if (!z.left_done) {
+                // come back to this node after the left child
+                long y = z.x - (1L << (z.level - 1));
+                stack[t].level = z.level;
+                stack[t].x = z.x;
+                stack[t++].left_done = true;
+                // left child can be past the end, in which case descend anyway
+                if (y >= n || ms[y] >= start) {
+                    stack[t].level = z.level - 1;
+                    stack[t].x = y;
+                    stack[t++].left_done = false;
+                }
+            } else if (z.x < n && iv[z.x].start <= stop) {
+                if (iv[z.x].stop >= start && !f(iv[z.x]))
+                    return false;
+                stack[t].level = z.level - 1;
+                stack[t].x = z.x + (1L << (z.level - 1));
+                stack[t++].left_done = false;
+            }
+        }
+        return true;
+    }
+
+    intervalVector findContained(K start, K stop) const {
+        intervalVector contained;
+        this->findContained(start, stop, contained);
+        return contained;
+    }
+
+    void findContained(K start, K stop, intervalVector& contained) const {
+        // contained intervals start in [start, stop], so just scan that part
+        const interval* i =
+            std::lower_bound(iv, iv + n, interval(start, start, T()), IntervalStartSorter<T,K>());
+        for (; i != iv + n && i->start <= stop; ++i)
+            if (i->stop <= stop)
+                contained.push_back(*i);
+    }
+
+    /** Intervals, sorted by start (size() of them) */
+    const interval* Data() const { return iv; }
+
+    /** Largest stop in the subtree at each interval (size() of them) */
+    const K* MaxStops() const { return ms; }
+
+private:
+
+    struct _Collector {
+        _Collector(intervalVector& v) : out(v) {}
+        bool operator()(const interval& i) { out.push_back(i); return true; }
+        intervalVector& out;
+    };
+
+    struct _StackItem {
+        int level;
+        long x;
+        bool left_done;
+    };
+
+    // owned storage. Empty for a view
+    intervalVector intervals;
+
+    // largest stop in the subtree rooted at each index
+    std::vector<K> max_stop;
+
+    // what is queried: the owned storage, or the viewed arrays
+    const interval* iv;
+    const K* ms;
+    long n;
+
+    // level of the root
+    int max_level;
+
+    bool owns() const { return !n || (!intervals.empty() && iv == &intervals[0]); }
+
+    void point_to_owned() {
+        n = intervals.size();
+        iv = n ? &intervals[0] : NULL;
+        ms = n ? &max_stop[0] : NULL;
+    }
+
+    static int root_level(size_t num) {
+        int k = 0;
+        while (num >> (k + 1))
+            ++k;
+        return num ? k : -1;
+    }
+
+    void index() {
+
+        const long n = intervals.size();
+        max_stop.resize(n);
+        point_to_owned();
+        if (!n) {
+            max_level = -1;
+            return;
+        }
+
+        // leaves are at even indices
+        long last_i = 0;
+        K last = K();
+        for (long i = 0; i < n; i += 2) {
+            last_i = i;
+            last = max_stop[i] = intervals[i].stop;
+        }
+
+        int k = 1;
+        for (; (1L << k) <= n; ++k) {
+            long x = 1L << (k - 1);
+            long i0 = (x << 1) - 1;
+            long step = x << 2;
+            for (long i = i0; i < n; i += step) {
+                K el = max_stop[i - x];
+                // right child may be past the end, in which case use the last max
+                K er = i + x < n ? max_stop[i + x] : last;
+                max_stop[i] = std::max(intervals[i].stop, std::max(el, er));
+            }
+            // move last_i up to its parent at level k
+            last_i = (last_i >> k & 1) ? last_i - x : last_i + x;
+            if (last_i < n && max_stop[last_i] > last)
+                last = max_stop[last_i];
+        }
+        max_level = k - 1;
+    }
+
+};
+
+}
+#endif
@@ -20,7 +20,8 @@
 */
 
 /* Modifed by Jeremiah Wala to switch unique_ptr to traditional
-   pointer (requiring free on destruction) */
+   pointer (requiring free on destruction), and to add visitor queries
+   and swap */
 
 #ifndef SEQLIB_INTERVAL_TREE_H__
 #define SEQLIB_INTERVAL_TREE_H__
@@ -119,6 +120,14 @@ public:
         return *this;
     }
 
+    // exchange contents with another tree, without copying nodes
+    void swap(intervalTree& other) {
+        intervals.swap(other.intervals);
+        std::swap(left, other.left);
+        std::swap(right, other.right);
+        std::swap(center, other.center);
+    }
+
     // Note: changes the order of ivals
     TIntervalTree<T,K>(
             intervalVector& ivals,
@@ -211,6 +220,33 @@ public:
 
     }
 
+    // call f(interval) on each overlapping interval, stopping early
+    // if f returns false. Returns false if stopped early
+    template <class F>
+    bool visitOverlapping(K start, K stop, F& f) const {
+        if (!intervals.empty() && ! (stop < intervals.front().start)) {
+            for (typename intervalVector::const_iterator i = intervals.begin(); i != intervals.end(); ++i) {
+                const interval& interval = *i;
+                if (interval.stop >= start && interval.start <= stop) {
+                    if (!f(interval))
+                        return false;
+                }
+            }
+        }
+
+        if (left && start <= center) {
+            if (!left->visitOverlapping(start, stop, f))
+                return false;
+        }
+
+        if (right && stop >= center) {
+            if (!right->visitOverlapping(start, stop, f))
+                return false;
+        }
+
+        return true;
+    }
+
     intervalVector findContained(K start, K stop) const {
 	intervalVector contained;
 	this->findContained(start, stop, contained);
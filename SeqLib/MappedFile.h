@@ -0,0 +1,56 @@
+#ifndef SEQLIB_MAPPED_FILE_H
+#define SEQLIB_MAPPED_FILE_H
+
+#include <string>
+#include <cstddef>
+
+namespace SeqLib {
+
+  /** Read-only memory map of a whole file
+   *
+   * The mapping is released when the object is destroyed, so anything
+   * pointing into Data() must not outlive it. Hold it in a SeqPointer
+   * to share it between copies of an object that views the memory.
+   */
+class MappedFile {
+
+ public:
+
+  /** Construct an unopened map */
+  MappedFile() : m_data(NULL), m_size(0) {}
+
+  ~MappedFile() { Close(); }
+
+  /** Map a file into memory
+   * @param file Path to the file
+   * @return False if the file could not be opened or mapped
+   */
+  bool Open(const std::string& file);
+
+  /** Release the mapping */
+  void Close();
+
+  /** Is a file mapped? */
+  bool IsOpen() const { return m_data != NULL; }
+
+  /** Start of the mapped file */
+  const char* Data() const { return m_data; }
+
+  /** Size of the mapped file, in bytes */
+  size_t Size() const { return m_size; }
+
+ private:
+
+  // not copyable, as the mapping is released on destruction
+  MappedFile(const MappedFile&);
+  MappedFile& operator=(const MappedFile&);
+
+  const char* m_data;
+
+  size_t m_size;
+
+};
+
+}
+
+#endif
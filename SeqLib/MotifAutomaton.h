@@ -0,0 +1,99 @@
+#ifndef SEQLIB_MOTIF_AUTOMATON_H
+#define SEQLIB_MOTIF_AUTOMATON_H
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <stdint.h>
+
+namespace SeqLib {
+
+  /** @brief Table-driven Aho-Corasick automaton for finding motifs in reads
+   *
+   * Finds whether any of a set of motifs is a substring of a read, with
+   * the same answers as the AhoCorasick trie on the decoded sequence. It
+   * scans the 4-bit packed sequence of a BAM record (bam_get_seq) directly,
+   * decoding nothing.
+   *
+   * All transitions are in one flat table (state x symbol), where
+   * a symbol is a character used in the motifs, and one more symbol stands for
+   * every other character. Each step of the scan is one table lookup. While
+   * no motif has been started, whole bytes of the packed sequence (two
+   * bases) that cannot start a motif are skipped with one lookup.
+   *
+   * Call Build after adding motifs, and before matching.
+   */
+class MotifAutomaton {
+
+ public:
+
+  /** Construct an empty automaton, which matches nothing */
+  MotifAutomaton();
+
+  /** Add a motif. Empty motifs are ignored.
+   * @note The automaton must be built again (Build) before matching
+   */
+  void AddMotif(const std::string& m);
+
+  /** Make the transition table from the motifs added so far */
+  void Build();
+
+  /** Has the automaton been built since the last motif was added? */
+  bool IsBuilt() const { return m_built; }
+
+  /** Number of motifs added (not counting empty ones) */
+  size_t NumMotifs() const { return m_motifs.size(); }
+
+  /** Number of states of the built automaton */
+  size_t NumStates() const { return m_accept.size(); }
+
+  /** Return if any motif is in a 4-bit packed sequence
+   *
+   * Bases are compared as BamRecord::Sequence decodes them.
+   * @param seq Packed sequence, as from bam_get_seq
+   * @param len Number of bases
+   * @exception Throws a logic_error if the automaton has not been built
+   */
+  bool Match(const uint8_t* seq, int32_t len) const;
+
+  /** Return if any motif is in a string
+   * @param s Text to search
+   * @param n Length of the text
+   * @exception Throws a logic_error if the automaton has not been built
+   */
+  bool Match(const char* s, size_t n) const;
+
+  /** Return if any motif is in a string
+   * @exception Throws a logic_error if the automaton has not been built
+   */
+  bool Match(const std::string& s) const { return Match(s.data(), s.length()); }
+
+ private:
+
+  std::vector<std::string> m_motifs;
+
+  bool m_built;
+
+  // number of symbols. Symbol 0 is any character not in a motif
+  size_t m_nsym;
+
+  // symbol of each character, and of each 4-bit base code
+  uint8_t m_char_sym[256];
+  uint8_t m_code_sym[16];
+
+  // next state for each state and symbol, at m_next[state * m_nsym + symbol]
+  std::vector<int32_t> m_next;
+
+  // does a motif end at the state (itself, or by a suffix)
+  std::vector<uint8_t> m_accept;
+
+  // can a packed byte be skipped from the root, as neither base starts a motif
+  uint8_t m_skip[256];
+
+  void check_built() const;
+
+};
+
+}
+
+#endif
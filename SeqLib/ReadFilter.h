@@ -11,6 +11,8 @@
 
 #include "SeqLib/GenomicRegionCollection.h"
 #include "SeqLib/BamRecord.h"
+#include "SeqLib/MotifAutomaton.h"
+#include "SeqLib/ReadNameSet.h"
 
 #ifdef HAVE_C11
 #include "SeqLib/aho_corasick.hpp"
@@ -22,12 +24,37 @@
 #define MINIRULES_REGION 3
 #define MINIRULES_REGION_EXCLUDE 4
 
+// queries between reorderings of the checks of a CompiledRule
+#define RULE_ADAPT_INTERVAL 4096
+
 namespace SeqLib {
 
   typedef SeqHashSet<std::string> StringSet;
 
   namespace Filter {
 
+  /** Counts of the reads tested by a rule or filter
+   *
+   * Also the time spent testing them, if timing is turned on in
+   * the ReadFilterCollection (see ReadFilterCollection::SetTiming).
+   */
+  struct FilterStats {
+
+    /** Construct with all counts at zero */
+    FilterStats() : tested(0), passed(0), ticks(0) {}
+
+    /** Number of reads tested that failed */
+    size_t Rejected() const { return tested - passed; }
+
+    /** Set all counts to zero */
+    void Reset() { tested = 0; passed = 0; ticks = 0; }
+
+    size_t tested; ///< Number of reads tested
+    size_t passed; ///< Number of reads tested that passed
+    uint64_t ticks; ///< Time spent testing, in CPU cycles on x86 or else nanoseconds
+
+  };
+
 #ifdef HAVE_C11
   /** Tool for using the Aho-Corasick method for substring queries of 
    * using large dictionaries 
@@ -52,6 +79,7 @@ namespace SeqLib {
      */
     void AddMotif(const std::string& m) { 
       aho_trie->insert(m);
+      automaton.AddMotif(m);
     } 
     
     /** Add a set of motifs to the trie from a file 
@@ -67,6 +95,8 @@ namespace SeqLib {
     int QueryText(const std::string& t) const;
 
     SeqPointer<aho_corasick::trie> aho_trie; ///< The trie for the Aho-Corasick search
+
+    MotifAutomaton automaton; ///< The same motifs, for matching packed sequence (built by CompiledRule)
     
     std::string file; ///< Name of the file holding the motifs
 
@@ -144,7 +174,7 @@ public:
    * @param val Query value (e.g. mapping quality)
    * @return true if the value passes this Range rule
    */
-  bool isValid(int val) {
+  bool isValid(int val) const {
     if (m_every)
       return true;
     if (!m_inverted)
@@ -263,7 +293,7 @@ class FlagRule {
    * @param r Alignment record to query
    * @return true if record passes rules
    */
-  bool isValid(const BamRecord &r);
+  bool isValid(const BamRecord &r) const;
 
   /** Print the flag rule */
   friend std::ostream& operator<<(std::ostream &out, const FlagRule &fr);
@@ -283,6 +313,8 @@ private:
 
   int parse_json_int(const Json::Value& v);
 
+  friend class CompiledRule;
+
 };
 
 /** Stores a full rule (Flag + Range + motif etc)
@@ -294,11 +326,12 @@ class AbstractRule {
 
   friend class ReadFilter;
   friend class ReadFilterCollection;
+  friend class CompiledRule;
 
  public:
 
   /** Create empty rule with default to accept all */
- AbstractRule() : m_count(0), subsam_frac(1), subsam_seed(999) { }
+ AbstractRule() : subsam_frac(1), subsam_seed(999), m_names_inv(false) { }
 
   /** Destroy the filter */
   ~AbstractRule() {}
@@ -310,11 +343,24 @@ class AbstractRule {
    */
   void addMotifRule(const std::string& f, bool inverted);
 
+  /** Add a list of read names, of which the read name must be one
+   * @param f Path to new-line separated file of read names (see ReadNameSet::AddFile)
+   * @param inverted If true, the reads with a name in the list will fail isValid
+   * @exception Throws a runtime_error if the file cannot be read
+   */
+  void addReadNameRule(const std::string& f, bool inverted);
+
+  /** Add a set of read names, of which the read name must be one
+   * @param names Read names. Copied once, then shared by copies of this rule
+   * @param inverted If true, the reads with a name in the set will fail isValid
+   */
+  void addReadNameRule(const ReadNameSet& names, bool inverted);
+
   /** Query a read against this rule. If the
    * read passes this rule, return true.
    * @param r An aligned sequencing read to query against filter
    */
-  bool isValid(const BamRecord &r);
+  bool isValid(const BamRecord &r) const;
 
   /** Supply the rule parameters with a JSON
    * @param value JSON object created by parsing a string
@@ -346,6 +392,12 @@ class AbstractRule {
    */
   void SetReadGroup(const std::string& rg) { read_group = rg; }
 
+  /** Return the number of reads tested and passed by this rule
+   * @note Counts reads that got as far as this rule, in
+   * ReadFilter::isValid or ReadFilterCollection queries
+   */
+  const FilterStats& Stats() const { return m_stats; }
+
   FlagRule fr; ///< FlagRule specifying the alignment flag filter
 
   Range isize; ///< Range object for insert-size filter
@@ -366,8 +418,8 @@ class AbstractRule {
   // read group 
   std::string read_group;
 
-  // how many reads pass this rule?
-  size_t m_count;
+  // how many reads are tested and pass this rule
+  FilterStats m_stats;
 
   // the aho-corasick trie
 #ifdef HAVE_C11
@@ -383,8 +435,184 @@ class AbstractRule {
   // data
   uint32_t subsam_seed; // random seed for subsampling
 
+  // read names to keep (or exclude, if m_names_inv). Shared, as it can be large
+  SeqPointer<ReadNameSet> m_names;
+  bool m_names_inv;
+  std::string m_names_file;
+
   void parseSubLine(const Json::Value& value);
 
+  void parseNameLine(const Json::Value& value);
+
+};
+
+/** Read values that a Range of a CompiledRule can test, cheapest to get first */
+enum RuleField {
+  FIELD_MAPQ,   ///< Mapping quality
+  FIELD_ISIZE,  ///< Insert size, as BamRecord::FullInsertSize
+  FIELD_INS,    ///< Longest CIGAR insertion
+  FIELD_DEL,    ///< Longest CIGAR deletion
+  FIELD_LEN,    ///< Length of BamRecord::QualitySequence
+  FIELD_CLIP,   ///< Clipped bases, less any trimmed off
+  FIELD_NM,     ///< NM tag
+  FIELD_NBASES, ///< Number of N bases
+  FIELD_XP      ///< Number of secondary alignments in the XA tag
+};
+
+/** The core fields of a batch of reads, stored column-wise
+ *
+ * Lets a CompiledRule test a field on a whole batch in one tight loop
+ * (which the compiler can vectorize), instead of read by read.
+ */
+struct ReadColumns {
+
+  /** Load the columns of a batch of reads */
+  void Load(const BamRecordVector& batch);
+
+  /** Number of reads in the batch */
+  size_t size() const { return reads.size(); }
+
+  std::vector<const bam1_t*> reads; ///< The reads themselves, for the per-read checks
+  std::vector<uint32_t> flag;       ///< Alignment flag of each read
+  std::vector<uint8_t> mapq;        ///< Mapping quality of each read
+
+};
+
+/** An AbstractRule compiled into flat checks on a raw bam1_t
+ *
+ * All of the flag rules are folded into a few bit masks, which are
+ * checked first. The other rules that are set (ranges, orientation,
+ * read group, motif etc) are kept in a list of checks. Values are
+ * read straight from the bam1_t core, CIGAR and tags, and only as
+ * needed. Motifs are matched on the packed sequence (see MotifAutomaton).
+ * Accepts exactly the reads that AbstractRule::isValid accepts.
+ *
+ * With adaptive ordering (the default), the number of reads each check
+ * tests and rejects is counted, and every RULE_ADAPT_INTERVAL queries the
+ * checks are sorted by rejection rate per unit cost, so that cheap,
+ * selective checks run first. Costs are fixed estimates for each kind
+ * of check. Counts are then halved, so the order follows changes in the input.
+ */
+class CompiledRule {
+
+ public:
+
+  /** Construct a rule that accepts all reads */
+  CompiledRule();
+
+  /** Compile a rule */
+  explicit CompiledRule(const AbstractRule& ar);
+
+  /** Query a read against this rule
+   * @param b Read to query
+   * @param adapt If false, the counts and order of the checks are
+   * left alone even with adaptive ordering on
+   * @return True if the read passes the rule
+   * @note With adaptive ordering on and adapt true, this updates the
+   * counts (and order) of the checks, so must not be called from several
+   * threads at once. With adapt false, it can be.
+   */
+  bool isValid(const bam1_t* b, bool adapt = true) const;
+
+  /** Query a batch of reads against this rule
+   *
+   * The flag masks and MAPQ range are tested on whole columns at
+   * once, then the other checks on each read that is left.
+   * @param c Columns of the batch
+   * @param test Reads to test (non-zero), one per read in the batch
+   * @param pass Set to 1 for each tested read that passes. Others are not changed
+   * @param adapt If false, the counts and order of the checks are left alone (see isValid)
+   */
+  void Evaluate(const ReadColumns& c, const uint8_t* test, uint8_t* pass, bool adapt = true) const;
+
+  /** Turn adaptive ordering of the checks on or off (default on) */
+  void SetAdaptiveOrder(bool a) { m_adaptive = a; }
+
+  /** Return if the checks are reordered as reads are queried */
+  bool AdaptiveOrder() const { return m_adaptive; }
+
+  /** Number of checks, not counting the flag masks */
+  size_t NumChecks() const { return m_checks.size(); }
+
+ private:
+
+  enum _CheckKind { CHECK_RANGE, CHECK_HARDCLIP, CHECK_ORIENTATION,
+		    CHECK_SUBSAMPLE, CHECK_READ_GROUP, CHECK_MOTIF, CHECK_READ_NAME };
+
+  struct _Check {
+    _CheckKind kind;
+    RuleField field; // for CHECK_RANGE
+    int min;
+    int max;
+    bool inverted;
+    double cost;       // relative cost of a test
+    uint32_t tested;   // reads tested since the last reorder (halved each time)
+    uint32_t rejected; // and the number rejected
+  };
+
+  // values of a read that more than one check needs, made when first needed
+  struct _ReadCache {
+    _ReadCache() : len(-1) {}
+    int len; // length of BamRecord::QualitySequence
+  };
+
+  // flag bits that must be on, and that must be off
+  uint32_t m_flag_on;
+  uint32_t m_flag_off;
+
+  // fail if all of these are on, or if none of these are on
+  uint32_t m_all_off;
+  uint32_t m_any_on;
+
+  // fail if hard clipped (0), or if not (1)
+  int m_hardclip;
+
+  // the PairOrientation values (as bits) that pass, and -1 / 0 / 1
+  // for interchromosomal not checked / must be off / must be on
+  uint32_t m_orient;
+  int m_ic;
+
+  double m_subsam_frac;
+  uint32_t m_subsam_seed;
+
+  std::string m_read_group;
+
+  // checks after the flag masks, in the order they are run
+  mutable std::vector<_Check> m_checks;
+
+  bool m_adaptive;
+
+  // queries since the last reorder
+  mutable uint32_t m_queries;
+
+  // motifs, of which one must be in the sequence
+  MotifAutomaton m_motifs;
+
+  // read names, as AbstractRule
+  SeqPointer<ReadNameSet> m_names;
+  bool m_names_inv;
+
+  void add_check(_CheckKind kind, double cost);
+
+  void add_range(RuleField f, const Range& r);
+
+  // run one check on a read
+  bool pass(const _Check& c, const bam1_t* b, _ReadCache& rc) const;
+
+  // run the checks after the flag masks on a read, except for the MAPQ
+  // range if skip_mapq (as already done on the column). Updates the
+  // counts and order of the checks if adapt and adaptive ordering is on
+  bool run_checks(const bam1_t* b, bool skip_mapq, bool adapt) const;
+
+  // sort the checks by rejection rate per unit cost, and decay the counts
+  void reorder() const;
+
+  // value of a field on a read
+  static int field_value(RuleField f, const bam1_t* b, _ReadCache& rc);
+
+  // length of BamRecord::QualitySequence
+  static int quality_sequence_length(const bam1_t* b);
+
 };
 
 class ReadFilterCollection;
@@ -402,7 +630,7 @@ class ReadFilter {
   public:
 
   /** Construct an empty filter that passes all reads */
-  ReadFilter() : excluder(false), m_applies_to_mate(false), m_count(0) {}
+  ReadFilter() : excluder(false), m_applies_to_mate(false), m_cursor(0), m_cursor_chr(-1), m_cursor_pos(-1) {}
 
   /** Destroy the filter */
   ~ReadFilter();
@@ -446,6 +674,26 @@ class ReadFilter {
    */
   bool isReadOverlappingRegion(const BamRecord &r) const;
 
+  /** Check if a raw read (or its mate, if mate-linked) overlaps the region of this filter */
+  bool isReadOverlappingRegion(const bam1_t* b) const;
+
+  /** Check if a raw read (or its mate, if mate-linked) overlaps the region of this filter,
+   * for reads in coordinate order
+   *
+   * Same answer as isReadOverlappingRegion, but walks a cursor forward through the
+   * sorted regions as the reads advance, instead of looking up the interval tree. Reads
+   * from a coordinate-sorted BAM cost amortized O(1) each. A read before the previous
+   * one (unsorted input) moves the cursor back with a binary search. Unmapped reads and
+   * mates are looked up in the tree.
+   * @note Not thread safe, as the cursor is part of the filter
+   */
+  bool isReadOverlappingRegionSorted(const bam1_t* b);
+
+  /** Check if a read overlaps the region defined by this filter, for reads in coordinate order
+   * @note See isReadOverlappingRegionSorted(const bam1_t*)
+   */
+  bool isReadOverlappingRegionSorted(const BamRecord &r) { return isReadOverlappingRegionSorted(r.raw()); }
+
   /** Print basic information about this filter */
   friend std::ostream& operator<<(std::ostream& out, const ReadFilter &mr);
 
@@ -454,6 +702,18 @@ class ReadFilter {
     return m_abstract_rules.size();
   }
 
+  /** Return a rule of this filter
+   * @param i Index of the rule, in the order added
+   */
+  const AbstractRule& GetRule(size_t i) const { return m_abstract_rules[i]; }
+
+  /** Return the number of reads tested and passed by this filter
+   * @note A read is tested if it overlaps the region. In a
+   * ReadFilterCollection, only reads not decided by an earlier
+   * filter (excluders first) are tested.
+   */
+  const FilterStats& Stats() const { return m_stats; }
+
   /** Set as an excluder region 
    * An excluder region is such that if a read satisfies
    * this rule, then it will fail isValid, rather than pass
@@ -478,8 +738,22 @@ class ReadFilter {
   // rule applies to mate too
   bool m_applies_to_mate;
 
-  // how many reads pass this MiniRule
-  size_t m_count;
+  // how many reads are tested and pass this filter
+  FilterStats m_stats;
+
+  // the regions of m_grv sorted, with overlaps merged, for the cursor
+  std::vector<GenomicRegion> m_sorted;
+
+  // first region of m_sorted that does not end before the last read, and the last read
+  size_t m_cursor;
+  int32_t m_cursor_chr;
+  int32_t m_cursor_pos;
+
+  // make m_sorted from m_grv, and rewind the cursor
+  void sort_regions();
+
+  // check a read at [pos1, pos2] on chr, and its mate at [mpos1, mpos2] on mchr
+  bool overlaps_region(int32_t chr, int32_t pos1, int32_t pos2, int32_t mchr, int32_t mpos1, int32_t mpos2) const;
 
 };
 
@@ -497,7 +771,7 @@ class ReadFilterCollection {
   /** Construct an empty ReadFilterCollection 
    * that will pass all reads.
    */
- ReadFilterCollection() : m_count(0), m_count_seen(0) {}
+ ReadFilterCollection() : m_count(0), m_count_seen(0), m_compiled(false), m_adaptive(true), m_timing(false) {}
 
   /** Create a new filter collection directly from a JSON 
    * @param script A JSON file or directly as JSON formatted string
@@ -522,6 +796,60 @@ class ReadFilterCollection {
   /** Query a read to see if it passes any one of the
    * filters contained in this collection */
   bool isValid(const BamRecord &r);
+
+  /** Query a raw read to see if it passes any one of the
+   * filters contained in this collection 
+   *
+   * Same as isValid(const BamRecord&), without needing a BamRecord */
+  bool isValid(const bam1_t* b);
+
+  /** Query a read without changing the collection
+   *
+   * Gives the same answer as isValid, but does not update the counts
+   * (see StatsJSON) or the order of the checks, so can be called from
+   * several threads at once on a shared collection.
+   * @exception Throws a logic_error if the filters have not been
+   * compiled since they were last changed (see Compile)
+   */
+  bool isValid(const BamRecord &r) const;
+
+  /** Query a raw read without changing the collection (see isValid(const BamRecord&) const) */
+  bool isValid(const bam1_t* b) const;
+
+  /** Query a batch of reads against the filters
+   *
+   * Gives the same answers as isValid on each read, but tests each
+   * rule on the whole batch at once, with column-wise flag and MAPQ
+   * checks. This is faster for large batches (e.g. filtering a whole
+   * genome), as each rule is set up once per batch instead of once per read.
+   * @param batch Reads to query
+   * @param mask Set to one bit per read, bit i % 64 of word i / 64,
+   * which is on if read i passes
+   */
+  void Evaluate(const BamRecordVector& batch, std::vector<uint64_t>& mask);
+
+  /** Query a batch of reads without changing the collection
+   *
+   * As Evaluate, but thread safe in the same way as isValid(const BamRecord&) const.
+   * @exception Throws a logic_error if the filters have not been compiled (see Compile)
+   */
+  void Evaluate(const BamRecordVector& batch, std::vector<uint64_t>& mask) const;
+
+  /** Turn adaptive ordering of the checks of each rule on or off (see CompiledRule)
+   * @note Default is on. Applies to rules compiled after this call
+   */
+  void SetAdaptiveOrder(bool a) { m_adaptive = a; m_compiled = false; }
+
+  /** Compile the filters into flat checks on bam1_t (see CompiledRule)
+   *
+   * This is done once by the JSON constructor, and again by isValid
+   * if filters have been added since. There is no need to call it
+   * directly, except to move the work out of the first query.
+   */
+  void Compile();
+
+  /** Return if the filters have been compiled since they were last changed */
+  bool IsCompiled() const { return m_compiled; }
   
   /** Print some basic information about this object */
   friend std::ostream& operator<<(std::ostream& out, const ReadFilterCollection &mr);
@@ -534,9 +862,50 @@ class ReadFilterCollection {
    */
   GRC getAllRegions() const;
 
+  /** Compute the regions that a read must overlap to pass the filters
+   *
+   * A read can only pass by hitting an includer, so if every includer
+   * is restricted to regions (and is not mate-linked), reads outside of
+   * the includer regions always fail, and need not be read at all (see
+   * BamReader::SetFilterRegions). Excluders only remove reads, so they
+   * do not change the regions.
+   * @param grc Set to the sorted, merged includer regions, widened by 1 bp
+   * on each side, so that an index query returns every read that the
+   * filters count as overlapping
+   * @param pad Extra bases to widen by on each side. Reads with no
+   * stored sequence (SEQ is *) are taken to end at their start plus the
+   * query length (as BamRecord::PositionEnd), which can be past their
+   * alignment end. Pad by the read length to keep those too.
+   * @return False if reads from anywhere could pass (there are no filters,
+   * or an includer is whole-genome or mate-linked), in which case grc is empty
+   */
+  bool GetAcceptedRegions(GRC& grc, int pad = 0) const;
+
   /** Return the number of filters in this collection */
   size_t size() const { return m_regions.size(); } 
 
+  /** Return a filter of this collection, e.g. for its Stats()
+   * @param i Index of the filter, in the order added
+   */
+  const ReadFilter& GetReadFilter(size_t i) const { return m_regions[i]; }
+
+  /** Return the number of reads queried */
+  size_t NumSeen() const { return m_count_seen; }
+
+  /** Return the number of reads queried that passed */
+  size_t NumPassed() const { return m_count; }
+
+  /** Time each filter and rule as reads are queried (default off)
+   *
+   * Adds the time (see FilterStats::ticks) to the stats of each filter and
+   * rule. Reading the clock costs about as much as a simple rule, so
+   * this is best left off except when tuning filters.
+   */
+  void SetTiming(bool t) { m_timing = t; }
+
+  /** Set the counts of this collection, and of all its filters and rules, to zero */
+  void ResetStats();
+
   /** Return the total number of rules in this collection.
    * Filters are composed of collections of rules, and this
    * returns the total number of rules (e.g. MAPQ > 30) across
@@ -554,11 +923,16 @@ class ReadFilterCollection {
    */
   void CheckHasIncluder();
 
-  // Return the a tab-delimited tally of which filters were satisfied.
-   // Includes the header:
-   // total_seen_count total_passed_count region region_passed_count rule rule_passed_count
-   //
-  //std::string EmitCounts() const;
+  /** Return the counts of the collection, each filter and each rule, as JSON
+   *
+   * For example
+   * { "tested" : 100, "passed" : 60, "rejected" : 40,
+   *   "filters" : [ { "region" : "WHOLE GENOME", "exclude" : false,
+   *                   "tested" : 100, "passed" : 60, "rejected" : 40,
+   *                   "rules" : [ { "rule" : "mapq:[20,60] -- ", "tested" : 100, ... } ] } ] }
+   * with "ticks" for each filter and rule if timing is on.
+   */
+  std::string StatsJSON() const;
 
  private:  
 
@@ -571,6 +945,31 @@ class ReadFilterCollection {
   // store all of the individual filters
   std::vector<ReadFilter> m_regions;
 
+  // a filter of m_regions, compiled
+  struct _CompiledFilter {
+    size_t filter; // index in m_regions, for the region check
+    bool whole_genome;
+    std::vector<CompiledRule> rules;
+  };
+
+  // compiled filters, excluders first. Valid if m_compiled
+  std::vector<_CompiledFilter> m_program;
+  bool m_compiled;
+
+  // run the compiled filters on a read, adding to the counts (and timing)
+  // of the filters in counts if not NULL. counts is m_regions, or NULL
+  // to leave the collection unchanged
+  bool query(const bam1_t* b, bool adapt, std::vector<ReadFilter>* counts) const;
+
+  // as query, on a batch. Sets valid to 1 for the reads that pass
+  void query(const ReadColumns& cols, std::vector<uint8_t>& valid, bool adapt, std::vector<ReadFilter>* counts) const;
+
+  // adaptive ordering of the compiled checks
+  bool m_adaptive;
+
+  // time the filters and rules
+  bool m_timing;
+
   bool ParseFilterObject(const std::string& filterName, const Json::Value& filterObject);
 
 };
@@ -0,0 +1,88 @@
+#ifndef SEQLIB_READ_NAME_SET_H
+#define SEQLIB_READ_NAME_SET_H
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <stdint.h>
+
+#include "htslib/htslib/sam.h"
+
+namespace SeqLib {
+
+  /** @brief A large set of read names, for pulling reads out by name
+   *
+   * Stores a 64-bit hash (fingerprint) of each name in an open-addressing
+   * table (linear probing), which is 8 to 16 bytes per name instead of a
+   * std::string. A blocked Bloom filter (4 bits in one 64-bit word per name)
+   * is checked first, so most names not in the set cost one memory read.
+   * Names are hashed straight from the read (bam_get_qname), without
+   * making a string.
+   *
+   * As only fingerprints are kept, a name not in the set is reported as in
+   * it if it has the same 64-bit hash as a name in the set, which is
+   * unlikely (about n / 2^64 for n names).
+   */
+class ReadNameSet {
+
+ public:
+
+  /** Construct an empty set */
+  ReadNameSet();
+
+  /** Add a name */
+  void Add(const char* name, size_t n);
+
+  /** Add a name */
+  void Add(const std::string& name) { Add(name.data(), name.length()); }
+
+  /** Add the names in a file, one per line
+   *
+   * Only the first word of a line is used, so the first column of
+   * a SAM file works as well. Empty lines are skipped.
+   * @param f File of read names
+   * @exception Throws a runtime_error if the file cannot be read
+   */
+  void AddFile(const std::string& f);
+
+  /** Is a name in the set */
+  bool Contains(const char* name, size_t n) const;
+
+  /** Is a name in the set */
+  bool Contains(const std::string& name) const { return Contains(name.data(), name.length()); }
+
+  /** Is the name of a read in the set */
+  bool Contains(const bam1_t* b) const;
+
+  /** Number of different names added */
+  size_t size() const { return m_count; }
+
+  /** Is the set empty */
+  bool empty() const { return m_count == 0; }
+
+ private:
+
+  // fingerprints, with 0 for an empty slot. The size is a power of 2
+  std::vector<uint64_t> m_table;
+
+  // Bloom filter words, the size is a power of 2
+  std::vector<uint64_t> m_bloom;
+
+  size_t m_count;
+
+  static uint64_t hash(const char* s, size_t n);
+
+  // bits of the Bloom word of fingerprint h
+  static uint64_t bloom_bits(uint64_t h);
+
+  // add a fingerprint, which is not already there, with no resize
+  void insert(uint64_t h);
+
+  // double the table and Bloom filter
+  void grow();
+
+};
+
+}
+
+#endif
@@ -0,0 +1,253 @@
+#ifndef SEQLIB_READ_PREDICATE_H
+#define SEQLIB_READ_PREDICATE_H
+
+#include <cstdlib>
+#include <stdint.h>
+
+#include "SeqLib/BamRecord.h"
+
+namespace SeqLib {
+
+  namespace Filter {
+
+    /** @brief Read predicates written as C++ expressions, checked at compile time
+     *
+     * A fixed filter can be written directly in code instead of as JSON rules
+     * for a ReadFilterCollection, e.g.
+     * @code
+     * using namespace SeqLib::Filter::Pred;
+     * auto keep = mapq >= 20 && !duplicate && !secondary && clip > 5; // or pass to a template
+     * if (keep(rec)) ...
+     * @endcode
+     * Each expression is its own type, so the compiler inlines the whole
+     * test, and there is nothing to interpret per read. Flag tests joined
+     * by && and ! are folded into one mask test when the expression is made,
+     * when nothing else comes between them (e.g. !duplicate && !secondary
+     * is one comparison, after mapq >= 20 as well, but not around clip > 5).
+     *
+     * The fields are on the raw record (no GV tag trimming, as AbstractRule does).
+     * Operators evaluate left to right and stop at the first answer, as
+     * the built-in ones, so cheap tests should go first.
+     */
+    namespace Pred {
+
+      /** Base of all predicates. D is the predicate type, which implements eval */
+      template <class D>
+      struct Expr {
+
+	/** Return whether a raw read passes */
+	bool operator()(const bam1_t* b) const { return static_cast<const D&>(*this).eval(b); }
+
+	/** Return whether a read passes */
+	bool operator()(const BamRecord& r) const { return static_cast<const D&>(*this).eval(r.raw()); }
+
+      };
+
+      /** Passes if all of the ON bits and none of the OFF bits of the flag are set */
+      template <uint32_t ON, uint32_t OFF>
+      struct FlagTest : public Expr<FlagTest<ON, OFF> > {
+	bool eval(const bam1_t* b) const {
+	  // a bit both on and off never passes
+	  return !(ON & OFF) && (b->core.flag & (ON | OFF)) == ON;
+	}
+      };
+
+      template <class L, class R>
+      struct And : public Expr<And<L, R> > {
+	And(const L& l, const R& r) : left(l), right(r) {}
+	bool eval(const bam1_t* b) const { return left.eval(b) && right.eval(b); }
+	L left;
+	R right;
+      };
+
+      template <class L, class R>
+      struct Or : public Expr<Or<L, R> > {
+	Or(const L& l, const R& r) : left(l), right(r) {}
+	bool eval(const bam1_t* b) const { return left.eval(b) || right.eval(b); }
+	L left;
+	R right;
+      };
+
+      template <class E>
+      struct Not : public Expr<Not<E> > {
+	explicit Not(const E& e) : expr(e) {}
+	bool eval(const bam1_t* b) const { return !expr.eval(b); }
+	E expr;
+      };
+
+      /** An integer field of a read. F has a static get(const bam1_t*) */
+      template <class F>
+      struct Field {};
+
+      /** Compare a field to a value, with Op::apply(field, value) */
+      template <class F, class Op>
+      struct Compare : public Expr<Compare<F, Op> > {
+	explicit Compare(int64_t v) : value(v) {}
+	bool eval(const bam1_t* b) const { return Op::apply(F::get(b), value); }
+	int64_t value;
+      };
+
+      struct Less { static bool apply(int64_t a, int64_t b) { return a < b; } };
+      struct LessEqual { static bool apply(int64_t a, int64_t b) { return a <= b; } };
+      struct Greater { static bool apply(int64_t a, int64_t b) { return a > b; } };
+      struct GreaterEqual { static bool apply(int64_t a, int64_t b) { return a >= b; } };
+      struct Equal { static bool apply(int64_t a, int64_t b) { return a == b; } };
+      struct NotEqual { static bool apply(int64_t a, int64_t b) { return a != b; } };
+
+      // field op value, and value op field (e.g. 20 <= mapq is mapq >= 20)
+#define SEQLIB_PRED_COMPARE(OP, ROP, CMP)				\
+      template <class F> inline Compare<F, CMP> operator OP(const Field<F>&, int64_t v) { return Compare<F, CMP>(v); } \
+      template <class F> inline Compare<F, CMP> operator ROP(int64_t v, const Field<F>&) { return Compare<F, CMP>(v); }
+
+      SEQLIB_PRED_COMPARE(<, >, Less)
+      SEQLIB_PRED_COMPARE(<=, >=, LessEqual)
+      SEQLIB_PRED_COMPARE(>, <, Greater)
+      SEQLIB_PRED_COMPARE(>=, <=, GreaterEqual)
+      SEQLIB_PRED_COMPARE(==, ==, Equal)
+      SEQLIB_PRED_COMPARE(!=, !=, NotEqual)
+
+#undef SEQLIB_PRED_COMPARE
+
+      template <class L, class R>
+      inline And<L, R> operator&&(const Expr<L>& l, const Expr<R>& r) {
+	return And<L, R>(static_cast<const L&>(l), static_cast<const R&>(r));
+      }
+
+      template <class L, class R>
+      inline Or<L, R> operator||(const Expr<L>& l, const Expr<R>& r) {
+	return Or<L, R>(static_cast<const L&>(l), static_cast<const R&>(r));
+      }
+
+      template <class E>
+      inline Not<E> operator!(const Expr<E>& e) {
+	return Not<E>(static_cast<const E&>(e));
+      }
+
+      /** Flag tests joined by && are one flag test */
+      template <uint32_t A, uint32_t B, uint32_t C, uint32_t D>
+      inline FlagTest<A | C, B | D> operator&&(const FlagTest<A, B>&, const FlagTest<C, D>&) {
+	return FlagTest<A | C, B | D>();
+      }
+
+      // && groups left to right, so x && f1 && f2 is (x && f1) && f2. Fold f2 into f1
+      template <class L, uint32_t A, uint32_t B, uint32_t C, uint32_t D>
+      inline And<L, FlagTest<A | C, B | D> > operator&&(const And<L, FlagTest<A, B> >& l, const FlagTest<C, D>&) {
+	return And<L, FlagTest<A | C, B | D> >(l.left, FlagTest<A | C, B | D>());
+      }
+
+      // the negation of a test of one bit is a test of the bit the other way.
+      // Other flag tests (including a bit both on and off, which never
+      // passes) are negated as any expression
+      template <uint32_t ON, uint32_t OFF,
+		bool ONE_BIT = (ON & OFF) == 0 && (ON | OFF) != 0 && ((ON | OFF) & ((ON | OFF) - 1)) == 0>
+      struct _FlagNot {
+	typedef Not<FlagTest<ON, OFF> > type;
+	static type make(const FlagTest<ON, OFF>& f) { return type(f); }
+      };
+
+      template <uint32_t ON, uint32_t OFF>
+      struct _FlagNot<ON, OFF, true> {
+	typedef FlagTest<OFF, ON> type;
+	static type make(const FlagTest<ON, OFF>&) { return type(); }
+      };
+
+      template <uint32_t ON, uint32_t OFF>
+      inline typename _FlagNot<ON, OFF>::type operator!(const FlagTest<ON, OFF>& f) {
+	return _FlagNot<ON, OFF>::make(f);
+      }
+
+      // field getters
+      struct _Mapq { static int64_t get(const bam1_t* b) { return b->core.qual; } };
+      struct _ChrID { static int64_t get(const bam1_t* b) { return b->core.tid; } };
+      struct _Position { static int64_t get(const bam1_t* b) { return b->core.pos; } };
+      struct _MateChrID { static int64_t get(const bam1_t* b) { return b->core.mtid; } };
+      struct _MatePosition { static int64_t get(const bam1_t* b) { return b->core.mpos; } };
+      struct _InsertSize { static int64_t get(const bam1_t* b) { return std::labs(b->core.isize); } };
+      struct _Length { static int64_t get(const bam1_t* b) { return b->core.l_qseq; } };
+
+      struct _Clip {
+	static int64_t get(const bam1_t* b) {
+	  const uint32_t* c = bam_get_cigar(b);
+	  int64_t n = 0;
+	  for (uint32_t i = 0; i < b->core.n_cigar; ++i)
+	    if (bam_cigar_op(c[i]) == BAM_CSOFT_CLIP || bam_cigar_op(c[i]) == BAM_CHARD_CLIP)
+	      n += bam_cigar_oplen(c[i]);
+	  return n;
+	}
+      };
+
+      template <int OP>
+      struct _MaxCigarOp {
+	static int64_t get(const bam1_t* b) {
+	  const uint32_t* c = bam_get_cigar(b);
+	  int64_t n = 0;
+	  for (uint32_t i = 0; i < b->core.n_cigar; ++i)
+	    if (bam_cigar_op(c[i]) == OP && bam_cigar_oplen(c[i]) > n)
+	      n = bam_cigar_oplen(c[i]);
+	  return n;
+	}
+      };
+
+      struct _NM {
+	static int64_t get(const bam1_t* b) {
+	  const uint8_t* p = bam_aux_get(b, "NM");
+	  return p ? bam_aux2i(p) : 0;
+	}
+      };
+
+      struct _NBases {
+	static int64_t get(const bam1_t* b) {
+	  const uint8_t* s = bam_get_seq(b);
+	  int64_t n = 0;
+	  for (int32_t i = 0; i < b->core.l_qseq; ++i)
+	    n += bam_seqi(s, i) == 15;
+	  return n;
+	}
+      };
+
+      /** Mapping quality */
+      const Field<_Mapq> mapq = Field<_Mapq>();
+      /** Chromosome ID */
+      const Field<_ChrID> chr = Field<_ChrID>();
+      /** Position (0-based) */
+      const Field<_Position> pos = Field<_Position>();
+      /** Mate chromosome ID */
+      const Field<_MateChrID> mate_chr = Field<_MateChrID>();
+      /** Mate position (0-based) */
+      const Field<_MatePosition> mate_pos = Field<_MatePosition>();
+      /** Absolute insert size (TLEN) */
+      const Field<_InsertSize> isize = Field<_InsertSize>();
+      /** Length of the stored sequence */
+      const Field<_Length> length = Field<_Length>();
+      /** Number of soft and hard clipped bases */
+      const Field<_Clip> clip = Field<_Clip>();
+      /** Longest insertion */
+      const Field<_MaxCigarOp<BAM_CINS> > ins = Field<_MaxCigarOp<BAM_CINS> >();
+      /** Longest deletion */
+      const Field<_MaxCigarOp<BAM_CDEL> > del = Field<_MaxCigarOp<BAM_CDEL> >();
+      /** NM tag, or 0 if missing */
+      const Field<_NM> nm = Field<_NM>();
+      /** Number of N bases */
+      const Field<_NBases> nbases = Field<_NBases>();
+
+      /** Flag tests, named as in the JSON rules */
+      const FlagTest<BAM_FPAIRED, 0> paired = FlagTest<BAM_FPAIRED, 0>();
+      const FlagTest<BAM_FPROPER_PAIR, 0> proper_pair = FlagTest<BAM_FPROPER_PAIR, 0>();
+      const FlagTest<0, BAM_FUNMAP> mapped = FlagTest<0, BAM_FUNMAP>();
+      const FlagTest<0, BAM_FMUNMAP> mate_mapped = FlagTest<0, BAM_FMUNMAP>();
+      const FlagTest<BAM_FREVERSE, 0> rev_strand = FlagTest<BAM_FREVERSE, 0>();
+      const FlagTest<BAM_FMREVERSE, 0> mate_rev_strand = FlagTest<BAM_FMREVERSE, 0>();
+      const FlagTest<BAM_FREAD1, 0> first_mate = FlagTest<BAM_FREAD1, 0>();
+      const FlagTest<BAM_FREAD2, 0> second_mate = FlagTest<BAM_FREAD2, 0>();
+      const FlagTest<BAM_FSECONDARY, 0> secondary = FlagTest<BAM_FSECONDARY, 0>();
+      const FlagTest<BAM_FQCFAIL, 0> qcfail = FlagTest<BAM_FQCFAIL, 0>();
+      const FlagTest<BAM_FDUP, 0> duplicate = FlagTest<BAM_FDUP, 0>();
+      const FlagTest<BAM_FSUPPLEMENTARY, 0> supplementary = FlagTest<BAM_FSUPPLEMENTARY, 0>();
+
+    }
+
+  }
+
+}
+
+#endif
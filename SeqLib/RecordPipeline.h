@@ -0,0 +1,135 @@
+#ifndef SEQLIB_RECORD_PIPELINE_H
+#define SEQLIB_RECORD_PIPELINE_H
+
+#include "SeqLib/ThreadPool.h"
+#include "SeqLib/BamReader.h"
+#include "SeqLib/BamWriter.h"
+#include "SeqLib/ReadFilter.h"
+
+#ifdef HAVE_C11
+
+#include <map>
+#include <mutex>
+#include <functional>
+#include <condition_variable>
+
+namespace SeqLib {
+
+  /** @brief Process batches of reads in parallel, emitting them in input order
+   *
+   * Reads are taken from a BamReader in batches, and each batch is
+   * processed by a user function on a ThreadPool. Processed batches go into
+   * a reorder buffer keyed on their sequence number, and are passed to
+   * the output (a BamWriter or a callback) in the order they were read,
+   * so the output is the same regardless of the number of threads.
+   *
+   * Memory is bounded: at most MaxBatches() batches are being processed or
+   * waiting in the reorder buffer at once. Reading stops until the oldest
+   * batch has been written. The output is always written from the calling
+   * thread.
+   *
+   * This is the same read / process / write pattern as kt_pipeline in
+   * seqtools, with a typed interface.
+   */
+class RecordPipeline {
+
+ public:
+
+  /** Processes a batch in place. May modify, add or remove records. */
+  typedef std::function<void(BamRecordVector&)> BatchFunction;
+
+  /** Receives processed batches in input order. Return false to stop. */
+  typedef std::function<bool(const BamRecordVector&)> SinkFunction;
+
+  /** Create a pipeline on a thread pool
+   * @param tp Pool to run on. If not open, batches are processed on the calling thread.
+   * @param batch_size Number of reads per batch
+   * @param max_batches Maximum number of batches in memory. Default (0) is 4 per thread.
+   * @exception Throws an invalid_argument if batch_size is 0
+   */
+  RecordPipeline(ThreadPool tp, size_t batch_size = 1000, size_t max_batches = 0);
+
+  /** Process all remaining reads of a reader and write them to a BamWriter
+   * @param r Reader to take reads from
+   * @param f Function to apply to each batch. Called from several threads at once.
+   * @param w Opened writer, with header already written
+   * @return False if a record could not be written
+   * @exception Re-throws the first exception thrown by f, once all
+   * in-flight batches have finished.
+   */
+  bool Run(BamReader& r, BatchFunction f, BamWriter& w);
+
+  /** Process all remaining reads of a reader and pass them, in order, to a callback
+   * @param r Reader to take reads from
+   * @param f Function to apply to each batch. Called from several threads at once.
+   * @param sink Called on the calling thread with each processed batch, in input order
+   * @return False if sink returned false
+   * @exception Re-throws the first exception thrown by f, once all
+   * in-flight batches have finished.
+   */
+  bool Run(BamReader& r, BatchFunction f, SinkFunction sink);
+
+  /** Write the reads of a reader that pass a filter collection, in input order
+   *
+   * Batches are filtered on the pool with the const (thread safe)
+   * evaluation of the collection, so its counts are not updated.
+   * The collection is copied and compiled once, so does not need to be compiled.
+   * @param r Reader to take reads from
+   * @param rfc Filters to apply
+   * @param w Opened writer, with header already written
+   * @return False if a record could not be written
+   */
+  bool RunFilter(BamReader& r, const Filter::ReadFilterCollection& rfc, BamWriter& w);
+
+  /** Pass the reads of a reader that pass a filter collection, in input order, to a callback
+   * @param r Reader to take reads from
+   * @param rfc Filters to apply (see RunFilter(BamReader&, const Filter::ReadFilterCollection&, BamWriter&))
+   * @param sink Called on the calling thread with each filtered batch, in input order
+   * @return False if sink returned false
+   */
+  bool RunFilter(BamReader& r, const Filter::ReadFilterCollection& rfc, SinkFunction sink);
+
+  /** Number of reads per batch */
+  size_t BatchSize() const { return m_batch_size; }
+
+  /** Maximum number of batches being processed or waiting to be written */
+  size_t MaxBatches() const { return m_max_batches; }
+
+  /** Number of batches processed in the last Run */
+  size_t NumBatches() const { return m_next_out; }
+
+ private:
+
+  ThreadPool m_pool;
+
+  size_t m_batch_size;
+
+  size_t m_max_batches;
+
+  // reorder buffer of finished batches, keyed on sequence number
+  std::map<size_t, SeqPointer<BamRecordVector> > m_done;
+
+  // sequence number of the next batch to write
+  size_t m_next_out;
+
+  // batches read but not yet written
+  size_t m_in_flight;
+
+  std::exception_ptr m_err;
+
+  std::mutex m_mtx;
+  std::condition_variable m_cv;
+
+  // run f on a batch and put it in the reorder buffer
+  void process(size_t seq, SeqPointer<BamRecordVector> batch, const BatchFunction& f);
+
+  // write finished batches in order. If block, waits for the next one
+  // (or for an error) first. Returns false if the sink stops.
+  bool drain(const SinkFunction& sink, bool block);
+
+};
+
+}
+
+#endif
+#endif
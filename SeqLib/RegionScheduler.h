@@ -0,0 +1,173 @@
+#ifndef SEQLIB_REGION_SCHEDULER_H
+#define SEQLIB_REGION_SCHEDULER_H
+
+#include "SeqLib/ThreadPool.h"
+#include "SeqLib/GenomicRegionCollection.h"
+#include "SeqLib/GenomicTiling.h"
+
+#ifdef HAVE_C11
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+
+// tiles per worker made at a time, when running on a GenomicTiling
+#define REGION_SCHEDULER_TILE_BATCH 1024
+
+namespace SeqLib {
+
+  class RegionScheduler;
+
+  /** @brief A region handed to the work function of a RegionScheduler
+   *
+   * The end of the region may shrink while the task is running, if the
+   * scheduler splits off the remainder for an idle worker. Call Progress
+   * as the work moves along the region to allow this.
+   */
+class RegionTask {
+
+  friend class RegionScheduler;
+
+ public:
+
+  /** The region to process. pos2 may be lowered by a call to Progress */
+  const GenomicRegion& Region() const { return m_region; }
+
+  /** Report that all positions up to and including pos have been processed
+   *
+   * If a worker is idle and enough of the region is left, the region
+   * is bisected between pos and its end, and the upper half is given
+   * to another worker.
+   * @param pos Last position processed
+   * @return False if pos is past the end of the (possibly shrunk) region,
+   * in which case the work function should stop.
+   * @note To not double count, only process items that start
+   * within Region() (e.g. reads with Position() in [pos1, pos2]).
+   */
+  bool Progress(int32_t pos);
+
+ private:
+
+ RegionTask() : m_sched(NULL), m_slot(0) {}
+
+  GenomicRegion m_region;
+
+  RegionScheduler* m_sched;
+
+  // queue owned by the worker running this task
+  size_t m_slot;
+
+};
+
+  /** @brief Work-stealing scheduler for processing a set of regions on a ThreadPool
+   *
+   * Each worker has its own queue of regions, which it processes in order.
+   * A worker that runs out takes regions from the end of another worker's
+   * queue. When there is nothing left to take but a worker would be idle, long
+   * regions are bisected, either before they start or while they are
+   * running (see RegionTask::Progress). This keeps all of the threads busy
+   * when the work per region is very uneven (e.g. deep pileups).
+   *
+   * Workers run as tasks on the ThreadPool, with the calling thread as
+   * one of them. At most ThreadPool::nthreads workers run at once,
+   * which leaves one pool thread free for htslib BGZF work.
+   */
+class RegionScheduler {
+
+  friend class RegionTask;
+
+ public:
+
+  /** Work function run on each region */
+  typedef std::function<void(RegionTask&)> RegionFunction;
+
+  /** Create a scheduler that runs on a thread pool
+   * @param tp Pool to run on. If not open, all regions are run on the calling thread.
+   * @param min_width Regions are not split into pieces narrower than this
+   */
+  RegionScheduler(ThreadPool tp, int32_t min_width = 10000);
+
+  /** Process each region, returning once all are done
+   *
+   * The work function is called from several threads at once,
+   * so must be thread safe.
+   * @param regions Regions to process
+   * @param f Function to call on each region (or part of a region)
+   * @exception Re-throws the first exception thrown by f, after
+   * all other regions have been processed.
+   */
+  void Run(const GRC& regions, RegionFunction f);
+
+  /** Process each tile of a genome, returning once all are done
+   *
+   * Tiles are made in batches of REGION_SCHEDULER_TILE_BATCH per worker,
+   * and each batch is run as with Run(regions, f), so only one batch
+   * of tiles is held at a time.
+   * @param tiles Tiles to process
+   * @param f Function to call on each tile (or part of a tile)
+   * @exception Re-throws the first exception thrown by f, after the
+   * rest of its batch has been processed. Later batches are not run.
+   */
+  void Run(const GenomicTiling& tiles, RegionFunction f);
+
+  /** Number of regions taken from another worker's queue in the last Run */
+  size_t NumSteals() const { return m_steals; }
+
+  /** Number of times a region was bisected in the last Run */
+  size_t NumSplits() const { return m_splits; }
+
+ private:
+
+  struct _WorkQueue {
+    std::mutex mtx;
+    std::deque<GenomicRegion> q;
+  };
+
+  ThreadPool m_pool;
+
+  int32_t m_min_width;
+
+  RegionFunction m_func;
+
+  // one per worker slot
+  std::vector<SeqPointer<_WorkQueue> > m_queues;
+
+  size_t m_max;
+
+  // running workers, and slots without a worker. Changed under m_mtx
+  std::atomic<size_t> m_active;
+  std::vector<size_t> m_free_slots;
+  std::mutex m_mtx;
+  std::condition_variable m_done;
+
+  // regions sitting in a queue
+  std::atomic<size_t> m_queued;
+
+  std::atomic<size_t> m_steals;
+  std::atomic<size_t> m_splits;
+
+  std::exception_ptr m_err;
+
+  // worker loop, run until no work is left
+  void worker(size_t slot);
+
+  // get a region from own queue, or steal one
+  bool next_region(size_t slot, GenomicRegion& gr);
+
+  // start a worker on a free slot, if there is one
+  void launch();
+
+  // true if a worker could be started and there is nothing queued for it
+  bool want_split() const { return m_active < m_max && m_queued == 0; }
+
+  // bisect the rest of a task after pos, queueing the upper half
+  void split(RegionTask& t, int32_t pos);
+
+};
+
+}
+
+#endif
+#endif
@@ -0,0 +1,135 @@
+#ifndef SEQLIB_TABIX_REGION_COLLECTION_H
+#define SEQLIB_TABIX_REGION_COLLECTION_H
+
+#include <list>
+#include <string>
+#include <vector>
+
+#include "SeqLib/GenomicRegionCollection.h"
+
+extern "C" {
+#include "htslib/htslib/tbx.h"
+}
+
+struct tbx_delete {
+  void operator()(tbx_t* x) { if (x) tbx_destroy(x); }
+};
+
+namespace SeqLib {
+
+  /** @brief Query a bgzipped, tabix indexed BED or VCF without reading all of it
+   *
+   * Intervals are read from the file one window at a time (a whole
+   * chromosome, or a fixed width window of one), as they are needed by
+   * the queries. The last few windows are kept, each as a GRC with a flat
+   * index (see GRC::CreateIntervalArrayMap), and the least recently used is
+   * dropped when another is loaded. Memory is that of the loaded windows,
+   * not of the whole file, so this suits a large annotation queried
+   * along a region or a sorted stream of reads.
+   *
+   * Intervals are read as GRC::ReadBED and GRC::ReadVCF would read them,
+   * so queries give the same results as on a GRC of the whole file.
+   *
+   * Each object holds its own file handle and cache, so use one per
+   * thread. For region-parallel jobs, give each worker its own, to hold
+   * only the windows of its regions.
+   */
+class TabixRegionCollection {
+
+ public:
+
+  /** Create an unopened collection
+   * @param max_windows Number of windows to keep loaded
+   * @param window_width Width of each window. 0 loads whole chromosomes.
+   */
+  TabixRegionCollection(size_t max_windows = 4, int32_t window_width = 0);
+
+  /** Open a bgzipped BED or VCF, with its .tbi or .csi index
+   * @param file Path to the bgzipped file
+   * @param hdr Dictionary to convert chromosome names to IDs, as in GRC::ReadBED
+   * @return False if the file or its index could not be opened
+   */
+  bool Open(const std::string& file, const BamHeader& hdr);
+
+  /** Close the file and drop the loaded windows */
+  void Close();
+
+  /** Is a file open? */
+  bool IsOpen() const { return m_tbx.get() != NULL; }
+
+  /** Return the intervals of the window holding a position, loading it if needed
+   *
+   * The intervals are those that overlap the window (so an interval
+   * that spans windows is in each of them), with the index already built.
+   * @note The reference is good until the window is dropped by a later
+   * load, so until at most max_windows other windows have been used.
+   * @exception Throws a runtime_error if no file is open
+   */
+  const GRC& Window(int32_t chr, int32_t pos);
+
+  /** Return the intervals that overlap a region, trimmed to it
+   * @see GRC::FindOverlaps(const K& gr, bool)
+   */
+  GRC FindOverlaps(const GenomicRegion& gr, bool ignore_strand);
+
+  /** Return the number of intervals that overlap a region */
+  size_t CountOverlaps(const GenomicRegion& gr);
+
+  /** Check if any interval overlaps a region */
+  bool AnyOverlap(const GenomicRegion& gr, bool ignore_strand);
+
+  /** Number of windows loaded now */
+  size_t NumWindows() const { return m_windows.size(); }
+
+  /** Number of times a window (or a region spanning windows) has been read from the file */
+  size_t NumLoads() const { return m_loads; }
+
+ private:
+
+  // not copyable, as the file handle can't be shared
+  TabixRegionCollection(const TabixRegionCollection&);
+  TabixRegionCollection& operator=(const TabixRegionCollection&);
+
+  struct _Window {
+    int32_t chr;
+    int32_t start;
+    int32_t end;
+    GRC grc;
+  };
+
+  size_t m_max_windows;
+
+  int32_t m_window_width;
+
+  SeqPointer<htsFile> m_fp;
+
+  SeqPointer<tbx_t> m_tbx;
+
+  BamHeader m_hdr;
+
+  // true if the file is a VCF, read as GRC::ReadVCF
+  bool m_vcf;
+
+  // tabix sequence ID for each header sequence ID, or -1
+  std::vector<int> m_tid;
+
+  // most recently used first
+  std::list<_Window> m_windows;
+
+  size_t m_loads;
+
+  // bounds of the window holding a position
+  void window_bounds(int32_t pos, int32_t& start, int32_t& end) const;
+
+  // read all intervals that may overlap [start, end] into a GRC, with its index built
+  void load(int32_t chr, int32_t start, int32_t end, GRC& grc);
+
+  // intervals for a query, from the cached window if it fits in one,
+  // otherwise read just for this query into tmp
+  const GRC& intervals_for(const GenomicRegion& gr, GRC& tmp);
+
+};
+
+}
+
+#endif
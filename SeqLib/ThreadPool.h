@@ -5,27 +5,370 @@
 #include "SeqLib/BamWalker.h"
 #include "htslib/thread_pool.h"
 
+#ifdef HAVE_C11
+#include <functional>
+#include <future>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <thread>
+#include <map>
+#endif
+
+// number of queued tasks allowed per thread before Submit blocks
+#define TASKS_PER_THREAD 16
+
 namespace SeqLib{
 
+#ifdef HAVE_C11
+  /** @brief Snapshot of the activity of a ThreadPool
+   *
+   * Only tasks run through Submit and ParallelFor are timed. htslib
+   * does not report the time its BGZF jobs take, so that time is
+   * counted in OtherTime, together with the time threads were idle.
+   */
+struct ThreadPoolStats {
+
+ ThreadPoolStats() : nthreads(0), queued(0), completed(0), running(0), waiting(0),
+    elapsed(0), mean_wait(0), task_time(0), other_time(0) {}
+
+  size_t nthreads; ///< Threads in the pool
+
+  size_t queued; ///< Tasks submitted
+
+  size_t completed; ///< Tasks finished
+
+  size_t running; ///< Tasks running now
+
+  size_t waiting; ///< Tasks submitted but not yet started (queue depth)
+
+  double elapsed; ///< Seconds since the pool was created
+
+  double mean_wait; ///< Mean seconds between submitting a task and it starting
+
+  double task_time; ///< Total seconds spent in tasks, over all threads
+
+  double other_time; ///< Thread seconds not spent in tasks (htslib BGZF work, or idle)
+
+  std::vector<double> busy; ///< Fraction of elapsed time each thread spent in tasks
+
+  /** Return the stats as a single line JSON object */
+  std::string AsJSON() const;
+
+};
+
+  // shared counters of a ThreadPool and its copies
+struct _ThreadPoolStats {
+
+  _ThreadPoolStats(size_t n) : nthreads(n), queued(0), completed(0), running(0), wait_ns(0),
+    start(now()), dump_stop(false) {}
+
+  ~_ThreadPoolStats() { stop_dump(); }
+
+  static uint64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  // times a task while in scope
+  struct Timer {
+  Timer(_ThreadPoolStats& s, uint64_t queued_at) : st(s), t0(now()) {
+      st.wait_ns += t0 - queued_at;
+      ++st.running;
+    }
+    ~Timer() {
+      uint64_t t = now() - t0;
+      {
+	std::lock_guard<std::mutex> lock(st.mtx);
+	st.busy_ns[std::this_thread::get_id()] += t;
+      }
+      --st.running;
+      ++st.completed;
+    }
+    _ThreadPoolStats& st;
+    uint64_t t0;
+  };
+
+  size_t nthreads;
+  std::atomic<size_t> queued;
+  std::atomic<size_t> completed;
+  std::atomic<size_t> running;
+  std::atomic<uint64_t> wait_ns;
+  uint64_t start;
+
+  std::mutex mtx;
+  std::map<std::thread::id, uint64_t> busy_ns;
+
+  // periodic dump
+  std::thread dump_thread;
+  std::mutex dump_mtx;
+  std::condition_variable dump_cv;
+  bool dump_stop;
+
+  ThreadPoolStats snapshot();
+
+  bool start_dump(const std::string& file, double seconds);
+
+  void stop_dump();
+
+};
+#endif
+
+/** Pool of threads shared by htslib (BGZF compression / decompression)
+ * and user tasks.
+ *
+ * Pass the pool to BamReader::SetThreadPool and BamWriter::SetThreadPool
+ * to have htslib use it, and use Submit and ParallelFor (C++11 only) to
+ * run other work on the same threads. Copies of a ThreadPool share
+ * the same threads and task queue.
+ */
 class ThreadPool {
 
- public: 
-  
+ public:
+
  ThreadPool() : nthreads(1) { p.pool = NULL; }
 
- ThreadPool(int n) : nthreads(1) {
+ ThreadPool(int n) : nthreads(n) {
     p.pool = NULL;
     if (n < 1)
       throw std::invalid_argument( "n threads must be > 0");
-    if (!(p.pool = hts_tpool_init(n))) 
+    if (!(p.pool = hts_tpool_init(n)))
       throw std::runtime_error( "Error creating thread pool");
+#ifdef HAVE_C11
+    hts_tpool_process* q = hts_tpool_process_init(p.pool, n * TASKS_PER_THREAD, 1);
+    if (!q)
+      throw std::runtime_error( "Error creating thread pool task queue");
+    m_tasks = SeqPointer<hts_tpool_process>(q, destroy_tasks);
+    m_stats = SeqPointer<_ThreadPoolStats>(new _ThreadPoolStats(n));
+#endif
   }
 
   bool IsOpen() { return p.pool != NULL; }
 
+#ifdef HAVE_C11
+  /** Run a callable on the pool
+   *
+   * Blocks if the task queue is full. If the pool is not open, or if
+   * called from a task on this pool, the task is run immediately on
+   * the calling thread (a task waiting on tasks queued behind it could
+   * hold up every thread). Use ParallelFor for work split within a task.
+   * @param f Callable taking no arguments
+   * @return Future holding the return value (or exception) of f
+   */
+  template <typename F>
+  std::future<typename std::result_of<F()>::type> Submit(F f) {
+
+    typedef typename std::result_of<F()>::type R;
+    SeqPointer<std::packaged_task<R()> > task(new std::packaged_task<R()>(f));
+    std::future<R> fut = task->get_future();
+
+    if (!IsOpen() || in_task() || !dispatch([task]() { (*task)(); }, false))
+      (*task)();
+
+    return fut;
+  }
+
+  /** Block until all tasks submitted with Submit have finished
+   *
+   * Do not call from a task on this pool, which would wait for itself.
+   * Wait on the futures from Submit instead.
+   * @exception Throws a logic_error if called from a task on this pool
+   */
+  void Wait() {
+    if (in_task())
+      throw std::logic_error("ThreadPool::Wait - called from a task on the same pool");
+    if (IsOpen())
+      hts_tpool_process_flush(m_tasks.get());
+  }
+
+  /** Call f(i) for each i in [begin, end) using the pool
+   *
+   * The range is split into chunks that are taken up by the pool threads
+   * as they become free. The calling thread also processes chunks, so it
+   * is safe to call ParallelFor from within a task running on the pool.
+   * Returns once all calls have finished. If any call throws, the
+   * first exception is re-thrown here after the remaining calls finish.
+   * @param begin First index
+   * @param end One past the last index
+   * @param f Callable taking a size_t index
+   */
+  template <typename F>
+  void ParallelFor(size_t begin, size_t end, F f) {
+
+    if (end <= begin)
+      return;
+
+    size_t n = end - begin;
+    size_t chunk = n / (nthreads * 4);
+    if (!chunk)
+      chunk = 1;
+
+    SeqPointer<_RangeJob> job(new _RangeJob(begin, end, chunk));
+    job->func = [&f](size_t b, size_t e) { for (size_t i = b; i < e; ++i) f(i); };
+
+    // helpers that find no work left (queue full, or already done) just return
+    if (IsOpen()) {
+      size_t helpers = std::min<size_t>(nthreads, (n + chunk - 1) / chunk) - 1;
+      for (size_t i = 0; i < helpers; ++i)
+	if (!dispatch([job]() { job->work(); }, true))
+	  break;
+    }
+
+    job->work();
+
+    std::unique_lock<std::mutex> lock(job->mtx);
+    job->cv.wait(lock, [&job] { return job->done == job->nchunks; });
+    if (job->err)
+      std::rethrow_exception(job->err);
+  }
+
+  /** Call f(c[i]) for each element of a container with size() and operator[]
+   *
+   * Works on std::vector, GRC, BamRecordVector etc.
+   * @param c Container to iterate over
+   * @param f Callable taking an element of c
+   */
+  template <typename C, typename F>
+  void ParallelFor(C& c, F f) {
+    ParallelFor(0, c.size(), [&c, &f](size_t i) { f(c[i]); });
+  }
+
+  /** Return counts and timings of the tasks run on the pool
+   *
+   * Stats are shared between copies of a ThreadPool. If the
+   * pool is not open, all values are zero.
+   */
+  ThreadPoolStats Stats() const {
+    return m_stats ? m_stats->snapshot() : ThreadPoolStats();
+  }
+
+  /** Periodically append a JSON line of Stats() to a file
+   *
+   * Replaces any dump already running on this pool.
+   * @param file File to append to, or "-" for stderr
+   * @param seconds Interval between dumps
+   * @return False if the pool is not open or the file cannot be opened
+   */
+  bool StartStatsDump(const std::string& file, double seconds) {
+    return m_stats && m_stats->start_dump(file, seconds);
+  }
+
+  /** Stop the periodic stats dump, if one is running */
+  void StopStatsDump() {
+    if (m_stats)
+      m_stats->stop_dump();
+  }
+#endif
+
   htsThreadPool p;
   size_t nthreads;
 
+ private:
+
+#ifdef HAVE_C11
+  // queue of user tasks, on the same threads as htslib
+  SeqPointer<hts_tpool_process> m_tasks;
+
+  SeqPointer<_ThreadPoolStats> m_stats;
+
+  // wait for running tasks to let go of the queue before freeing it
+  static void destroy_tasks(hts_tpool_process* q) {
+    hts_tpool_process_flush(q);
+    hts_tpool_process_destroy(q);
+  }
+
+  // shared state of a ParallelFor, outlives the call if helpers are still queued
+  struct _RangeJob {
+
+  _RangeJob(size_t b, size_t e, size_t c) : begin(b), end(e), chunk(c),
+      nchunks((e - b + c - 1) / c), next(0), done(0) {}
+
+    size_t begin, end, chunk, nchunks;
+    std::function<void(size_t, size_t)> func;
+    std::atomic<size_t> next;
+    size_t done;
+    std::exception_ptr err;
+    std::mutex mtx;
+    std::condition_variable cv;
+
+    // take chunks until none are left
+    void work() {
+      size_t i;
+      while ((i = next++) < nchunks) {
+	size_t b = begin + i * chunk;
+	size_t e = std::min(end, b + chunk);
+	std::exception_ptr ex;
+	try {
+	  func(b, e);
+	} catch (...) {
+	  ex = std::current_exception();
+	}
+	std::lock_guard<std::mutex> lock(mtx);
+	if (ex && !err)
+	  err = ex;
+	if (++done == nchunks)
+	  cv.notify_all();
+      }
+    }
+  };
+
+  // task queue of the task running on this thread, if any
+  static hts_tpool_process*& current_tasks() {
+    static thread_local hts_tpool_process* q = NULL;
+    return q;
+  }
+
+  // marks the thread as running a task of queue q
+  struct _TaskScope {
+    explicit _TaskScope(hts_tpool_process* q) : prev(current_tasks()) { current_tasks() = q; }
+    ~_TaskScope() { current_tasks() = prev; }
+    hts_tpool_process* prev;
+  };
+
+  // is the calling thread running a task of this pool
+  bool in_task() const {
+    return m_tasks && current_tasks() == m_tasks.get();
+  }
+
+  // queue a task, timing it if stats are kept. Returns false if
+  // nonblock and the queue is full
+  bool dispatch(const std::function<void()>& fn, bool nonblock) {
+
+    std::function<void()>* job;
+    hts_tpool_process* q = m_tasks.get();
+    if (m_stats) {
+      SeqPointer<_ThreadPoolStats> st = m_stats;
+      uint64_t t0 = st->now();
+      job = new std::function<void()>([fn, st, t0, q]() {
+	  _ThreadPoolStats::Timer t(*st, t0);
+	  _TaskScope s(q);
+	  fn();
+	});
+      ++st->queued;
+    } else {
+      job = new std::function<void()>([fn, q]() {
+	  _TaskScope s(q);
+	  fn();
+	});
+    }
+
+    if (hts_tpool_dispatch2(p.pool, m_tasks.get(), run_function, job, nonblock) < 0) {
+      if (m_stats)
+	--m_stats->queued;
+      delete job;
+      return false;
+    }
+    return true;
+  }
+
+  static void* run_function(void* arg) {
+    std::function<void()>* fn = static_cast<std::function<void()>*>(arg);
+    (*fn)();
+    delete fn;
+    return NULL;
+  }
+#endif
+
 };
 
 }
@@ -12,6 +12,12 @@
 #include "SeqLib/FermiAssembler.h"
 #include "SeqLib/SeqPlot.h"
 #include "SeqLib/RefGenome.h"
+#include "SeqLib/BamConcatenator.h"
+#include "SeqLib/RegionScheduler.h"
+#include "SeqLib/RecordPipeline.h"
+#include "SeqLib/TabixRegionCollection.h"
+#include "SeqLib/GenomicTiling.h"
+#include "SeqLib/ReadPredicate.h"
 
 #define GZBED "test_data/test.bed.gz"
 #define GZVCF "test_data/test.vcf.gz"
@@ -29,6 +35,7 @@ using namespace SeqLib::Filter;
 using namespace SeqLib;
 
 #include <fstream>
+#include <set>
 #include "SeqLib/BFC.h"
 
 BOOST_AUTO_TEST_CASE( read_gzbed ) {
@@ -1571,3 +1578,1326 @@ BOOST_AUTO_TEST_CASE ( set_cigar ) {
 
 
 }
+
+BOOST_AUTO_TEST_CASE ( bam_concatenate ) {
+
+  SeqLib::BamConcatenator bc;
+
+  BOOST_CHECK(!bc.Concatenate("tmp_cat.bam")); // no inputs yet
+  BOOST_CHECK(!bc.Add(BEDFILE)); // only BAM is allowed
+  BOOST_CHECK(bc.Add(SBAM));
+  BOOST_CHECK(bc.Add(SBAM));
+  BOOST_CHECK_EQUAL(bc.size(), 2);
+
+  SeqLib::BamRecord rec;
+  size_t n_in = 0;
+  SeqLib::BamReader r;
+  r.Open(SBAM);
+  while (r.GetNextRecord(rec))
+    ++n_in;
+
+  // raw block copy
+  BOOST_CHECK(bc.Concatenate("tmp_cat.bam"));
+  size_t n_out = 0;
+  SeqLib::BamReader rc;
+  BOOST_CHECK(rc.Open("tmp_cat.bam"));
+  while (rc.GetNextRecord(rec))
+    ++n_out;
+  BOOST_CHECK_EQUAL(n_out, 2 * n_in);
+
+  // same file twice overlaps, so falls back to record merge
+  BOOST_CHECK(bc.Merge("tmp_merge.bam"));
+  n_out = 0;
+  SeqLib::BamReader rm;
+  BOOST_CHECK(rm.Open("tmp_merge.bam"));
+  uint32_t last_chr = 0;
+  int32_t last_pos = -1;
+  bool sorted = true;
+  while (rm.GetNextRecord(rec)) {
+    ++n_out;
+    // in coordinate order, with the unplaced reads (chr -1) last
+    uint32_t chr = static_cast<uint32_t>(rec.ChrID());
+    sorted = sorted && (chr > last_chr || (chr == last_chr && rec.Position() >= last_pos));
+    last_chr = chr;
+    last_pos = rec.Position();
+  }
+  BOOST_CHECK_EQUAL(n_out, 2 * n_in);
+  BOOST_CHECK(sorted);
+
+  // shards that don't interleave, the first with its last record split
+  // across two blocks, so its last block does not start at a record
+  SeqLib::BamReader rs;
+  rs.Open(SBAM);
+  std::vector<SeqLib::BamRecord> first_chr;
+  SeqLib::BamWriter ws(SeqLib::BAM);
+  ws.Open("tmp_shard2.bam");
+  ws.SetHeader(rs.Header());
+  ws.WriteHeader();
+  while (rs.GetNextRecord(rec)) {
+    if (first_chr.empty() || rec.ChrID() == first_chr[0].ChrID())
+      first_chr.push_back(rec);
+    else
+      ws.WriteRecord(rec);
+  }
+  ws.Close();
+  BOOST_REQUIRE(first_chr.size() > 1);
+
+  BGZF* fs = bgzf_open("tmp_shard1.bam", "w");
+  BOOST_REQUIRE(fs);
+  BOOST_CHECK(bam_hdr_write(fs, rs.Header().get()) >= 0);
+  for (size_t i = 0; i + 1 < first_chr.size(); ++i)
+    BOOST_CHECK(bam_write1(fs, first_chr[i].raw()) >= 0);
+
+  // the last record as bam_write1 lays it out (little-endian), less the name padding
+  const bam1_t* b = first_chr.back().raw();
+  const bam1_core_t& c = b->core;
+  uint32_t l_qname = c.l_qname - c.l_extranul;
+  uint32_t fixed[9] = { 32 + b->l_data - c.l_extranul, static_cast<uint32_t>(c.tid), static_cast<uint32_t>(c.pos),
+			static_cast<uint32_t>(c.bin) << 16 | static_cast<uint32_t>(c.qual) << 8 | l_qname,
+			static_cast<uint32_t>(c.flag) << 16 | c.n_cigar, static_cast<uint32_t>(c.l_qseq),
+			static_cast<uint32_t>(c.mtid), static_cast<uint32_t>(c.mpos), static_cast<uint32_t>(c.isize) };
+  std::string raw(reinterpret_cast<const char*>(fixed), sizeof(fixed));
+  raw.append(reinterpret_cast<const char*>(b->data), l_qname);
+  raw.append(reinterpret_cast<const char*>(b->data) + c.l_qname, b->l_data - c.l_qname);
+  size_t half = raw.size() / 2;
+  BOOST_CHECK(bgzf_write(fs, raw.data(), half) >= 0);
+  BOOST_CHECK(bgzf_flush(fs) >= 0);
+  BOOST_CHECK(bgzf_write(fs, raw.data() + half, raw.size() - half) >= 0);
+  BOOST_CHECK(bgzf_close(fs) >= 0);
+
+  SeqLib::BamConcatenator bs;
+  BOOST_CHECK(bs.Add("tmp_shard1.bam"));
+  BOOST_CHECK(bs.Add("tmp_shard2.bam"));
+  BOOST_CHECK(bs.Merge("tmp_merge.bam"));
+  n_out = 0;
+  SeqLib::BamReader rsm;
+  BOOST_CHECK(rsm.Open("tmp_merge.bam"));
+  last_chr = 0;
+  last_pos = -1;
+  sorted = true;
+  while (rsm.GetNextRecord(rec)) {
+    ++n_out;
+    uint32_t chr = static_cast<uint32_t>(rec.ChrID());
+    sorted = sorted && (chr > last_chr || (chr == last_chr && rec.Position() >= last_pos));
+    last_chr = chr;
+    last_pos = rec.Position();
+  }
+  BOOST_CHECK_EQUAL(n_out, n_in);
+  BOOST_CHECK(sorted);
+
+}
+
+BOOST_AUTO_TEST_CASE ( thread_pool_tasks ) {
+
+  SeqLib::ThreadPool tp(4);
+  BOOST_CHECK_EQUAL(tp.nthreads, 4);
+
+  // futures
+  std::vector<std::future<int> > res;
+  for (int i = 0; i < 100; ++i)
+    res.push_back(tp.Submit([i]() { return i * 2; }));
+  for (int i = 0; i < 100; ++i)
+    BOOST_CHECK_EQUAL(res[i].get(), i * 2);
+
+  // exceptions come back through the future
+  std::future<int> bad = tp.Submit([]() -> int { throw std::runtime_error("fail"); });
+  BOOST_CHECK_THROW(bad.get(), std::runtime_error);
+
+  // parallel for over an index range
+  std::vector<int> v(1000, 0);
+  tp.ParallelFor(0, v.size(), [&v](size_t i) { v[i] = i; });
+  for (size_t i = 0; i < v.size(); ++i)
+    BOOST_CHECK_EQUAL(v[i], static_cast<int>(i));
+
+  // and over a GRC, nested inside a task
+  SeqLib::GRC grc;
+  for (int i = 0; i < 100; ++i)
+    grc.add(SeqLib::GenomicRegion(0, i * 10, i * 10 + 5));
+  std::atomic<int> width(0);
+  tp.Submit([&]() { tp.ParallelFor(grc, [&width](const SeqLib::GenomicRegion& g) { width += g.Width(); }); }).get();
+  BOOST_CHECK_EQUAL(width.load(), 600);
+
+  // tasks on every thread submitting more tasks, which run in place. A task may not Wait
+  std::atomic<int> ran(0);
+  std::vector<std::future<void> > outer;
+  for (int t = 0; t < 4; ++t)
+    outer.push_back(tp.Submit([&]() {
+	  std::vector<std::future<void> > inner;
+	  for (int i = 0; i < 1000; ++i)
+	    inner.push_back(tp.Submit([&ran]() { ++ran; }));
+	  for (size_t i = 0; i < inner.size(); ++i)
+	    inner[i].get();
+	}));
+  for (size_t t = 0; t < outer.size(); ++t)
+    outer[t].get();
+  BOOST_CHECK_EQUAL(ran.load(), 4000);
+  BOOST_CHECK_THROW(tp.Submit([&tp]() { tp.Wait(); }).get(), std::logic_error);
+
+  // pool shares threads with the reader
+  SeqLib::BamReader r;
+  r.Open(SBAM);
+  r.SetThreadPool(tp);
+  SeqLib::BamRecord rec;
+  size_t count = 0;
+  while (r.GetNextRecord(rec))
+    ++count;
+  BOOST_CHECK(count > 0);
+  tp.Wait();
+
+  // not open, so tasks run in place
+  SeqLib::ThreadPool empty;
+  BOOST_CHECK_EQUAL(empty.Submit([]() { return 1; }).get(), 1);
+  std::vector<int> w(10, 0);
+  empty.ParallelFor(w, [](int& x) { ++x; });
+  BOOST_CHECK_EQUAL(w[9], 1);
+
+}
+
+BOOST_AUTO_TEST_CASE ( region_scheduler ) {
+
+  SeqLib::ThreadPool tp(4);
+  SeqLib::RegionScheduler rs(tp, 1000);
+
+  // one long region, and lots of short ones
+  SeqLib::GRC grc;
+  grc.add(SeqLib::GenomicRegion(0, 0, 999999));
+  for (int i = 0; i < 50; ++i)
+    grc.add(SeqLib::GenomicRegion(1, i * 100, i * 100 + 50));
+
+  // every position is seen exactly once, even when regions are split
+  std::atomic<long> covered(0);
+  std::atomic<long> sum(0);
+  rs.Run(grc, [&](SeqLib::RegionTask& t) {
+      for (int32_t pos = t.Region().pos1; t.Progress(pos); ++pos) {
+	++covered;
+	sum += pos;
+      }
+    });
+  BOOST_CHECK_EQUAL(covered.load(), 1000000 + 50 * 51);
+  long expected = 999999L * 1000000L / 2;
+  for (int i = 0; i < 50; ++i)
+    for (int j = i * 100; j <= i * 100 + 50; ++j)
+      expected += j;
+  BOOST_CHECK_EQUAL(sum.load(), expected);
+  BOOST_CHECK(rs.NumSplits() > 0);
+
+  // exceptions are passed back
+  BOOST_CHECK_THROW(rs.Run(grc, [](SeqLib::RegionTask&) { throw std::runtime_error("fail"); }), std::runtime_error);
+
+  // no pool, so everything on this thread
+  SeqLib::RegionScheduler rs1(SeqLib::ThreadPool(), 1000);
+  covered = 0;
+  rs1.Run(grc, [&covered](SeqLib::RegionTask& t) { covered += t.Region().Width(); });
+  BOOST_CHECK_EQUAL(covered.load(), 1000000 + 50 * 51);
+  BOOST_CHECK_EQUAL(rs1.NumSplits(), 0);
+
+  BOOST_CHECK_THROW(SeqLib::RegionScheduler(tp, 0), std::invalid_argument);
+}
+
+BOOST_AUTO_TEST_CASE ( record_pipeline ) {
+
+  SeqLib::ThreadPool tp(4);
+  SeqLib::RecordPipeline rp(tp, 100, 4);
+  BOOST_CHECK_EQUAL(rp.BatchSize(), 100);
+  BOOST_CHECK_EQUAL(rp.MaxBatches(), 4);
+
+  // read names in input order
+  std::vector<std::string> names;
+  SeqLib::BamReader r;
+  r.Open(SBAM);
+  SeqLib::BamRecord rec;
+  while (r.GetNextRecord(rec))
+    names.push_back(rec.Qname());
+
+  // drop unmapped reads, keep order
+  SeqLib::BamReader r2;
+  r2.Open(SBAM);
+  std::vector<std::string> out;
+  bool ok = rp.Run(r2, [](SeqLib::BamRecordVector& b) {
+      SeqLib::BamRecordVector keep;
+      for (size_t i = 0; i < b.size(); ++i)
+	if (b[i].MappedFlag())
+	  keep.push_back(b[i]);
+      b.swap(keep);
+    }, [&out](const SeqLib::BamRecordVector& b) {
+      for (size_t i = 0; i < b.size(); ++i)
+	out.push_back(b[i].Qname());
+      return true;
+    });
+  BOOST_CHECK(ok);
+  BOOST_CHECK_EQUAL(rp.NumBatches(), (names.size() + 99) / 100);
+
+  SeqLib::BamReader r3;
+  r3.Open(SBAM);
+  size_t j = 0;
+  while (r3.GetNextRecord(rec))
+    if (rec.MappedFlag()) {
+      BOOST_REQUIRE(j < out.size());
+      BOOST_CHECK_EQUAL(out[j++], rec.Qname());
+    }
+  BOOST_CHECK_EQUAL(j, out.size());
+
+  // straight to a writer
+  SeqLib::BamReader r4;
+  r4.Open(SBAM);
+  SeqLib::BamWriter w(SeqLib::BAM);
+  w.SetHeader(r4.Header());
+  w.Open("tmp_pipeline.bam");
+  w.WriteHeader();
+  BOOST_CHECK(rp.Run(r4, [](SeqLib::BamRecordVector&) {}, w));
+  w.Close();
+
+  SeqLib::BamReader r5;
+  r5.Open("tmp_pipeline.bam");
+  j = 0;
+  while (r5.GetNextRecord(rec))
+    BOOST_CHECK_EQUAL(rec.Qname(), names[j++]);
+  BOOST_CHECK_EQUAL(j, names.size());
+
+  // sink can stop early
+  SeqLib::BamReader r6;
+  r6.Open(SBAM);
+  BOOST_CHECK(!rp.Run(r6, [](SeqLib::BamRecordVector&) {}, [](const SeqLib::BamRecordVector&) { return false; }));
+
+  BOOST_CHECK_THROW(SeqLib::RecordPipeline(tp, 0), std::invalid_argument);
+}
+
+BOOST_AUTO_TEST_CASE ( thread_pool_stats ) {
+
+  SeqLib::ThreadPool tp(2);
+
+  std::vector<std::future<int> > res;
+  for (int i = 0; i < 20; ++i)
+    res.push_back(tp.Submit([i]() { return i; }));
+  for (size_t i = 0; i < res.size(); ++i)
+    res[i].get();
+  tp.Wait();
+
+  SeqLib::ThreadPoolStats s = tp.Stats();
+  BOOST_CHECK_EQUAL(s.nthreads, 2);
+  BOOST_CHECK_EQUAL(s.queued, 20);
+  BOOST_CHECK_EQUAL(s.completed, 20);
+  BOOST_CHECK_EQUAL(s.waiting, 0);
+  BOOST_CHECK_EQUAL(s.busy.size(), 2);
+  BOOST_CHECK(s.elapsed > 0);
+  BOOST_CHECK(s.AsJSON().find("\"completed\":20") != std::string::npos);
+
+  // shared with copies
+  SeqLib::ThreadPool cp = tp;
+  BOOST_CHECK_EQUAL(cp.Stats().queued, 20);
+
+  BOOST_CHECK(tp.StartStatsDump("tmp_pool_stats.json", 0.01));
+  tp.StopStatsDump();
+  BOOST_CHECK(!tp.StartStatsDump("tmp_pool_stats.json", 0));
+
+  // closed pool keeps no stats
+  SeqLib::ThreadPool closed;
+  BOOST_CHECK_EQUAL(closed.Stats().queued, 0);
+  BOOST_CHECK(!closed.StartStatsDump("tmp_pool_stats.json", 1));
+}
+
+BOOST_AUTO_TEST_CASE ( interval_array_queries ) {
+
+  // same answers as the interval tree
+  SeqLib::GRC grc, query;
+  for (int i = 0; i < 5000; ++i) {
+    int pos = rand() % 100000;
+    grc.add(SeqLib::GenomicRegion(rand() % 3, pos, pos + rand() % 1000));
+  }
+  for (int i = 0; i < 1000; ++i) {
+    int pos = rand() % 100000;
+    query.add(SeqLib::GenomicRegion(rand() % 4, pos, pos + rand() % 1000));
+  }
+
+  grc.CreateTreeMap();
+  std::vector<int32_t> q1, s1, q2, s2;
+  SeqLib::GRC res1 = query.FindOverlaps(grc, q1, s1, true);
+  size_t count1 = 0;
+  for (size_t i = 0; i < query.size(); ++i)
+    count1 += grc.CountOverlaps(query[i]);
+
+  grc.CreateIntervalArrayMap();
+  BOOST_CHECK_EQUAL(grc.GetTree()->size(), 0);
+  BOOST_CHECK_EQUAL(grc.NumTree(), 3);
+  SeqLib::GRC res2 = query.FindOverlaps(grc, q2, s2, true);
+  size_t count2 = 0;
+  for (size_t i = 0; i < query.size(); ++i)
+    count2 += grc.CountOverlaps(query[i]);
+
+  BOOST_CHECK_EQUAL(count1, count2);
+  BOOST_CHECK_EQUAL(res1.size(), res2.size());
+  BOOST_CHECK_EQUAL(res1.TotalWidth(), res2.TotalWidth());
+  std::set<std::pair<int32_t, int32_t> > h1, h2;
+  for (size_t i = 0; i < q1.size(); ++i) {
+    h1.insert(std::pair<int32_t, int32_t>(q1[i], s1[i]));
+    h2.insert(std::pair<int32_t, int32_t>(q2[i], s2[i]));
+  }
+  BOOST_CHECK(h1 == h2);
+
+  // contained, and closed ends
+  SeqLib::GenomicIntervalVector giv;
+  giv.push_back(SeqLib::GenomicInterval(10, 20, 0));
+  giv.push_back(SeqLib::GenomicInterval(5, 30, 1));
+  giv.push_back(SeqLib::GenomicInterval(21, 25, 2));
+  SeqLib::GenomicIntervalArray ia(giv);
+  BOOST_CHECK(giv.empty());
+  BOOST_CHECK_EQUAL(ia.size(), 3);
+  BOOST_CHECK_EQUAL(ia.findOverlapping(20, 20).size(), 2);
+  BOOST_CHECK_EQUAL(ia.findOverlapping(31, 40).size(), 0);
+  BOOST_CHECK_EQUAL(ia.findContained(10, 25).size(), 2);
+}
+
+BOOST_AUTO_TEST_CASE ( sweep_overlaps ) {
+
+  SeqLib::GRC subject, query;
+  for (int i = 0; i < 2000; ++i) {
+    int pos = rand() % 100000;
+    subject.add(SeqLib::GenomicRegion(rand() % 3, pos, pos + rand() % 2000));
+  }
+  for (int i = 0; i < 500; ++i) {
+    int pos = rand() % 100000;
+    query.add(SeqLib::GenomicRegion(rand() % 4, pos, pos + rand() % 500));
+  }
+  subject.CoordinateSort();
+  query.CoordinateSort();
+
+  // no tree needed when both are sorted
+  std::vector<int32_t> q1, s1, q2, s2;
+  SeqLib::GRC res1 = query.FindOverlaps(subject, q1, s1, true);
+  BOOST_CHECK_EQUAL(subject.NumTree(), 0);
+
+  // tree lookup gives the same pairs
+  subject.CreateTreeMap();
+  query.Shuffle();
+  SeqLib::GRC res2 = query.FindOverlaps(subject, q2, s2, true);
+  BOOST_CHECK_EQUAL(res1.size(), res2.size());
+  BOOST_CHECK_EQUAL(res1.TotalWidth(), res2.TotalWidth());
+
+  std::set<std::pair<int32_t, int32_t> > h1, h2;
+  query.CoordinateSort();
+  for (size_t i = 0; i < q2.size(); ++i)
+    h2.insert(std::pair<int32_t, int32_t>(res2[i].pos1, s2[i]));
+  for (size_t i = 0; i < q1.size(); ++i)
+    h1.insert(std::pair<int32_t, int32_t>(res1[i].pos1, s1[i]));
+  BOOST_CHECK(h1 == h2);
+
+  // pairs come out in query order
+  for (size_t i = 1; i < q1.size(); ++i)
+    BOOST_CHECK(q1[i-1] <= q1[i]);
+}
+
+struct OverlapStopper {
+  OverlapStopper() : n(0) {}
+  bool operator()(size_t) { return ++n < 2; }
+  int n;
+};
+
+BOOST_AUTO_TEST_CASE ( visitor_overlaps ) {
+
+  SeqLib::GRC grc;
+  grc.add(SeqLib::GenomicRegion(0, 10, 100, '+'));
+  grc.add(SeqLib::GenomicRegion(0, 50, 150, '-'));
+  grc.add(SeqLib::GenomicRegion(0, 90, 200, '+'));
+  grc.add(SeqLib::GenomicRegion(1, 10, 100, '+'));
+
+  BOOST_CHECK_THROW(grc.AnyOverlap(SeqLib::GenomicRegion(0, 1, 5), true), std::logic_error);
+
+  for (int i = 0; i < 2; ++i) {
+
+    if (i)
+      grc.CreateIntervalArrayMap();
+    else
+      grc.CreateTreeMap();
+
+    // reused buffer
+    std::vector<int> ids(10, -1);
+    BOOST_CHECK_EQUAL(grc.FindOverlappedIntervals(SeqLib::GenomicRegion(0, 95, 95, '+'), ids, true), 3);
+    BOOST_CHECK_EQUAL(ids.size(), 3);
+    BOOST_CHECK_EQUAL(grc.FindOverlappedIntervals(SeqLib::GenomicRegion(0, 95, 95, '+'), ids, false), 2);
+    BOOST_CHECK_EQUAL(ids.size(), 2);
+
+    BOOST_CHECK(grc.AnyOverlap(SeqLib::GenomicRegion(1, 100, 300), true));
+    BOOST_CHECK(!grc.AnyOverlap(SeqLib::GenomicRegion(0, 201, 300), true));
+    BOOST_CHECK(!grc.AnyOverlap(SeqLib::GenomicRegion(2, 10, 100), true));
+    BOOST_CHECK(!grc.AnyOverlap(SeqLib::GenomicRegion(0, 120, 150, '+'), false));
+
+    // visitor can stop early
+    OverlapStopper st;
+    BOOST_CHECK(!grc.VisitOverlaps(SeqLib::GenomicRegion(0, 95, 95), st, true));
+    BOOST_CHECK_EQUAL(st.n, 2);
+    OverlapStopper st2;
+    BOOST_CHECK(grc.VisitOverlaps(SeqLib::GenomicRegion(0, 5, 20), st2, true));
+    BOOST_CHECK_EQUAL(st2.n, 1);
+  }
+}
+
+BOOST_AUTO_TEST_CASE ( parallel_tree_map ) {
+
+  SeqLib::ThreadPool tp(4);
+
+  SeqLib::GRC subject, query;
+  for (int i = 0; i < 5000; ++i) {
+    int pos = rand() % 100000;
+    subject.add(SeqLib::GenomicRegion(rand() % 10, pos, pos + rand() % 2000));
+  }
+  for (int i = 0; i < 1000; ++i) {
+    int pos = rand() % 100000;
+    query.add(SeqLib::GenomicRegion(rand() % 12, pos, pos + rand() % 500));
+  }
+
+  // same index as the serial build
+  subject.CreateTreeMap();
+  std::vector<int32_t> q1, s1, q2, s2;
+  SeqLib::GRC res1 = query.FindOverlaps(subject, q1, s1, true);
+
+  subject.CreateTreeMap(tp);
+  BOOST_CHECK_EQUAL(subject.NumTree(), 10);
+  SeqLib::GRC res2 = query.FindOverlaps(subject, q2, s2, true, tp);
+  BOOST_CHECK(q1 == q2);
+  BOOST_CHECK(s1 == s2);
+  BOOST_CHECK_EQUAL(res1.size(), res2.size());
+  BOOST_CHECK_EQUAL(res1.TotalWidth(), res2.TotalWidth());
+
+  subject.CreateIntervalArrayMap(tp);
+  BOOST_CHECK_EQUAL(subject.NumTree(), 10);
+  std::vector<int32_t> q3, s3;
+  query.FindOverlaps(subject, q3, s3, true, tp);
+  BOOST_CHECK_EQUAL(q3.size(), q1.size());
+
+  // sorted sweep, split by chromosome
+  subject.CoordinateSort();
+  query.CoordinateSort();
+  std::vector<int32_t> q4, s4, q5, s5;
+  SeqLib::GRC res4 = query.FindOverlaps(subject, q4, s4, true);
+  SeqLib::GRC res5 = query.FindOverlaps(subject, q5, s5, true, tp);
+  BOOST_CHECK(q4 == q5);
+  BOOST_CHECK(s4 == s5);
+  BOOST_CHECK_EQUAL(res4.TotalWidth(), res5.TotalWidth());
+}
+
+BOOST_AUTO_TEST_CASE ( binary_grc ) {
+
+  SeqLib::BamReader br;
+  br.Open(SBAM);
+  SeqLib::BamHeader hdr = br.Header();
+
+  SeqLib::GRC bed(BEDFILE, hdr);
+  BOOST_CHECK(bed.size() > 0);
+  BOOST_CHECK(bed.WriteBinary("tmp_grc.bin", hdr));
+
+  SeqLib::GRC loaded;
+  BOOST_CHECK(loaded.ReadBinary("tmp_grc.bin", hdr));
+  BOOST_CHECK_EQUAL(loaded.size(), bed.size());
+  BOOST_CHECK_EQUAL(loaded.TotalWidth(), bed.TotalWidth());
+  BOOST_CHECK(loaded.NumTree() > 0); // index comes with the file
+
+  // same hits as a freshly built index
+  bed.CreateTreeMap();
+  for (size_t i = 0; i < bed.size(); ++i) {
+    SeqLib::GenomicRegion q = bed[i];
+    q.Pad(100);
+    BOOST_CHECK_EQUAL(loaded.FindOverlappedIntervals(q, true).size(),
+		      bed.FindOverlappedIntervals(q, true).size());
+  }
+
+  // dictionary has to match
+  SeqLib::HeaderSequenceVector hsv = hdr.GetHeaderSequenceVector();
+  hsv[0].Length += 1;
+  SeqLib::GRC other;
+  BOOST_CHECK(!other.ReadBinary("tmp_grc.bin", SeqLib::BamHeader(hsv)));
+  BOOST_CHECK(other.IsEmpty());
+  BOOST_CHECK(!other.ReadBinary(BEDFILE, hdr));
+}
+
+BOOST_AUTO_TEST_CASE ( read_bed_blocks ) {
+
+  SeqLib::BamReader br;
+  br.Open(SBAM);
+  SeqLib::BamHeader hdr = br.Header();
+
+  // with and without decompression threads
+  SeqLib::ThreadPool tp(2);
+  SeqLib::GRC g1, g2, v1, v2;
+  BOOST_CHECK(g1.ReadBED(GZBED, hdr));
+  BOOST_CHECK(g2.ReadBED(GZBED, hdr, tp));
+  BOOST_CHECK(v1.ReadVCF(GZVCF, hdr));
+  BOOST_CHECK(v2.ReadVCF(GZVCF, hdr, tp));
+  BOOST_CHECK_EQUAL(g1.size(), 3);
+  BOOST_CHECK_EQUAL(v1.size(), 57);
+  BOOST_CHECK_EQUAL(g1.size(), g2.size());
+  BOOST_CHECK_EQUAL(v1.size(), v2.size());
+  for (size_t i = 0; i < v1.size(); ++i)
+    BOOST_CHECK(v1[i] == v2[i]);
+
+  // comments, blank lines, space separators, CRLF and no final newline
+  std::ofstream out("tmp_blocks.bed");
+  out << "# header\n\n1 100 200\tname\r\n\n2\t300\t400";
+  out.close();
+  SeqLib::GRC g3;
+  BOOST_CHECK(g3.ReadBED("tmp_blocks.bed", hdr));
+  BOOST_CHECK_EQUAL(g3.size(), 2);
+  BOOST_CHECK_EQUAL(g3[0].pos2, 200);
+  BOOST_CHECK_EQUAL(g3[1].chr, 1);
+  BOOST_CHECK_EQUAL(g3[1].pos1, 300);
+
+  BOOST_CHECK(!g3.ReadBED("no_such_file.bed", hdr));
+}
+
+BOOST_AUTO_TEST_CASE ( tabix_region_collection ) {
+
+  SeqLib::BamReader br;
+  br.Open(SBAM);
+  SeqLib::BamHeader hdr = br.Header();
+
+  // make a bgzipped, indexed BED
+  std::stringstream ss;
+  for (int c = 0; c < 3; ++c)
+    for (int i = 0; i < 500; ++i)
+      ss << hdr.IDtoName(c) << "\t" << i * 1000 << "\t" << i * 1000 + 200 + (i % 10 == 0 ? 5000 : 0) << "\n";
+  std::string bed = ss.str();
+  BGZF* fp = bgzf_open("tmp_tabix.bed.gz", "w");
+  BOOST_CHECK(fp);
+  BOOST_CHECK_EQUAL(bgzf_write(fp, bed.c_str(), bed.length()), bed.length());
+  bgzf_close(fp);
+  BOOST_CHECK_EQUAL(tbx_index_build("tmp_tabix.bed.gz", 0, &tbx_conf_bed), 0);
+
+  SeqLib::GRC full;
+  BOOST_CHECK(full.ReadBED("tmp_tabix.bed.gz", hdr));
+  full.CreateTreeMap();
+
+  BOOST_CHECK_THROW(SeqLib::TabixRegionCollection(0), std::invalid_argument);
+
+  SeqLib::TabixRegionCollection t(2, 20000);
+  BOOST_CHECK(!t.Open("no_such_file.bed.gz", hdr));
+  BOOST_CHECK(t.Open("tmp_tabix.bed.gz", hdr));
+
+  // only the windows in use are loaded
+  const SeqLib::GRC& w = t.Window(0, 30000);
+  BOOST_CHECK(w.size() > 0 && w.size() < 30);
+  BOOST_CHECK_EQUAL(t.NumWindows(), 1);
+
+  for (int c = 0; c < 4; ++c)
+    for (int pos = 0; pos < 520000; pos += 7919) {
+      SeqLib::GenomicRegion gr(c, pos, pos + (pos % 3 ? 100 : 30000));
+      BOOST_CHECK_EQUAL(t.CountOverlaps(gr), full.CountOverlaps(gr));
+      BOOST_CHECK_EQUAL(t.AnyOverlap(gr, true), full.AnyOverlap(gr, true));
+      BOOST_CHECK_EQUAL(t.FindOverlaps(gr, true).TotalWidth(), full.FindOverlaps(gr, true).TotalWidth());
+    }
+  BOOST_CHECK(t.NumWindows() <= 2);
+}
+
+BOOST_AUTO_TEST_CASE ( dynamic_index ) {
+
+  SeqLib::GRC grc;
+  grc.CreateDynamicMap();
+  BOOST_CHECK(grc.GetDynamicIndex());
+
+  // query between inserts, with no rebuild
+  for (int i = 0; i < 1000; ++i) {
+    grc.add(SeqLib::GenomicRegion(i % 2, i * 100, i * 100 + 150));
+    BOOST_CHECK_EQUAL(grc.CountOverlaps(SeqLib::GenomicRegion(i % 2, i * 100, i * 100)), i >= 2 ? 2 : 1);
+  }
+  BOOST_CHECK_EQUAL(grc.NumTree(), 2);
+
+  // erase moves the last region into the gap
+  std::vector<int> ids = grc.FindOverlappedIntervals(SeqLib::GenomicRegion(0, 1000, 1000), true);
+  BOOST_CHECK_EQUAL(ids.size(), 2);
+  grc.Erase(10); // 0:1000-1150
+  BOOST_CHECK_EQUAL(grc.size(), 999);
+  BOOST_CHECK_EQUAL(grc[10].pos1, 99900);
+  BOOST_CHECK_EQUAL(grc.CountOverlaps(SeqLib::GenomicRegion(0, 1000, 1000)), 1);
+  ids = grc.FindOverlappedIntervals(SeqLib::GenomicRegion(1, 99950, 99950), true);
+  BOOST_CHECK_EQUAL(ids.size(), 1);
+  BOOST_CHECK_EQUAL(ids[0], 10);
+  BOOST_CHECK_THROW(grc.Erase(999), std::out_of_range);
+
+  // same answers as a freshly built tree
+  SeqLib::GRC copy;
+  copy.Concat(grc);
+  copy.CreateTreeMap();
+  grc.Pad(20);
+  copy.Pad(20);
+  copy.CreateTreeMap();
+  for (int pos = 0; pos < 100000; pos += 337) {
+    SeqLib::GenomicRegion q(pos % 2, pos, pos + 50);
+    BOOST_CHECK_EQUAL(grc.CountOverlaps(q), copy.CountOverlaps(q));
+  }
+
+  // a static index replaces it
+  grc.CreateTreeMap();
+  BOOST_CHECK(!grc.GetDynamicIndex());
+
+  // as does a parallel build
+  SeqLib::ThreadPool tp(2);
+  grc.CreateDynamicMap();
+  BOOST_CHECK(grc.GetDynamicIndex());
+  grc.CreateIntervalArrayMap(tp);
+  BOOST_CHECK(!grc.GetDynamicIndex());
+  BOOST_CHECK_EQUAL(grc.NumTree(), 2);
+  for (int pos = 0; pos < 100000; pos += 337) {
+    SeqLib::GenomicRegion q(pos % 2, pos, pos + 50);
+    BOOST_CHECK_EQUAL(grc.CountOverlaps(q), copy.CountOverlaps(q));
+  }
+
+  grc.CreateDynamicMap();
+  grc.CreateTreeMap(tp);
+  BOOST_CHECK(!grc.GetDynamicIndex());
+  BOOST_CHECK_EQUAL(grc.NumTree(), 2);
+}
+
+BOOST_AUTO_TEST_CASE ( region_set_algebra ) {
+
+  SeqLib::GRC a, b;
+  a.add(SeqLib::GenomicRegion(0, 10, 20));
+  a.add(SeqLib::GenomicRegion(0, 15, 30));
+  a.add(SeqLib::GenomicRegion(1, 5, 8));
+  b.add(SeqLib::GenomicRegion(1, 0, 100)); // unsorted, so a copy is sorted
+  b.add(SeqLib::GenomicRegion(0, 25, 40));
+
+  SeqLib::GRC u = a.SetUnion(b);
+  BOOST_CHECK_EQUAL(u.size(), 2);
+  BOOST_CHECK_EQUAL(u[0].pos1, 10);
+  BOOST_CHECK_EQUAL(u[0].pos2, 40);
+  BOOST_CHECK_EQUAL(u[1].pos2, 100);
+
+  SeqLib::GRC x = a.SetIntersection(b);
+  BOOST_CHECK_EQUAL(x.size(), 2);
+  BOOST_CHECK_EQUAL(x[0].pos1, 25);
+  BOOST_CHECK_EQUAL(x[0].pos2, 30);
+  BOOST_CHECK_EQUAL(x[1].pos1, 5);
+  BOOST_CHECK_EQUAL(x[1].pos2, 8);
+
+  SeqLib::GRC d = b.SetDifference(a);
+  BOOST_CHECK_EQUAL(d.size(), 3);
+  BOOST_CHECK_EQUAL(d[0].pos1, 31);
+  BOOST_CHECK_EQUAL(d[1].pos2, 4);
+  BOOST_CHECK_EQUAL(d[2].pos1, 9);
+
+  SeqLib::HeaderSequenceVector h;
+  h.push_back(SeqLib::HeaderSequence("1", 50));
+  h.push_back(SeqLib::HeaderSequence("2", 8));
+  SeqLib::GRC c = a.Complement(h);
+  BOOST_CHECK_EQUAL(c.size(), 3);
+  BOOST_CHECK_EQUAL(c[0].pos2, 9);
+  BOOST_CHECK_EQUAL(c[1].pos1, 31);
+  BOOST_CHECK_EQUAL(c[1].pos2, 50);
+  BOOST_CHECK_EQUAL(c[2].pos2, 4); // 2:5-8 runs to the end
+  BOOST_CHECK_EQUAL(a.SetUnion(c).TotalWidth(), 51 + 9); // whole genome
+  BOOST_CHECK_EQUAL(a.SetIntersection(c).size(), 0);
+
+  std::vector<int32_t> depth;
+  SeqLib::GRC cov = a.CoverageDepth(depth);
+  BOOST_CHECK_EQUAL(cov.size(), 4);
+  BOOST_CHECK_EQUAL(cov[1].pos1, 15);
+  BOOST_CHECK_EQUAL(cov[1].pos2, 20);
+  BOOST_CHECK_EQUAL(depth[0], 1);
+  BOOST_CHECK_EQUAL(depth[1], 2);
+  BOOST_CHECK_EQUAL(depth[2], 1);
+  BOOST_CHECK_EQUAL(depth[3], 1);
+}
+
+BOOST_AUTO_TEST_CASE ( genomic_tiling ) {
+
+  SeqLib::HeaderSequenceVector h;
+  h.push_back(SeqLib::HeaderSequence("1", 10000));
+  h.push_back(SeqLib::HeaderSequence("2", 50)); // one tile
+  h.push_back(SeqLib::HeaderSequence("3", 2500));
+
+  // same tiles as the materialized collection
+  SeqLib::GenomicTiling tiles(100, 20, h);
+  SeqLib::GRC grc(100, 20, h);
+  BOOST_CHECK_EQUAL(tiles.size(), grc.size());
+  for (size_t i = 0; i < grc.size(); ++i)
+    BOOST_CHECK(tiles[i] == grc[i]);
+  BOOST_CHECK_EQUAL(tiles.NumTiles(1), 1);
+  BOOST_CHECK_EQUAL(tiles.NumTiles(3), 0);
+  BOOST_CHECK_THROW(tiles.at(tiles.size()), std::out_of_range);
+
+  // random access iterator
+  BOOST_CHECK_EQUAL(std::distance(tiles.begin(), tiles.end()), (long)tiles.size());
+  SeqLib::GenomicTiling::const_iterator it = tiles.begin() + 124;
+  BOOST_CHECK((*it).chr == 1);
+  BOOST_CHECK_EQUAL(it.Index(), 124);
+  BOOST_CHECK(it[1] == tiles[125]);
+
+  // binning
+  BOOST_CHECK_EQUAL(tiles.FindTile(0, 0), 0);
+  BOOST_CHECK_EQUAL(tiles.FindTile(0, 100), 0);
+  BOOST_CHECK_EQUAL(tiles.FindTile(0, 101), 1);
+  BOOST_CHECK_EQUAL(tiles.FindTile(1, 50), 124);
+  BOOST_CHECK_EQUAL(tiles.FindTile(1, 51), tiles.size());
+  BOOST_CHECK_EQUAL(tiles.FindTile(5, 10), tiles.size());
+
+  SeqLib::GRC s = tiles.Slice(120, 130);
+  BOOST_CHECK_EQUAL(s.size(), 10);
+  BOOST_CHECK(s[4] == tiles[124]);
+  BOOST_CHECK_THROW(tiles.Slice(10, tiles.size() + 1), std::out_of_range);
+  BOOST_CHECK_THROW(SeqLib::GenomicTiling(100, 100, h), std::invalid_argument);
+
+  // fed to a scheduler in batches
+  SeqLib::ThreadPool tp(4);
+  SeqLib::RegionScheduler rs(tp, 1000);
+  std::atomic<size_t> n(0);
+  rs.Run(tiles, [&n](SeqLib::RegionTask&) { ++n; });
+  BOOST_CHECK_EQUAL(n.load(), tiles.size());
+}
+
+BOOST_AUTO_TEST_CASE ( compiled_read_filter ) {
+
+  SeqLib::BamReader br;
+  br.Open("test_data/small.bam");
+  SeqLib::BamHeader h = br.Header();
+
+  // same rules, checked one at a time by the uncompiled objects
+  std::vector<ReadFilter> filters;
+
+  ReadFilter rf1;
+  AbstractRule ar;
+  ar.mapq = Range(10, 60, false);
+  ar.clip = Range(5, 1000, false);
+  ar.fr.dup.setOff();
+  ar.fr.mate_mapped.setOn();
+  rf1.AddRule(ar);
+  AbstractRule ar2;
+  ar2.isize = Range(200, 600, true);
+  ar2.nm = Range(1, 100, false);
+  ar2.fr.setAnyOffFlag(1536);
+  ar2.fr.fr.setOff();
+  rf1.AddRule(ar2);
+  filters.push_back(rf1);
+
+  ReadFilter rf2;
+  SeqLib::GRC g;
+  g.add(SeqLib::GenomicRegion(h.Name2ID("X"), 1100000, 1800000));
+  rf2.setRegions(g);
+  rf2.SetMateLinked(true);
+  AbstractRule ar3;
+  ar3.len = Range(50, 200, false);
+  ar3.fr.hardclip.setOff();
+  ar3.fr.ic.setOn();
+  rf2.AddRule(ar3);
+  filters.push_back(rf2);
+
+  ReadFilterCollection rfc;
+  for (size_t i = 0; i < filters.size(); ++i)
+    rfc.AddReadFilter(filters[i]);
+  rfc.Compile();
+
+  SeqLib::BamRecord rec;
+  size_t count = 0, passed = 0;
+  while (br.GetNextRecord(rec) && count++ < 10000) {
+    bool expected = false;
+    for (size_t i = 0; i < filters.size(); ++i)
+      expected = expected || (filters[i].isReadOverlappingRegion(rec) && filters[i].isValid(rec));
+    BOOST_CHECK_EQUAL(rfc.isValid(rec), expected);
+    BOOST_CHECK_EQUAL(rfc.isValid(rec.raw()), expected);
+    passed += expected;
+  }
+  BOOST_CHECK(passed > 0);
+}
+
+BOOST_AUTO_TEST_CASE ( adaptive_rule_order ) {
+
+  SeqLib::BamReader br;
+  br.Open("test_data/small.bam");
+
+  // many checks, in a poor starting order for this data
+  AbstractRule ar;
+  ar.nbases = Range(0, 5, false);
+  ar.xp = Range(0, 10, false);
+  ar.nm = Range(0, 20, false);
+  ar.len = Range(30, 500, false);
+  ar.mapq = Range(30, 60, false);
+  ar.isize = Range(0, 800, false);
+  ar.fr.hardclip.setOff();
+
+  CompiledRule adaptive(ar), fixed(ar);
+  fixed.SetAdaptiveOrder(false);
+  BOOST_CHECK(adaptive.AdaptiveOrder());
+  BOOST_CHECK(!fixed.AdaptiveOrder());
+  BOOST_CHECK_EQUAL(adaptive.NumChecks(), 7);
+
+  // reordering must not change which reads pass
+  SeqLib::BamRecord rec;
+  size_t count = 0, passed = 0;
+  while (br.GetNextRecord(rec) && count++ < 3 * RULE_ADAPT_INTERVAL) {
+    bool expected = ar.isValid(rec);
+    BOOST_CHECK_EQUAL(adaptive.isValid(rec.raw()), expected);
+    BOOST_CHECK_EQUAL(fixed.isValid(rec.raw()), expected);
+    passed += expected;
+  }
+  BOOST_CHECK(passed > 0);
+  BOOST_CHECK(passed < count);
+
+  // and the same through a collection
+  ReadFilter rf;
+  rf.AddRule(ar);
+  ReadFilterCollection rfc, rfc_fixed;
+  rfc.AddReadFilter(rf);
+  rfc_fixed.AddReadFilter(rf);
+  rfc_fixed.SetAdaptiveOrder(false);
+
+  SeqLib::BamReader br2;
+  br2.Open("test_data/small.bam");
+  count = 0;
+  while (br2.GetNextRecord(rec) && count++ < 3 * RULE_ADAPT_INTERVAL)
+    BOOST_CHECK_EQUAL(rfc.isValid(rec), rfc_fixed.isValid(rec));
+}
+
+BOOST_AUTO_TEST_CASE ( batch_read_filter ) {
+
+  SeqLib::BamReader br;
+  br.Open("test_data/small.bam");
+  SeqLib::BamHeader h = br.Header();
+
+  ReadFilter rf1;
+  rf1.SetExcluder(true);
+  AbstractRule ex;
+  ex.fr.dup.setOn();
+  rf1.AddRule(ex);
+
+  ReadFilter rf2;
+  AbstractRule ar;
+  ar.mapq = Range(20, 60, false);
+  ar.fr.setAnyOffFlag(1536);
+  rf2.AddRule(ar);
+  AbstractRule ar2;
+  ar2.clip = Range(5, 1000, false);
+  ar2.mapq = Range(0, 10, true);
+  rf2.AddRule(ar2);
+
+  ReadFilter rf3;
+  SeqLib::GRC g;
+  g.add(SeqLib::GenomicRegion(h.Name2ID("X"), 1100000, 1800000));
+  rf3.setRegions(g);
+  AbstractRule ar3;
+  ar3.fr.ic.setOn();
+  rf3.AddRule(ar3);
+
+  ReadFilterCollection rfc, rfc_batch;
+  rfc.AddReadFilter(rf1);
+  rfc.AddReadFilter(rf2);
+  rfc.AddReadFilter(rf3);
+  rfc_batch.AddReadFilter(rf1);
+  rfc_batch.AddReadFilter(rf2);
+  rfc_batch.AddReadFilter(rf3);
+
+  // same answers as one read at a time, over batches of odd sizes
+  SeqLib::BamRecordVector batch;
+  SeqLib::BamRecord rec;
+  std::vector<uint64_t> mask;
+  size_t count = 0, passed = 0;
+  bool more = true;
+  while (more && count < 20000) {
+    batch.clear();
+    while (batch.size() < 1000 && (more = br.GetNextRecord(rec)))
+      batch.push_back(rec);
+    rfc_batch.Evaluate(batch, mask);
+    BOOST_CHECK_EQUAL(mask.size(), (batch.size() + 63) / 64);
+    for (size_t i = 0; i < batch.size(); ++i) {
+      bool expected = rfc.isValid(batch[i]);
+      BOOST_CHECK_EQUAL((mask[i / 64] >> (i % 64)) & 1, expected ? 1u : 0u);
+      passed += expected;
+    }
+    count += batch.size();
+  }
+  BOOST_CHECK(passed > 0);
+  BOOST_CHECK(passed < count);
+
+  // an empty batch, and an empty collection passes everything
+  batch.clear();
+  rfc_batch.Evaluate(batch, mask);
+  BOOST_CHECK(mask.empty());
+  ReadFilterCollection none;
+  batch.push_back(rec);
+  none.Evaluate(batch, mask);
+  BOOST_CHECK_EQUAL(mask.size(), 1);
+  BOOST_CHECK_EQUAL(mask[0], 1u);
+}
+
+BOOST_AUTO_TEST_CASE ( read_filter_stats ) {
+
+  SeqLib::BamReader br;
+  br.Open("test_data/small.bam");
+
+  ReadFilter rf;
+  AbstractRule ar;
+  ar.mapq = Range(30, 60, false);
+  rf.AddRule(ar);
+  AbstractRule ar2;
+  ar2.clip = Range(5, 1000, false);
+  rf.AddRule(ar2);
+
+  ReadFilterCollection rfc;
+  rfc.AddReadFilter(rf);
+  rfc.SetTiming(true);
+
+  SeqLib::BamRecord rec;
+  size_t count = 0;
+  while (br.GetNextRecord(rec) && count++ < 5000)
+    rfc.isValid(rec);
+
+  // each rule sees the reads the rules before it did not pass
+  const ReadFilter& f = rfc.GetReadFilter(0);
+  BOOST_CHECK_EQUAL(rfc.NumSeen(), 5000);
+  BOOST_CHECK_EQUAL(f.Stats().tested, 5000);
+  BOOST_CHECK_EQUAL(f.Stats().passed, rfc.NumPassed());
+  BOOST_CHECK_EQUAL(f.GetRule(0).Stats().tested, 5000);
+  BOOST_CHECK_EQUAL(f.GetRule(1).Stats().tested, f.GetRule(0).Stats().Rejected());
+  BOOST_CHECK_EQUAL(f.GetRule(0).Stats().passed + f.GetRule(1).Stats().passed, f.Stats().passed);
+  BOOST_CHECK(f.GetRule(0).Stats().passed > 0);
+  BOOST_CHECK(f.Stats().ticks > 0);
+
+  // as JSON
+  Json::Value root;
+  Json::Reader reader;
+  BOOST_CHECK(reader.parse(rfc.StatsJSON(), root));
+  BOOST_CHECK_EQUAL(root["tested"].asUInt64(), 5000);
+  BOOST_CHECK_EQUAL(root["filters"].size(), 1);
+  BOOST_CHECK_EQUAL(root["filters"][0]["rules"].size(), 2);
+  BOOST_CHECK_EQUAL(root["filters"][0]["rules"][1]["passed"].asUInt64(), f.GetRule(1).Stats().passed);
+  BOOST_CHECK(root["filters"][0].isMember("ticks"));
+
+  BOOST_CHECK_EQUAL(root["filters"][0]["region"].asString(), "WHOLE GENOME");
+  BOOST_CHECK_EQUAL(root["filters"][0]["num_regions"].asUInt64(), 0);
+
+  rfc.ResetStats();
+  BOOST_CHECK_EQUAL(rfc.NumSeen(), 0);
+  BOOST_CHECK_EQUAL(rfc.GetReadFilter(0).GetRule(1).Stats().tested, 0);
+
+  // a region filter is labeled with its region
+  const std::string rules = "{\"reg\" : {\"region\" : \"X:1,100,000-1,800,000\", \"rules\" : [{\"mapq\" : [10, 60]}]}}";
+  SeqLib::BamReader br2;
+  br2.Open("test_data/small.bam");
+  ReadFilterCollection rfc2(rules, br2.Header());
+  count = 0;
+  while (br2.GetNextRecord(rec) && count++ < 5000)
+    rfc2.isValid(rec);
+  BOOST_CHECK(reader.parse(rfc2.StatsJSON(), root));
+  BOOST_CHECK_EQUAL(root["filters"].size(), 1);
+  BOOST_CHECK_EQUAL(root["filters"][0]["region"].asString(), "X:1,100,000-1,800,000");
+  BOOST_CHECK_EQUAL(root["filters"][0]["num_regions"].asUInt64(), 1);
+}
+
+BOOST_AUTO_TEST_CASE ( parallel_read_filter ) {
+
+  ReadFilter rf;
+  AbstractRule ar;
+  ar.mapq = Range(20, 60, false);
+  ar.fr.dup.setOff();
+  rf.AddRule(ar);
+  AbstractRule ar2;
+  ar2.clip = Range(5, 1000, false);
+  rf.AddRule(ar2);
+  ReadFilterCollection rfc;
+  rfc.AddReadFilter(rf);
+
+  // const queries need compiled filters
+  const ReadFilterCollection& crfc = rfc;
+  SeqLib::BamReader r;
+  r.Open(SBAM);
+  SeqLib::BamRecord rec;
+  r.GetNextRecord(rec);
+  BOOST_CHECK_THROW(crfc.isValid(rec), std::logic_error);
+
+  // expected names, one read at a time
+  ReadFilterCollection serial(rfc);
+  std::vector<std::string> names;
+  size_t total = 1;
+  if (serial.isValid(rec))
+    names.push_back(rec.Qname());
+  while (r.GetNextRecord(rec)) {
+    ++total;
+    if (serial.isValid(rec))
+      names.push_back(rec.Qname());
+  }
+  BOOST_CHECK(!names.empty());
+  BOOST_CHECK(names.size() < total);
+
+  rfc.Compile();
+  SeqLib::BamReader r1;
+  r1.Open(SBAM);
+  while (r1.GetNextRecord(rec))
+    BOOST_CHECK_EQUAL(crfc.isValid(rec), serial.isValid(rec));
+
+  // in parallel, in input order
+  SeqLib::ThreadPool tp(4);
+  SeqLib::RecordPipeline rp(tp, 250);
+  SeqLib::BamReader r2;
+  r2.Open(SBAM);
+  std::vector<std::string> out;
+  BOOST_CHECK(rp.RunFilter(r2, rfc, [&out](const SeqLib::BamRecordVector& b) {
+	for (size_t i = 0; i < b.size(); ++i)
+	  out.push_back(b[i].Qname());
+	return true;
+      }));
+  BOOST_CHECK(out == names);
+
+  // const queries leave the counts alone
+  BOOST_CHECK_EQUAL(rfc.NumSeen(), 0);
+
+  // and to a writer
+  SeqLib::BamReader r3;
+  r3.Open(SBAM);
+  SeqLib::BamWriter w(SeqLib::BAM);
+  w.SetHeader(r3.Header());
+  w.Open("tmp_filtered.bam");
+  w.WriteHeader();
+  BOOST_CHECK(rp.RunFilter(r3, rfc, w));
+  w.Close();
+
+  SeqLib::BamReader r4;
+  r4.Open("tmp_filtered.bam");
+  size_t j = 0;
+  while (r4.GetNextRecord(rec))
+    BOOST_CHECK_EQUAL(rec.Qname(), names[j++]);
+  BOOST_CHECK_EQUAL(j, names.size());
+}
+
+BOOST_AUTO_TEST_CASE ( motif_automaton ) {
+
+  SeqLib::MotifAutomaton ma;
+  BOOST_CHECK(ma.IsBuilt());
+  BOOST_CHECK(!ma.Match("ACGT"));
+
+  ma.AddMotif("GATTACA");
+  ma.AddMotif("TAC");
+  ma.AddMotif(""); // ignored
+  BOOST_CHECK_EQUAL(ma.NumMotifs(), 2);
+  BOOST_CHECK(!ma.IsBuilt());
+  BOOST_CHECK_THROW(ma.Match("TAC"), std::logic_error);
+  ma.Build();
+  BOOST_CHECK_EQUAL(ma.NumStates(), 1 + 7 + 3);
+  BOOST_CHECK(ma.Match("NNTACNN"));
+  BOOST_CHECK(ma.Match("GATTAGATTACA"));
+  BOOST_CHECK(!ma.Match("GATTAGA"));
+  BOOST_CHECK(!ma.Match("tac"));
+
+  // packed, two bases per byte: A=1 C=2 G=4 T=8 N=15
+  const uint8_t gattaca[] = { 0x41, 0x88, 0x12, 0x10 };
+  BOOST_CHECK(ma.Match(gattaca, 7));
+  BOOST_CHECK(ma.Match(gattaca + 1, 5)); // TTACA
+  BOOST_CHECK(!ma.Match(gattaca, 4)); // GATT
+
+  // same as the trie on the decoded reads, with motifs taken from some of them
+  SeqLib::BamReader br;
+  br.Open("test_data/small.bam");
+  SeqLib::BamRecordVector recs;
+  SeqLib::BamRecord rec;
+  while (br.GetNextRecord(rec) && recs.size() < 2000)
+    recs.push_back(rec);
+
+  SeqLib::Filter::AhoCorasick aho;
+  for (size_t i = 0; i < recs.size(); i += 40) {
+    std::string s = recs[i].Sequence();
+    if (s.length() > 30) {
+      aho.AddMotif(s.substr(10, 15));
+      ++aho.count;
+    }
+  }
+  aho.automaton.Build();
+  BOOST_CHECK(aho.automaton.NumMotifs() > 10);
+
+  size_t hits = 0;
+  for (size_t i = 0; i < recs.size(); ++i) {
+    const bam1_t* b = recs[i].raw();
+    bool expected = aho.QueryText(recs[i].Sequence()) > 0;
+    BOOST_CHECK_EQUAL(aho.automaton.Match(bam_get_seq(b), b->core.l_qseq), expected);
+    BOOST_CHECK_EQUAL(aho.automaton.Match(recs[i].Sequence()), expected);
+    hits += expected;
+  }
+  BOOST_CHECK(hits >= aho.automaton.NumMotifs());
+  BOOST_CHECK(hits < recs.size());
+}
+
+BOOST_AUTO_TEST_CASE ( filter_region_pushdown ) {
+
+  SeqLib::BamReader br;
+  br.Open("test_data/small.bam");
+  SeqLib::BamHeader h = br.Header();
+
+  ReadFilter inc;
+  SeqLib::GRC g;
+  g.add(SeqLib::GenomicRegion(h.Name2ID("X"), 1100000, 1200000));
+  g.add(SeqLib::GenomicRegion(h.Name2ID("X"), 1150000, 1250000));
+  inc.setRegions(g);
+  AbstractRule ar;
+  ar.mapq = Range(10, 60, false);
+  inc.AddRule(ar);
+
+  // excluders do not widen the regions
+  ReadFilter exc;
+  exc.SetExcluder(true);
+  AbstractRule ar2;
+  ar2.fr.dup.setOn();
+  exc.AddRule(ar2);
+
+  ReadFilterCollection rfc;
+  rfc.AddReadFilter(inc);
+  rfc.AddReadFilter(exc);
+
+  SeqLib::GRC acc;
+  BOOST_CHECK(rfc.GetAcceptedRegions(acc));
+  BOOST_CHECK_EQUAL(acc.size(), 1);
+  BOOST_CHECK_EQUAL(acc[0].pos1, 1100000 - 1);
+  BOOST_CHECK_EQUAL(acc[0].pos2, 1250000 + 1);
+
+  // same reads pass as from the whole file
+  std::vector<std::string> all, pushed;
+  SeqLib::BamRecord rec;
+  size_t total = 0;
+  while (br.GetNextRecord(rec) && ++total)
+    if (rfc.isValid(rec))
+      all.push_back(rec.Qname() + rec.Sequence());
+  BOOST_CHECK(!all.empty());
+
+  SeqLib::BamReader br2;
+  br2.Open("test_data/small.bam");
+  BOOST_CHECK(br2.SetFilterRegions(rfc));
+  size_t read = 0;
+  while (br2.GetNextRecord(rec)) {
+    ++read;
+    if (rfc.isValid(rec))
+      pushed.push_back(rec.Qname() + rec.Sequence());
+  }
+  BOOST_CHECK(all == pushed);
+  BOOST_CHECK(read < total);
+
+  // whole-genome or mate-linked includers can pass reads anywhere
+  inc.SetMateLinked(true);
+  ReadFilterCollection linked;
+  linked.AddReadFilter(inc);
+  BOOST_CHECK(!linked.GetAcceptedRegions(acc));
+  BOOST_CHECK_EQUAL(acc.size(), 0);
+  BOOST_CHECK(!br2.SetFilterRegions(linked));
+
+  ReadFilterCollection none;
+  BOOST_CHECK(!none.GetAcceptedRegions(acc));
+}
+
+BOOST_AUTO_TEST_CASE ( sorted_region_cursor ) {
+
+  SeqLib::BamReader br;
+  br.Open("test_data/small.bam");
+  SeqLib::BamHeader h = br.Header();
+
+  // many small, overlapping regions
+  ReadFilter rf;
+  SeqLib::GRC g;
+  for (int i = 0; i < 2000; ++i)
+    g.add(SeqLib::GenomicRegion(h.Name2ID("X"), 1000000 + i * 500, 1000000 + i * 500 + 700));
+  g.add(SeqLib::GenomicRegion(h.Name2ID("1"), 0, 100000));
+  rf.setRegions(g);
+
+  // same answer as the interval tree, for sorted reads
+  SeqLib::BamRecordVector reads;
+  SeqLib::BamRecord rec;
+  size_t hits = 0;
+  while (br.GetNextRecord(rec)) {
+    reads.push_back(rec);
+    BOOST_CHECK_EQUAL(rf.isReadOverlappingRegionSorted(rec), rf.isReadOverlappingRegion(rec));
+    hits += rf.isReadOverlappingRegion(rec);
+  }
+  BOOST_CHECK(hits > 0);
+
+  // and going back (unsorted)
+  for (size_t i = reads.size(); i > 0; --i)
+    BOOST_CHECK_EQUAL(rf.isReadOverlappingRegionSorted(reads[i - 1]), rf.isReadOverlappingRegion(reads[i - 1]));
+
+  // the collection walks the cursor, and the const (thread-safe) path the tree
+  AbstractRule ar;
+  ar.mapq = Range(10, 60, false);
+  rf.AddRule(ar);
+  ReadFilterCollection rfc;
+  rfc.AddReadFilter(rf);
+  rfc.Compile();
+  const ReadFilterCollection& crfc = rfc;
+  for (size_t i = 0; i < reads.size(); ++i)
+    BOOST_CHECK_EQUAL(rfc.isValid(reads[i]), crfc.isValid(reads[i]));
+}
+
+BOOST_AUTO_TEST_CASE ( read_predicate ) {
+
+  using namespace SeqLib::Filter::Pred;
+
+  // flag tests are folded into one mask test
+  FlagTest<BAM_FPAIRED, BAM_FDUP | BAM_FUNMAP> f = paired && !duplicate && mapped;
+  FlagTest<BAM_FUNMAP, 0> unmapped = !mapped;
+  And<Compare<_Mapq, GreaterEqual>, FlagTest<0, BAM_FDUP | BAM_FSECONDARY> > g = mapq >= 20 && !duplicate && !secondary;
+
+  SeqLib::BamReader br;
+  br.Open("test_data/small.bam");
+  SeqLib::BamRecord rec;
+  size_t n = 0, pass = 0;
+  while (br.GetNextRecord(rec)) {
+    ++n;
+    bool keep = rec.MapQuality() >= 20 && !rec.DuplicateFlag() && rec.NumSoftClip() + rec.NumHardClip() > 5;
+    BOOST_CHECK_EQUAL((mapq >= 20 && !duplicate && clip > 5)(rec), keep);
+    pass += keep;
+
+    BOOST_CHECK_EQUAL(f(rec), rec.PairedFlag() && !rec.DuplicateFlag() && rec.MappedFlag());
+    BOOST_CHECK_EQUAL(unmapped(rec), !rec.MappedFlag());
+    BOOST_CHECK_EQUAL(g(rec), rec.MapQuality() >= 20 && !rec.DuplicateFlag() && !rec.SecondaryFlag());
+    BOOST_CHECK(!(duplicate && !duplicate)(rec));
+    BOOST_CHECK(!(mapq >= 0 && duplicate && !duplicate)(rec));
+    BOOST_CHECK((!(duplicate && !duplicate))(rec));
+    BOOST_CHECK_EQUAL((rev_strand || 30 > mapq)(rec), rec.ReverseFlag() || rec.MapQuality() < 30);
+    BOOST_CHECK_EQUAL((chr == rec.ChrID() && pos != rec.Position())(rec), false);
+    BOOST_CHECK_EQUAL((length == rec.Length())(rec.raw()), true);
+  }
+  BOOST_CHECK(pass > 0 && pass < n);
+}
+
+BOOST_AUTO_TEST_CASE ( read_name_rule ) {
+
+  SeqLib::ReadNameSet s;
+  s.Add("read1");
+  s.Add("read1");
+  s.Add(std::string("read2"));
+  BOOST_CHECK_EQUAL(s.size(), 2);
+  BOOST_CHECK(s.Contains("read1"));
+  BOOST_CHECK(!s.Contains("read"));
+  BOOST_CHECK(!s.Contains("read12"));
+
+  // grows past the first table
+  for (int i = 0; i < 100000; ++i)
+    s.Add("name" + tostring(i));
+  BOOST_CHECK_EQUAL(s.size(), 100002);
+  for (int i = 0; i < 100000; ++i)
+    BOOST_CHECK(s.Contains("name" + tostring(i)));
+  BOOST_CHECK(s.Contains("read2"));
+
+  BOOST_CHECK_THROW(s.AddFile("no_such_file.txt"), std::runtime_error);
+
+  // every other read name, first column only
+  SeqLib::BamReader br;
+  br.Open("test_data/small.bam");
+  SeqLib::BamRecordVector reads;
+  SeqLib::BamRecord rec;
+  std::set<std::string> keep;
+  std::ofstream out("tmp_qnames.txt");
+  while (br.GetNextRecord(rec) && reads.size() < 2000) {
+    reads.push_back(rec);
+    if (reads.size() % 2) {
+      keep.insert(rec.Qname());
+      out << rec.Qname() << "\t" << rec.Position() << std::endl;
+    }
+  }
+  out.close();
+
+  ReadFilterCollection rfc("{\"\" : {\"rules\" : [{\"qname\" : \"tmp_qnames.txt\"}]}}", br.Header());
+  ReadFilterCollection inv("{\"\" : {\"rules\" : [{\"!qname\" : \"tmp_qnames.txt\"}]}}", br.Header());
+  for (size_t i = 0; i < reads.size(); ++i) {
+    bool in = keep.count(reads[i].Qname());
+    BOOST_CHECK_EQUAL(rfc.isValid(reads[i]), in);
+    BOOST_CHECK_EQUAL(inv.isValid(reads[i]), !in);
+  }
+
+  // from a set in memory
+  SeqLib::ReadNameSet names;
+  names.Add(reads[0].Qname());
+  AbstractRule ar;
+  ar.addReadNameRule(names, false);
+  BOOST_CHECK(ar.isValid(reads[0]));
+  BOOST_CHECK(!ar.isEvery());
+}
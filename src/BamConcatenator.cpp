@@ -0,0 +1,373 @@
+#include "SeqLib/BamConcatenator.h"
+
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <queue>
+#include <functional>
+
+#define CONCAT_BUFFER 0x10000
+
+namespace SeqLib {
+
+  // the empty BGZF block that terminates every BAM
+  static const uint8_t BGZF_EOF_MARKER[28] =
+    {31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 66, 67, 2, 0, 27, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+  static const size_t BGZF_EOF_LEN = 28;
+
+  // an input shard for merging, keyed on the first and last alignment
+  struct _BamShard {
+    std::string file;
+    uint64_t first;
+    uint64_t last;
+    bool operator<(const _BamShard& s) const { return first < s.first; }
+  };
+
+  // coordinate sort key of a record. Unmapped (tid -1) sort last, as in samtools
+  static inline uint64_t bam_sort_key(const bam1_t* b) {
+    uint32_t tid = b->core.tid < 0 ? INT32_MAX : b->core.tid;
+    return (static_cast<uint64_t>(tid) << 32) | static_cast<uint32_t>(b->core.pos + 1);
+  }
+
+  // check that two headers have the same sequence dictionary
+  static bool same_dictionary(const BamHeader& a, const BamHeader& b) {
+    if (a.NumSequences() != b.NumSequences())
+      return false;
+    for (int i = 0; i < a.NumSequences(); ++i)
+      if (a.get()->target_len[i] != b.get()->target_len[i] ||
+	  strcmp(a.get()->target_name[i], b.get()->target_name[i]))
+	return false;
+    return true;
+  }
+
+  // find the file offset of the last BGZF block holding data, by
+  // walking the block headers. Returns -1 if not a standard BGZF file
+  static int64_t last_data_block(const std::string& f) {
+
+    FILE* fp = fopen(f.c_str(), "rb");
+    if (!fp)
+      return -1;
+
+    int64_t off = 0, last = -1;
+    uint8_t h[18];
+    while (fread(h, 1, 18, fp) == 18) {
+      // gzip magic, FEXTRA set, 6 bytes of extra with BC subfield
+      if (h[0] != 31 || h[1] != 139 || !(h[3] & 4) || h[10] != 6 || h[12] != 'B' || h[13] != 'C') {
+	last = -1;
+	break;
+      }
+      int bsize = (h[16] | (h[17] << 8)) + 1;
+      if (bsize > static_cast<int>(BGZF_EOF_LEN)) // empty blocks (e.g. EOF) are exactly 28 bytes
+	last = off;
+      off += bsize;
+      if (fseeko(fp, off, SEEK_SET) != 0)
+	break;
+    }
+
+    fclose(fp);
+    return last;
+  }
+
+  static inline uint32_t le_u32(const uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+  }
+
+  // does the loaded block hold the next record whole, with a layout that
+  // agrees with its length (bytes that merely happen to fit are unlikely to)
+  static bool record_in_block(const BGZF* fp, int32_t n_targets) {
+
+    int avail = fp->block_length - fp->block_offset;
+    if (avail < 36)
+      return false;
+    const uint8_t* p = static_cast<const uint8_t*>(fp->uncompressed_block) + fp->block_offset;
+    uint32_t len = le_u32(p);
+    if (len < 32 || len > static_cast<uint32_t>(avail - 4))
+      return false;
+
+    // 32 bytes of fixed fields, then name, cigar, sequence and quality
+    int32_t tid = le_u32(p + 4);
+    int32_t mtid = le_u32(p + 24);
+    uint32_t l_qname = p[12];
+    uint32_t n_cigar = p[16] | (p[17] << 8);
+    int32_t l_qseq = le_u32(p + 20);
+    if (tid < -1 || tid >= n_targets || mtid < -1 || mtid >= n_targets ||
+	l_qname == 0 || l_qseq < 0)
+      return false;
+    uint64_t need = 32 + static_cast<uint64_t>(l_qname) + 4 * static_cast<uint64_t>(n_cigar) +
+      (static_cast<uint64_t>(l_qseq) + 1) / 2 + l_qseq;
+    return need <= len && p[36 + l_qname - 1] == '\0';
+  }
+
+  // read the first and last alignment of a BAM. Returns false if the
+  // first or last alignment could not be read whole from its own block
+  static bool boundary_records(const std::string& f, _BamShard& s, bool& empty) {
+
+    empty = true;
+    BGZF* fp = bgzf_open(f.c_str(), "r");
+    if (!fp)
+      return false;
+
+    bam_hdr_t* h = bam_hdr_read(fp);
+    if (!h) {
+      bgzf_close(fp);
+      return false;
+    }
+    int64_t hdr_block = fp->block_address;
+
+    bam1_t* b = bam_init1();
+    bool success = true;
+
+    // the first record must not span blocks. Load its block if the
+    // header ended with the last one (none left means no records)
+    if (fp->block_offset >= fp->block_length && bgzf_read_block(fp) < 0)
+      success = false;
+    else if (fp->block_length > 0 && !record_in_block(fp, h->n_targets))
+      success = false;
+    int ret = success ? bam_read1(fp, b) : -1;
+
+    if (ret >= 0) {
+      empty = false;
+      s.first = s.last = bam_sort_key(b);
+
+      // jump to last block, unless it is the one with the header
+      int64_t last = last_data_block(f);
+      if (last < 0)
+	success = false;
+      else if (last > hdr_block && bgzf_seek(fp, last << 16, SEEK_SET) < 0)
+	success = false;
+
+      // the rest of the records of the last block, which must start at a
+      // record and hold each one whole. Nothing marks where a record
+      // starts, so any record that doesn't look right, or is out of order,
+      // means it may not have. A seek only loads the block on the next read
+      if (success && fp->block_length == 0 && bgzf_read_block(fp) < 0)
+	success = false;
+      while (success && fp->block_offset < fp->block_length) {
+	if (!record_in_block(fp, h->n_targets) || bam_read1(fp, b) < 0 ||
+	    bam_sort_key(b) < s.last)
+	  success = false;
+	else
+	  s.last = bam_sort_key(b);
+      }
+    } else if (ret < -1) {
+      success = false;
+    }
+
+    bam_destroy1(b);
+    bam_hdr_destroy(h);
+    bgzf_close(fp);
+    return success;
+  }
+
+  bool BamConcatenator::Add(const std::vector<std::string>& f) {
+    bool pass = true;
+    for (std::vector<std::string>::const_iterator i = f.begin(); i != f.end(); ++i)
+      pass = pass && Add(*i);
+    return pass;
+  }
+
+  bool BamConcatenator::Add(const std::string& f) {
+
+    htsFile* fp = hts_open(f.c_str(), "r");
+    if (!fp) {
+      std::cerr << "BamConcatenator: Cannot open " << f << std::endl;
+      return false;
+    }
+
+    // raw block copying only makes sense for BGZF compressed BAM
+    if (fp->format.format != bam) {
+      std::cerr << "BamConcatenator: Input must be a BAM file: " << f << std::endl;
+      hts_close(fp);
+      return false;
+    }
+
+    bam_hdr_t* h = sam_hdr_read(fp);
+    hts_close(fp);
+    if (!h) {
+      std::cerr << "BamConcatenator: Cannot read header for " << f << std::endl;
+      return false;
+    }
+    BamHeader hdr(h);
+    bam_hdr_destroy(h);
+
+    if (m_files.empty())
+      m_first_hdr = hdr;
+    else if (!same_dictionary(hdr, m_first_hdr)) {
+      std::cerr << "BamConcatenator: Sequence dictionary of " << f
+		<< " does not match that of " << m_files[0] << std::endl;
+      return false;
+    }
+
+    m_files.push_back(f);
+    return true;
+  }
+
+  bool BamConcatenator::Concatenate(const std::string& out) const {
+    return concat(out, m_files);
+  }
+
+  bool BamConcatenator::concat(const std::string& out, const std::vector<std::string>& files) const {
+
+    if (files.empty()) {
+      std::cerr << "BamConcatenator: No inputs to concatenate" << std::endl;
+      return false;
+    }
+
+    const BamHeader& hdr = m_hdr.isEmpty() ? m_first_hdr : m_hdr;
+    if (!same_dictionary(hdr, m_first_hdr)) {
+      std::cerr << "BamConcatenator: Output header does not match sequence dictionary of inputs" << std::endl;
+      return false;
+    }
+
+    BGZF* fo = bgzf_open(out.c_str(), "w");
+    if (!fo) {
+      std::cerr << "BamConcatenator: Cannot open output " << out << std::endl;
+      return false;
+    }
+
+    // write the header in its own block(s)
+    if (bam_hdr_write(fo, hdr.get()) < 0 || bgzf_flush(fo) < 0) {
+      std::cerr << "BamConcatenator: Cannot write header to " << out << std::endl;
+      bgzf_close(fo);
+      return false;
+    }
+
+    // hold back the last 28 bytes of each input, which may be the EOF marker
+    std::vector<uint8_t> buf(BGZF_EOF_LEN + CONCAT_BUFFER);
+    bool success = true;
+
+    for (std::vector<std::string>::const_iterator f = files.begin(); f != files.end() && success; ++f) {
+
+      BGZF* in = bgzf_open(f->c_str(), "r");
+      bam_hdr_t* h = in ? bam_hdr_read(in) : NULL;
+      if (!h) {
+	std::cerr << "BamConcatenator: Cannot read " << *f << std::endl;
+	if (in)
+	  bgzf_close(in);
+	success = false;
+	break;
+      }
+      bam_hdr_destroy(h);
+
+      // the block with the end of the header may also hold alignments.
+      // Re-compress just the remainder of that block
+      if (in->block_offset < in->block_length) {
+	if (bgzf_write(fo, static_cast<char*>(in->uncompressed_block) + in->block_offset,
+		       in->block_length - in->block_offset) < 0 || bgzf_flush(fo) < 0)
+	  success = false;
+      }
+
+      // copy the remaining blocks as is
+      size_t held = 0;
+      ssize_t len = 0;
+      while (success && (len = bgzf_raw_read(in, &buf[held], CONCAT_BUFFER)) > 0) {
+	size_t tot = held + len;
+	held = tot;
+	if (tot > BGZF_EOF_LEN) {
+	  size_t n = tot - BGZF_EOF_LEN;
+	  if (bgzf_raw_write(fo, &buf[0], n) != static_cast<ssize_t>(n))
+	    success = false;
+	  memmove(&buf[0], &buf[n], BGZF_EOF_LEN);
+	  held = BGZF_EOF_LEN;
+	}
+      }
+      if (len < 0)
+	success = false;
+
+      // drop the EOF marker, keep anything else
+      if (success && held && !(held == BGZF_EOF_LEN && !memcmp(&buf[0], BGZF_EOF_MARKER, BGZF_EOF_LEN)))
+	if (bgzf_raw_write(fo, &buf[0], held) != static_cast<ssize_t>(held))
+	  success = false;
+
+      if (!success)
+	std::cerr << "BamConcatenator: Failed copying blocks from " << *f << " to " << out << std::endl;
+      bgzf_close(in);
+    }
+
+    // closing writes the EOF marker
+    if (bgzf_close(fo) < 0)
+      success = false;
+
+    return success;
+  }
+
+  bool BamConcatenator::Merge(const std::string& out) const {
+
+    if (m_files.empty()) {
+      std::cerr << "BamConcatenator: No inputs to merge" << std::endl;
+      return false;
+    }
+
+    // get the first and last alignment of each shard
+    std::vector<_BamShard> shards;
+    bool raw = true;
+    for (std::vector<std::string>::const_iterator f = m_files.begin(); f != m_files.end(); ++f) {
+      _BamShard s;
+      s.file = *f;
+      bool empty;
+      if (!boundary_records(*f, s, empty)) {
+	raw = false;
+	break;
+      }
+      if (!empty)
+	shards.push_back(s);
+    }
+
+    // shards must not interleave to be copied
+    if (raw) {
+      std::stable_sort(shards.begin(), shards.end());
+      for (size_t i = 1; i < shards.size(); ++i)
+	if (shards[i-1].last > shards[i].first)
+	  raw = false;
+    }
+
+    if (!raw)
+      return merge_records(out);
+
+    // all inputs are empty, so just need header
+    std::vector<std::string> files;
+    for (std::vector<_BamShard>::const_iterator s = shards.begin(); s != shards.end(); ++s)
+      files.push_back(s->file);
+    if (files.empty())
+      files.push_back(m_files[0]);
+
+    return concat(out, files);
+  }
+
+  bool BamConcatenator::merge_records(const std::string& out) const {
+
+    // a reader for each input (the same file may be added twice), with
+    // the inputs of the next records in coordinate order
+    std::vector<BamReader> readers(m_files.size());
+    std::vector<BamRecord> next(m_files.size());
+    typedef std::pair<uint64_t, size_t> _Head; // sort key, input. Ties go in input order
+    std::priority_queue<_Head, std::vector<_Head>, std::greater<_Head> > heads;
+    for (size_t i = 0; i < m_files.size(); ++i) {
+      if (!readers[i].Open(m_files[i])) {
+	std::cerr << "BamConcatenator: Cannot open " << m_files[i] << " for merging" << std::endl;
+	return false;
+      }
+      if (readers[i].GetNextRecord(next[i]))
+	heads.push(_Head(bam_sort_key(next[i].raw()), i));
+    }
+
+    BamWriter w(SeqLib::BAM);
+    w.SetHeader(m_hdr.isEmpty() ? m_first_hdr : m_hdr);
+    if (!w.Open(out) || !w.WriteHeader()) {
+      std::cerr << "BamConcatenator: Cannot open output " << out << std::endl;
+      return false;
+    }
+
+    while (!heads.empty()) {
+      size_t i = heads.top().second;
+      heads.pop();
+      if (!w.WriteRecord(next[i]))
+	return false;
+      if (readers[i].GetNextRecord(next[i]))
+	heads.push(_Head(bam_sort_key(next[i].raw()), i));
+    }
+
+    return w.Close();
+  }
+
+}
@@ -154,6 +154,22 @@ int BamHeader::NumSequences() const {
 
 }
 
+uint64_t BamHeader::SequenceDictionaryChecksum() const {
+
+  // 64-bit FNV-1a over each name (with its terminating null) and length
+  uint64_t hash = 14695981039346656037ULL;
+  int n = NumSequences();
+  for (int i = 0; i < n; ++i) {
+    const char* c = h->target_name[i];
+    do {
+      hash = (hash ^ static_cast<uint8_t>(*c)) * 1099511628211ULL;
+    } while (*c++);
+    for (int j = 0; j < 4; ++j)
+      hash = (hash ^ ((h->target_len[i] >> (8 * j)) & 0xff)) * 1099511628211ULL;
+  }
+  return hash;
+}
+
 std::string BamHeader::IDtoName(int id) const {
 
   if (id < 0)
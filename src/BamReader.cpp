@@ -141,6 +141,15 @@ void BamReader::Reset() {
   return false;
 }
 
+  bool BamReader::SetFilterRegions(const Filter::ReadFilterCollection& rfc, int pad) {
+
+    GRC grc;
+    if (!rfc.GetAcceptedRegions(grc, pad) || !grc.size())
+      return false;
+
+    return SetMultipleRegions(grc);
+  }
+
   bool BamReader::Open(const std::string& bam) {
 
     // dont open same bam twice
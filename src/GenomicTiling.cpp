@@ -0,0 +1,90 @@
+#include "SeqLib/GenomicTiling.h"
+
+#include <stdexcept>
+#include <algorithm>
+
+namespace SeqLib {
+
+  GenomicTiling::GenomicTiling(int width, int ovlp, const HeaderSequenceVector& h) {
+    init(width, ovlp, h);
+  }
+
+  GenomicTiling::GenomicTiling(int width, int ovlp, const BamHeader& h) {
+    init(width, ovlp, h.GetHeaderSequenceVector());
+  }
+
+  void GenomicTiling::init(int width, int ovlp, const HeaderSequenceVector& h) {
+
+    // undefined otherwise
+    if (width <= ovlp)
+      throw std::invalid_argument("GenomicTiling: Width should be > ovlp");
+
+    m_width = width;
+    m_step = width - ovlp;
+
+    // same tiles as the GRC constructor: each chromosome spans [0, Length],
+    // and is one tile if no wider than width, otherwise tiles [s, s + width]
+    // for as long as they fit
+    m_first.assign(1, 0);
+    m_len.clear();
+    for (HeaderSequenceVector::const_iterator i = h.begin(); i != h.end(); ++i) {
+      int32_t len = i->Length;
+      size_t n = m_width > len ? 1 : (len - m_width) / m_step + 1;
+      m_len.push_back(len);
+      m_first.push_back(m_first.back() + n);
+    }
+  }
+
+  size_t GenomicTiling::NumTiles(int32_t chr) const {
+    if (chr < 0 || chr >= static_cast<int32_t>(m_len.size()))
+      return 0;
+    return m_first[chr + 1] - m_first[chr];
+  }
+
+  GenomicRegion GenomicTiling::operator[](size_t i) const {
+
+    // last chromosome that starts at or before i
+    int32_t chr = std::upper_bound(m_first.begin(), m_first.end(), i) - m_first.begin() - 1;
+
+    if (m_width > m_len[chr])
+      return GenomicRegion(chr, 0, m_len[chr]);
+
+    int32_t start = static_cast<int32_t>(i - m_first[chr]) * m_step;
+    return GenomicRegion(chr, start, start + m_width);
+  }
+
+  GenomicRegion GenomicTiling::at(size_t i) const {
+    if (i >= size())
+      throw std::out_of_range("GenomicTiling::at - index out of range");
+    return (*this)[i];
+  }
+
+  size_t GenomicTiling::FindTile(int32_t chr, int32_t pos) const {
+
+    size_t n = NumTiles(chr);
+    if (!n || pos < 0 || pos > m_len[chr])
+      return size();
+
+    if (m_width > m_len[chr])
+      return m_first[chr];
+
+    // tile k is [k * step, k * step + width], so the first to contain pos
+    // is the smallest k with k * step >= pos - width
+    size_t k = pos <= m_width ? 0 : (pos - m_width + m_step - 1) / m_step;
+    if (k >= n || static_cast<int64_t>(k) * m_step > pos)
+      return size();
+    return m_first[chr] + k;
+  }
+
+  GRC GenomicTiling::Slice(size_t begin, size_t end) const {
+
+    if (begin > end || end > size())
+      throw std::out_of_range("GenomicTiling::Slice - range out of bounds");
+
+    GRC out;
+    for (size_t i = begin; i < end; ++i)
+      out.add((*this)[i]);
+    return out;
+  }
+
+}
@@ -0,0 +1,48 @@
+#include "SeqLib/MappedFile.h"
+
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace SeqLib {
+
+  bool MappedFile::Open(const std::string& file) {
+
+    Close();
+
+    int fd = open(file.c_str(), O_RDONLY);
+    if (fd < 0) {
+      std::cerr << "MappedFile: Cannot open " << file << std::endl;
+      return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size == 0) {
+      std::cerr << "MappedFile: Cannot map empty or unreadable file " << file << std::endl;
+      close(fd);
+      return false;
+    }
+
+    void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // the mapping holds its own reference to the file
+    if (p == MAP_FAILED) {
+      std::cerr << "MappedFile: Cannot map " << file << std::endl;
+      return false;
+    }
+
+    m_data = static_cast<const char*>(p);
+    m_size = st.st_size;
+    return true;
+  }
+
+  void MappedFile::Close() {
+
+    if (m_data)
+      munmap(const_cast<char*>(m_data), m_size);
+    m_data = NULL;
+    m_size = 0;
+  }
+
+}
@@ -0,0 +1,137 @@
+#include "SeqLib/MotifAutomaton.h"
+
+#include <stdexcept>
+#include <cstring>
+#include <queue>
+
+#include "SeqLib/BamRecord.h"
+
+namespace SeqLib {
+
+  MotifAutomaton::MotifAutomaton() : m_built(false), m_nsym(1) {
+    Build();
+  }
+
+  void MotifAutomaton::AddMotif(const std::string& m) {
+    // as the AhoCorasick trie
+    if (m.empty())
+      return;
+    m_motifs.push_back(m);
+    m_built = false;
+  }
+
+  void MotifAutomaton::Build() {
+
+    // a symbol for each character used in a motif
+    memset(m_char_sym, 0, sizeof(m_char_sym));
+    m_nsym = 1;
+    for (std::vector<std::string>::const_iterator m = m_motifs.begin(); m != m_motifs.end(); ++m)
+      for (std::string::const_iterator c = m->begin(); c != m->end(); ++c) {
+	uint8_t& sym = m_char_sym[static_cast<uint8_t>(*c)];
+	if (!sym)
+	  sym = m_nsym++;
+      }
+
+    // a base is the character it decodes to
+    for (int i = 0; i < 16; ++i)
+      m_code_sym[i] = m_char_sym[static_cast<uint8_t>(BASES[i])];
+
+    // the trie, with -1 for no child
+    m_next.assign(m_nsym, -1);
+    m_accept.assign(1, 0);
+    for (std::vector<std::string>::const_iterator m = m_motifs.begin(); m != m_motifs.end(); ++m) {
+      int32_t s = 0;
+      for (std::string::const_iterator c = m->begin(); c != m->end(); ++c) {
+	size_t k = s * m_nsym + m_char_sym[static_cast<uint8_t>(*c)];
+	if (m_next[k] < 0) {
+	  m_next[k] = m_accept.size();
+	  m_accept.push_back(0);
+	  m_next.resize(m_next.size() + m_nsym, -1);
+	}
+	s = m_next[k];
+      }
+      m_accept[s] = 1;
+    }
+
+    // breadth first, fill in the missing transitions from the failure
+    // state (the longest proper suffix that is in the trie), which is
+    // already done as it is shallower
+    std::vector<int32_t> fail(m_accept.size(), 0);
+    std::queue<int32_t> q;
+    for (size_t c = 0; c < m_nsym; ++c) {
+      if (m_next[c] < 0)
+	m_next[c] = 0;
+      else
+	q.push(m_next[c]);
+    }
+    while (!q.empty()) {
+      int32_t s = q.front();
+      q.pop();
+      m_accept[s] = m_accept[s] || m_accept[fail[s]];
+      for (size_t c = 0; c < m_nsym; ++c) {
+	int32_t& t = m_next[s * m_nsym + c];
+	int32_t f = m_next[fail[s] * m_nsym + c];
+	if (t < 0) {
+	  t = f;
+	} else {
+	  fail[t] = f;
+	  q.push(t);
+	}
+      }
+    }
+
+    // bytes with neither base leaving the root
+    for (int b = 0; b < 256; ++b)
+      m_skip[b] = !m_next[m_code_sym[b >> 4]] && !m_next[m_code_sym[b & 0xf]];
+
+    m_built = true;
+  }
+
+  void MotifAutomaton::check_built() const {
+    if (!m_built)
+      throw std::logic_error("MotifAutomaton::Match - motifs added since Build");
+  }
+
+  bool MotifAutomaton::Match(const uint8_t* seq, int32_t len) const {
+
+    check_built();
+
+    const int32_t* next = &m_next[0];
+    int32_t s = 0;
+    int32_t i = 0;
+    while (i < len) {
+
+      // from the root, skip bytes that cannot start a motif
+      if (!s && !(i & 1)) {
+	while (i + 1 < len && m_skip[seq[i >> 1]])
+	  i += 2;
+	if (i >= len)
+	  break;
+      }
+
+      // high 4 bits are the first base of a byte, as bam_seqi
+      s = next[s * m_nsym + m_code_sym[seq[i >> 1] >> ((~i & 1) << 2) & 0xf]];
+      if (m_accept[s])
+	return true;
+      ++i;
+    }
+
+    return false;
+  }
+
+  bool MotifAutomaton::Match(const char* t, size_t n) const {
+
+    check_built();
+
+    const int32_t* next = &m_next[0];
+    int32_t s = 0;
+    for (size_t i = 0; i < n; ++i) {
+      s = next[s * m_nsym + m_char_sym[static_cast<uint8_t>(t[i])]];
+      if (m_accept[s])
+	return true;
+    }
+
+    return false;
+  }
+
+}
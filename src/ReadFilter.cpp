@@ -1,8 +1,17 @@
 #include "SeqLib/ReadFilter.h"
 
 #include <cassert>
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+#include <sstream>
+#include <time.h>
 #include "htslib/htslib/khash.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
 //#define QNAME "D0EN0ACXX111207:7:2306:6903:136511"
 //#define QFLAG -1
 
@@ -18,12 +27,40 @@
 namespace SeqLib {
 
   namespace Filter {
+
+  // clock for the filter timing: the CPU cycle counter on x86, as
+  // it is much cheaper to read, else nanoseconds
+  static uint64_t filter_ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+#endif
+  }
+
+  // number of query bases in the CIGAR, as Cigar::NumQueryConsumed
+  static int32_t query_consumed(const bam1_t* b) {
+    const uint32_t* c = bam_get_cigar(b);
+    int32_t n = 0;
+    for (uint32_t i = 0; i < b->core.n_cigar; ++i)
+      if (bam_cigar_type(bam_cigar_op(c[i])) & 1)
+	n += bam_cigar_oplen(c[i]);
+    return n;
+  }
+
+  // does region r end before q starts (in coordinate order)
+  static bool region_ends_before(const GenomicRegion& r, const GenomicRegion& q) {
+    return r.chr < q.chr || (r.chr == q.chr && r.pos2 < q.pos1);
+  }
+
   // return if this rule accepts all reads
   bool AbstractRule::isEvery() const {
     return read_group.empty() && ins.isEvery() && del.isEvery() && isize.isEvery() && 
       mapq.isEvery() && len.isEvery() && clip.isEvery() && nm.isEvery() && 
       nbases.isEvery() && fr.isEvery() && 
-      (subsam_frac >= 1) && xp.isEvery() 
+      (subsam_frac >= 1) && xp.isEvery() && !m_names 
 #ifdef HAVE_C11
       && !aho.count
 #endif
@@ -38,7 +75,7 @@ namespace SeqLib {
   "mate_mapped", "isize","clip", "length","nm",
   "mapq", "all", "ff", "xp","fr","rr","rf",
   "ic", "discordant","motif","nbases","!motif","allflag", "!allflag", "anyflag", "!anyflag",
-  "ins","del",  "subsample", "rg"
+  "ins","del",  "subsample", "rg", "qname", "!qname"
 };
 
     static const StringSet allowed_region_annots = 
@@ -51,17 +88,23 @@ namespace SeqLib {
 */
 bool ReadFilter::isValid(const BamRecord &r) {
 
+  ++m_stats.tested;
+
   // empty default is pass
-  if (!m_abstract_rules.size())
+  if (!m_abstract_rules.size()) {
+    ++m_stats.passed;
     return true;
+  }
 
   for (std::vector<AbstractRule>::iterator it = m_abstract_rules.begin(); 
-       it != m_abstract_rules.end(); ++it) 
+       it != m_abstract_rules.end(); ++it) {
+    ++it->m_stats.tested;
     if (it->isValid(r)) {
-      ++it->m_count; //update this rule counter
-      ++m_count;
+      ++it->m_stats.passed; //update this rule counter
+      ++m_stats.passed;
        return true; // it is includable in at least one. 
     }
+  }
       
   return false;
 
@@ -99,60 +142,354 @@ bool ReadFilter::isReadOverlappingRegion(const BamRecord &r) const {
   if (!m_grv.size()) 
     return true;
 
-  if (m_grv.CountOverlaps(GenomicRegion(r.ChrID(), r.Position(), r.PositionEnd())))
+  return overlaps_region(r.ChrID(), r.Position(), r.PositionEnd(),
+			 r.MateChrID(), r.MatePosition(), r.MatePosition() + r.Length());
+}
+
+bool ReadFilter::isReadOverlappingRegion(const bam1_t* b) const {
+
+  if (!m_grv.size()) 
+    return true;
+
+  // same coordinates as BamRecord::PositionEnd
+  int32_t end = b->core.l_qseq > 0 ? bam_endpos(b) : b->core.pos + query_consumed(b);
+  return overlaps_region(b->core.tid, b->core.pos, end,
+			 b->core.mtid, b->core.mpos, b->core.mpos + b->core.l_qseq);
+}
+
+bool ReadFilter::overlaps_region(int32_t chr, int32_t pos1, int32_t pos2, int32_t mchr, int32_t mpos1, int32_t mpos2) const {
+
+  // stops at the first hit, without allocating
+  if (m_grv.AnyOverlap(GenomicRegion(chr, pos1, pos2), true))
     return true;
   
   if (!m_applies_to_mate)
     return false;
-  if (m_grv.CountOverlaps(GenomicRegion(r.MateChrID(), r.MatePosition(), r.MatePosition() + r.Length())))
+  if (m_grv.AnyOverlap(GenomicRegion(mchr, mpos1, mpos2), true))
     return true;
 
   return false;
 }
 
+bool ReadFilter::isReadOverlappingRegionSorted(const bam1_t* b) {
+
+  if (!m_grv.size())
+    return true;
+
+  const int32_t chr = b->core.tid;
+  const int32_t pos = b->core.pos;
+  int32_t end = b->core.l_qseq > 0 ? bam_endpos(b) : pos + query_consumed(b);
+
+  // unmapped reads are last in a sorted BAM, so leave the cursor for the next pass
+  if (chr < 0)
+    return overlaps_region(chr, pos, end, b->core.mtid, b->core.mpos, b->core.mpos + b->core.l_qseq);
+
+  // went back, so find the place again
+  const GenomicRegion r(chr, pos, end);
+  if (chr < m_cursor_chr || (chr == m_cursor_chr && pos < m_cursor_pos))
+    m_cursor = std::lower_bound(m_sorted.begin(), m_sorted.end(), r, region_ends_before) - m_sorted.begin();
+  m_cursor_chr = chr;
+  m_cursor_pos = pos;
+
+  // a region that ends before this read ends before all of the later ones.
+  // The regions are merged, so only the next one can overlap
+  while (m_cursor < m_sorted.size() && region_ends_before(m_sorted[m_cursor], r))
+    ++m_cursor;
+  if (m_cursor < m_sorted.size() && m_sorted[m_cursor].chr == chr && m_sorted[m_cursor].pos1 <= end)
+    return true;
+
+  // mates are not in order
+  if (!m_applies_to_mate)
+    return false;
+  return m_grv.AnyOverlap(GenomicRegion(b->core.mtid, b->core.mpos, b->core.mpos + b->core.l_qseq), true);
+}
+
 // checks which rule a read applies to (using the hiearchy stored in m_regions).
 // if a read does not satisfy a rule it is excluded.
   bool ReadFilterCollection::isValid(const BamRecord &r) {
+    return isValid(r.raw());
+  }
+
+  bool ReadFilterCollection::isValid(const bam1_t* b) {
 
-  ++m_count_seen;
+    ++m_count_seen;
 
-  DEBUGIV(r, "starting RFC isValid")
+    if (m_regions.empty()) {
+      ++m_count;
+      return true;
+    }
 
-  if (m_regions.size() == 0)
+    if (!m_compiled)
+      Compile();
+
+    if (!query(b, true, &m_regions))
+      return false;
+    ++m_count;
     return true;
+  }
 
-  DEBUGIV(r, "starting RFC isValid with non-empty regions")
-  
-    bool is_valid = false;
-    bool exclude_hit = false;
+  bool ReadFilterCollection::isValid(const BamRecord &r) const {
+    return isValid(r.raw());
+  }
 
-    for (std::vector<ReadFilter>::iterator it = m_regions.begin(); it != m_regions.end(); ++it) {
-      
-      // only check read validity if it overlaps region
-      if (!it->isReadOverlappingRegion(r)) 
+  bool ReadFilterCollection::isValid(const bam1_t* b) const {
+
+    if (m_regions.empty())
+      return true;
+
+    if (!m_compiled)
+      throw std::logic_error("ReadFilterCollection::isValid - filters must be compiled first for const queries");
+
+    return query(b, false, NULL);
+  }
+
+  bool ReadFilterCollection::query(const bam1_t* b, bool adapt, std::vector<ReadFilter>* counts) const {
+
+    const bool timing = counts && m_timing;
+
+    // excluders are first, so stop at the first hit either way
+    for (std::vector<_CompiledFilter>::const_iterator it = m_program.begin(); it != m_program.end(); ++it) {
+
+      const ReadFilter& rf = m_regions[it->filter];
+      FilterStats* fst = counts ? &(*counts)[it->filter].m_stats : NULL;
+      uint64_t t0 = timing ? filter_ticks() : 0;
+      // the region cursor moves only if the filters can be changed
+      bool in_region = it->whole_genome ||
+	(counts ? (*counts)[it->filter].isReadOverlappingRegionSorted(b) : rf.isReadOverlappingRegion(b));
+      if (!in_region) {
+	if (timing)
+	  fst->ticks += filter_ticks() - t0;
 	continue;
-    
-    // check the region with all its rules
-      if (it->isValid(r)) {
-     
-      // if this is excluder region, exclude read
-      if (it->excluder)
-	exclude_hit = true;
-      
-      // in case we do fall through, track that we passed here
-      is_valid = true;
+      }
 
+      // the compiled rules are in the same order as the rules of the filter
+      if (fst)
+	++fst->tested;
+      bool hit = it->rules.empty();
+      for (size_t j = 0; !hit && j < it->rules.size(); ++j) {
+	if (!counts) {
+	  hit = it->rules[j].isValid(b, adapt);
+	  continue;
+	}
+	FilterStats& st = (*counts)[it->filter].m_abstract_rules[j].m_stats;
+	++st.tested;
+	uint64_t t = timing ? filter_ticks() : 0;
+	hit = it->rules[j].isValid(b, adapt);
+	if (timing)
+	  st.ticks += filter_ticks() - t;
+	st.passed += hit;
+      }
+
+      if (timing)
+	fst->ticks += filter_ticks() - t0;
+
+      if (hit) {
+	if (fst)
+	  ++fst->passed;
+	return !rf.excluder;
+      }
     }
+
+    return false;
   }
 
-    // found a hit in a rule
-    if (is_valid && !exclude_hit) {
-      ++m_count;
-      return true;
+  void ReadFilterCollection::Evaluate(const BamRecordVector& batch, std::vector<uint64_t>& mask) {
+
+    const size_t n = batch.size();
+    mask.assign((n + 63) / 64, 0);
+    m_count_seen += n;
+
+    // no filters, so everything passes (as isValid)
+    if (m_regions.empty()) {
+      for (size_t i = 0; i < n; ++i)
+	mask[i / 64] |= 1ULL << (i % 64);
+      m_count += n;
+      return;
     }
-    
-    return false;
-}
+
+    if (!m_compiled)
+      Compile();
+
+    ReadColumns cols;
+    cols.Load(batch);
+    std::vector<uint8_t> valid;
+    query(cols, valid, true, &m_regions);
+
+    for (size_t i = 0; i < n; ++i)
+      if (valid[i]) {
+	mask[i / 64] |= 1ULL << (i % 64);
+	++m_count;
+      }
+  }
+
+  void ReadFilterCollection::Evaluate(const BamRecordVector& batch, std::vector<uint64_t>& mask) const {
+
+    const size_t n = batch.size();
+    mask.assign((n + 63) / 64, 0);
+
+    if (m_regions.empty()) {
+      for (size_t i = 0; i < n; ++i)
+	mask[i / 64] |= 1ULL << (i % 64);
+      return;
+    }
+
+    if (!m_compiled)
+      throw std::logic_error("ReadFilterCollection::Evaluate - filters must be compiled first for const queries");
+
+    ReadColumns cols;
+    cols.Load(batch);
+    std::vector<uint8_t> valid;
+    query(cols, valid, false, NULL);
+
+    for (size_t i = 0; i < n; ++i)
+      if (valid[i])
+	mask[i / 64] |= 1ULL << (i % 64);
+  }
+
+  void ReadFilterCollection::query(const ReadColumns& cols, std::vector<uint8_t>& valid, bool adapt,
+				   std::vector<ReadFilter>* counts) const {
+
+    const size_t n = cols.size();
+    const bool timing = counts && m_timing;
+
+    // reads not yet decided by an earlier filter, and the reads a filter applies to / hits
+    std::vector<uint8_t> open(n, 1), test(n), hit(n);
+    valid.assign(n, 0);
+
+    // as isValid, excluders are first and a read is decided by the first hit
+    for (std::vector<_CompiledFilter>::const_iterator it = m_program.begin(); it != m_program.end(); ++it) {
+
+      const ReadFilter& rf = m_regions[it->filter];
+      FilterStats* fst = counts ? &(*counts)[it->filter].m_stats : NULL;
+      uint64_t t0 = timing ? filter_ticks() : 0;
+      size_t ntest = 0;
+      ReadFilter* cur = counts ? &(*counts)[it->filter] : NULL;
+      for (size_t i = 0; i < n; ++i) {
+	test[i] = open[i] && (it->whole_genome ||
+			      (cur ? cur->isReadOverlappingRegionSorted(cols.reads[i]) : rf.isReadOverlappingRegion(cols.reads[i])));
+	ntest += test[i];
+      }
+
+      size_t nhit = 0;
+      if (ntest && it->rules.empty()) {
+	hit = test;
+	nhit = ntest;
+      } else if (ntest) {
+	// a read hits if it passes any rule, so only test it on the next if not
+	std::fill(hit.begin(), hit.end(), 0);
+	for (size_t j = 0; j < it->rules.size() && nhit < ntest; ++j) {
+	  FilterStats* st = counts ? &(*counts)[it->filter].m_abstract_rules[j].m_stats : NULL;
+	  uint64_t t = timing ? filter_ticks() : 0;
+	  it->rules[j].Evaluate(cols, &test[0], &hit[0], adapt);
+	  if (timing)
+	    st->ticks += filter_ticks() - t;
+	  size_t h = 0;
+	  for (size_t i = 0; i < n; ++i) {
+	    h += hit[i];
+	    test[i] &= !hit[i];
+	  }
+	  if (st) {
+	    st->tested += ntest - nhit;
+	    st->passed += h - nhit;
+	  }
+	  nhit = h;
+	}
+      }
+
+      for (size_t i = 0; nhit && i < n; ++i)
+	if (hit[i]) {
+	  open[i] = 0;
+	  valid[i] = !rf.excluder;
+	}
+
+      if (fst) {
+	fst->tested += ntest;
+	fst->passed += nhit;
+	if (timing)
+	  fst->ticks += filter_ticks() - t0;
+      }
+    }
+  }
+
+  void ReadFilterCollection::ResetStats() {
+    m_count = 0;
+    m_count_seen = 0;
+    for (std::vector<ReadFilter>::iterator it = m_regions.begin(); it != m_regions.end(); ++it) {
+      it->m_stats.Reset();
+      for (std::vector<AbstractRule>::iterator ar = it->m_abstract_rules.begin(); ar != it->m_abstract_rules.end(); ++ar)
+	ar->m_stats.Reset();
+    }
+  }
+
+  // add the counts of a rule or filter to a JSON object
+  static void stats_to_json(const FilterStats& st, bool timing, Json::Value& v) {
+    v["tested"] = static_cast<Json::UInt64>(st.tested);
+    v["passed"] = static_cast<Json::UInt64>(st.passed);
+    v["rejected"] = static_cast<Json::UInt64>(st.Rejected());
+    if (timing)
+      v["ticks"] = static_cast<Json::UInt64>(st.ticks);
+  }
+
+  std::string ReadFilterCollection::StatsJSON() const {
+
+    Json::Value root(Json::objectValue);
+    root["tested"] = static_cast<Json::UInt64>(m_count_seen);
+    root["passed"] = static_cast<Json::UInt64>(m_count);
+    root["rejected"] = static_cast<Json::UInt64>(m_count_seen - m_count);
+
+    Json::Value filters(Json::arrayValue);
+    for (std::vector<ReadFilter>::const_iterator it = m_regions.begin(); it != m_regions.end(); ++it) {
+
+      Json::Value f(Json::objectValue);
+      f["region"] = !it->m_grv.size() ? "WHOLE GENOME" : it->m_region_file;
+      f["num_regions"] = static_cast<Json::UInt64>(it->m_grv.size());
+      f["exclude"] = it->excluder;
+      stats_to_json(it->m_stats, m_timing, f);
+
+      // describe each rule as operator<< does, less the label
+      Json::Value rules(Json::arrayValue);
+      for (std::vector<AbstractRule>::const_iterator ar = it->m_abstract_rules.begin(); ar != it->m_abstract_rules.end(); ++ar) {
+	Json::Value r(Json::objectValue);
+	std::stringstream ss;
+	ss << *ar;
+	std::string desc = ss.str();
+	size_t p = desc.find("Rule: ");
+	if (p != std::string::npos)
+	  desc = desc.substr(p + 6);
+	r["rule"] = desc;
+	if (!ar->id.empty())
+	  r["id"] = ar->id;
+	stats_to_json(ar->m_stats, m_timing, r);
+	rules.append(r);
+      }
+      f["rules"] = rules;
+      filters.append(f);
+    }
+    root["filters"] = filters;
+
+    return root.toStyledString();
+  }
+
+  void ReadFilterCollection::Compile() {
+
+    m_program.clear();
+    for (int pass = 0; pass < 2; ++pass)
+      for (size_t i = 0; i < m_regions.size(); ++i) {
+	const ReadFilter& rf = m_regions[i];
+	if (rf.excluder != (pass == 0))
+	  continue;
+	_CompiledFilter cf;
+	cf.filter = i;
+	cf.whole_genome = !rf.m_grv.size();
+	for (std::vector<AbstractRule>::const_iterator ar = rf.m_abstract_rules.begin(); ar != rf.m_abstract_rules.end(); ++ar) {
+	  cf.rules.push_back(CompiledRule(*ar));
+	  cf.rules.back().SetAdaptiveOrder(m_adaptive);
+	}
+	m_program.push_back(cf);
+      }
+
+    m_compiled = true;
+  }
 
   void ReadFilter::AddRule(const AbstractRule& ar) {
     m_abstract_rules.push_back(ar);
@@ -161,7 +498,7 @@ bool ReadFilter::isReadOverlappingRegion(const BamRecord &r) const {
   // constructor to make a ReadFilterCollection from a rules file.
   // This will reduce each individual BED file and make the 
   // GenomicIntervalTreeMap
-  ReadFilterCollection::ReadFilterCollection(const std::string& script, const BamHeader& hdr) : m_count(0), m_count_seen(0) {
+  ReadFilterCollection::ReadFilterCollection(const std::string& script, const BamHeader& hdr) : m_count(0), m_count_seen(0), m_compiled(false), m_adaptive(true), m_timing(false) {
 
     // if is a file, read into a string
     std::ifstream iscript(script.c_str());
@@ -214,6 +551,7 @@ bool ReadFilter::isReadOverlappingRegion(const BamRecord &r) const {
       if (v != null) {
 	reg = v.asString();
 	mr.id = mr.id + reg;
+	mr.m_region_file = reg;
       }
       
       // actually parse the region
@@ -266,6 +604,7 @@ bool ReadFilter::isReadOverlappingRegion(const BamRecord &r) const {
     // make sure that there is at least one includer region
     this->CheckHasIncluder();
 
+    Compile();
   }
 
     void ReadFilterCollection::CheckHasIncluder() {
@@ -281,6 +620,7 @@ bool ReadFilter::isReadOverlappingRegion(const BamRecord &r) const {
 	mr.m_abstract_rules.push_back(rule_all);
 	mr.id = "WG_includer";
 	m_regions.push_back(mr);
+	m_compiled = false;
       }
 
     }
@@ -288,12 +628,38 @@ bool ReadFilter::isReadOverlappingRegion(const BamRecord &r) const {
   void ReadFilter::setRegions(const GRC& g) {
     m_grv = g;
     m_grv.CreateTreeMap();
+    sort_regions();
   }
 
   void ReadFilter::addRegions(const GRC& g) {
     m_grv.Concat(g);
     m_grv.MergeOverlappingIntervals();
     m_grv.CreateTreeMap();
+    sort_regions();
+  }
+
+  void ReadFilter::sort_regions() {
+
+    m_sorted.clear();
+    for (size_t i = 0; i < m_grv.size(); ++i)
+      m_sorted.push_back(m_grv[i]);
+    std::sort(m_sorted.begin(), m_sorted.end());
+
+    // merge overlaps (inclusive, as the tree), so regions are disjoint and
+    // in order of both start and end
+    size_t k = 0;
+    for (size_t i = 1; i < m_sorted.size(); ++i) {
+      if (m_sorted[i].chr == m_sorted[k].chr && m_sorted[i].pos1 <= m_sorted[k].pos2)
+	m_sorted[k].pos2 = std::max(m_sorted[k].pos2, m_sorted[i].pos2);
+      else
+	m_sorted[++k] = m_sorted[i];
+    }
+    if (!m_sorted.empty())
+      m_sorted.resize(k + 1);
+
+    m_cursor = 0;
+    m_cursor_chr = -1;
+    m_cursor_pos = -1;
   }
 
 
@@ -332,6 +698,7 @@ std::ostream& operator<<(std::ostream &out, const ReadFilter &mr) {
 
   void ReadFilterCollection::AddReadFilter(const ReadFilter& rf) {
     m_regions.push_back(rf);
+    m_compiled = false;
   }
 
   ReadFilter::~ReadFilter() {}
@@ -448,12 +815,15 @@ std::ostream& operator<<(std::ostream &out, const ReadFilter &mr) {
 
     // parse the motif line
     parseSeqLine(value);
+
+    // parse the read name list
+    parseNameLine(value);
     
   }
 
 
     // main function for determining if a read is valid
-    bool AbstractRule::isValid(const BamRecord &r) {
+    bool AbstractRule::isValid(const BamRecord &r) const {
     
       DEBUGIV(r, "starting AR:isValid")
 
@@ -484,6 +854,10 @@ std::ostream& operator<<(std::ostream &out, const ReadFilter &mr) {
 	return false;
     }
 
+    // check the read name list
+    if (m_names && m_names->Contains(r.raw()) == m_names_inv)
+      return false;
+
     // check for valid mapping quality
     if (!mapq.isEvery())
       if (!mapq.isValid(r.MapQuality())) 
@@ -507,18 +881,6 @@ std::ostream& operator<<(std::ostream &out, const ReadFilter &mr) {
 
     DEBUGIV(r, "cigar pass")
       
-    // get the sequence as trimmed
-    std::string tseq = r.QualitySequence(); //AddZTag("GV", r.Sequence().substr(startpoint, new_len));
-    
-#ifdef HAVE_C11
-    // check for aho corasick motif match
-    if (aho.count) {
-      if (!aho.QueryText(tseq))
-      return false;
-      DEBUGIV(r, "aho pass")
-    }
-#endif    
-
     // check for valid NM
     if (!nm.isEvery()) {
       int32_t nm_val = 0;
@@ -536,17 +898,37 @@ std::ostream& operator<<(std::ostream &out, const ReadFilter &mr) {
       DEBUGIV(r, "N bases pass")
     }
 
-    // check for valid length
-    if (!len.isValid(tseq.length())) {
-      return false;
-      DEBUGIV(r, "len pass")
-    }
+    // only decode the trimmed sequence if a rule needs it
+    bool need_seq = !len.isEvery() || !clip.isEvery();
+#ifdef HAVE_C11
+    need_seq = need_seq || aho.count;
+#endif
+    if (need_seq) {
 
-    // check for valid clip
-    int new_clipnum = r.NumClip() - (r.Length() - tseq.length()); // get clips, minus amount trimmed off
-    if (!clip.isValid(new_clipnum)) {
-      return false;
-      DEBUGIV(r, "clip pass with clip size " + tostring(new_clipnum))
+      // get the sequence as trimmed
+      std::string tseq = r.QualitySequence(); //AddZTag("GV", r.Sequence().substr(startpoint, new_len));
+
+      // check for valid length
+      if (!len.isValid(tseq.length())) {
+	return false;
+	DEBUGIV(r, "len pass")
+      }
+
+      // check for valid clip
+      int new_clipnum = r.NumClip() - (r.Length() - tseq.length()); // get clips, minus amount trimmed off
+      if (!clip.isValid(new_clipnum)) {
+	return false;
+	DEBUGIV(r, "clip pass with clip size " + tostring(new_clipnum))
+      }
+
+#ifdef HAVE_C11
+      // check for aho corasick motif match, last as it is the most costly
+      if (aho.count) {
+	if (!aho.QueryText(tseq))
+	  return false;
+	DEBUGIV(r, "aho pass")
+      }
+#endif    
     }
 
     // check for secondary alignments
@@ -561,7 +943,7 @@ std::ostream& operator<<(std::ostream &out, const ReadFilter &mr) {
     return true;
   }
   
-  bool FlagRule::isValid(const BamRecord &r) {
+  bool FlagRule::isValid(const BamRecord &r) const {
     
     DEBUGIV(r, "flagrule start")
 
@@ -656,6 +1038,401 @@ std::ostream& operator<<(std::ostream &out, const ReadFilter &mr) {
   
 }
 
+  // longest CIGAR operation of a type
+  static int32_t max_cigar_op(const bam1_t* b, int op) {
+    const uint32_t* c = bam_get_cigar(b);
+    uint32_t m = 0;
+    for (uint32_t i = 0; i < b->core.n_cigar; ++i)
+      if (static_cast<int>(bam_cigar_op(c[i])) == op)
+	m = std::max(bam_cigar_oplen(c[i]), m);
+    return m;
+  }
+
+  // both the read and its mate are mapped, as BamRecord::PairMappedFlag
+  static bool pair_mapped(const bam1_t* b) {
+    return (b->core.flag & (BAM_FPAIRED | BAM_FUNMAP | BAM_FMUNMAP)) == BAM_FPAIRED;
+  }
+
+  // BamRecord::PairOrientation of a read with both mates mapped
+  static int pair_orientation(const bam1_t* b) {
+    bool rev = bam_is_rev(b);
+    bool mrev = bam_is_mrev(b);
+    if ( (!rev && b->core.pos <= b->core.mpos && mrev) || (rev && b->core.pos >= b->core.mpos && !mrev) )
+      return FRORIENTATION;
+    if (!rev && !mrev)
+      return FFORIENTATION;
+    if (rev && mrev)
+      return RRORIENTATION;
+    return RFORIENTATION;
+  }
+
+  // add the bits of a named flag that must be on (if the flag is ON) or off (if OFF)
+  static void fold_flag(const Flag& f, uint32_t bit, uint32_t& on, uint32_t& off) {
+    if (f.isOn())
+      on |= bit;
+    else if (f.isOff())
+      off |= bit;
+  }
+
+  // keep only the pair orientations allowed by an orientation flag
+  static void fold_orientation(const Flag& f, int orientation, uint32_t& allowed) {
+    if (f.isOn())
+      allowed &= 1u << orientation;
+    else if (f.isOff())
+      allowed &= ~(1u << orientation);
+  }
+
+  CompiledRule::CompiledRule()
+    : m_flag_on(0), m_flag_off(0), m_all_off(0), m_any_on(0), m_hardclip(-1),
+      m_orient(~0u), m_ic(-1), m_subsam_frac(1), m_subsam_seed(0),
+      m_adaptive(true), m_queries(0), m_names_inv(false) {}
+
+  CompiledRule::CompiledRule(const AbstractRule& ar)
+    : m_flag_on(0), m_flag_off(0), m_all_off(0), m_any_on(0), m_hardclip(-1),
+      m_orient(~0u), m_ic(-1), m_subsam_frac(ar.subsam_frac),
+      m_subsam_seed(ar.subsam_seed), m_read_group(ar.read_group),
+      m_adaptive(true), m_queries(0), m_names(ar.m_names), m_names_inv(ar.m_names_inv) {
+
+    const FlagRule& fr = ar.fr;
+
+    // all of the flag rules become two masks, plus the all-off and any-on checks
+    m_flag_on = fr.m_all_on_flag;
+    m_flag_off = fr.m_any_off_flag;
+    m_all_off = fr.m_all_off_flag;
+    m_any_on = fr.m_any_on_flag;
+    fold_flag(fr.dup, BAM_FDUP, m_flag_on, m_flag_off);
+    fold_flag(fr.supp, BAM_FSECONDARY, m_flag_on, m_flag_off); // as FlagRule::isValid
+    fold_flag(fr.qcfail, BAM_FQCFAIL, m_flag_on, m_flag_off);
+    fold_flag(fr.mapped, BAM_FUNMAP, m_flag_off, m_flag_on); // mapped is the unmapped bit off
+    fold_flag(fr.mate_mapped, BAM_FMUNMAP, m_flag_off, m_flag_on);
+
+    // the other checks start in a rough order of cost, which is
+    // relative to reading a field of the core (1)
+    if (!fr.hardclip.isNA()) {
+      m_hardclip = fr.hardclip.isOn();
+      add_check(CHECK_HARDCLIP, 2);
+    }
+
+    fold_orientation(fr.fr, FRORIENTATION, m_orient);
+    fold_orientation(fr.ff, FFORIENTATION, m_orient);
+    fold_orientation(fr.rf, RFORIENTATION, m_orient);
+    fold_orientation(fr.rr, RRORIENTATION, m_orient);
+    if (!fr.ic.isNA())
+      m_ic = fr.ic.isOn();
+    if (!fr.ff.isNA() || !fr.fr.isNA() || !fr.rf.isNA() || !fr.rr.isNA() || !fr.ic.isNA())
+      add_check(CHECK_ORIENTATION, 1);
+
+    add_range(FIELD_MAPQ, ar.mapq);
+    add_range(FIELD_ISIZE, ar.isize);
+    add_range(FIELD_INS, ar.ins);
+    add_range(FIELD_DEL, ar.del);
+
+    if (m_subsam_frac < 1)
+      add_check(CHECK_SUBSAMPLE, 3);
+
+    add_range(FIELD_LEN, ar.len);
+    add_range(FIELD_CLIP, ar.clip);
+    add_range(FIELD_NM, ar.nm);
+
+    if (!m_read_group.empty())
+      add_check(CHECK_READ_GROUP, 5);
+
+    if (m_names)
+      add_check(CHECK_READ_NAME, 3);
+
+    add_range(FIELD_NBASES, ar.nbases);
+    add_range(FIELD_XP, ar.xp);
+
+#ifdef HAVE_C11
+    if (ar.aho.count) {
+      m_motifs = ar.aho.automaton;
+      m_motifs.Build();
+      add_check(CHECK_MOTIF, 10);
+    }
+#endif
+  }
+
+  void CompiledRule::add_check(_CheckKind kind, double cost) {
+    _Check c;
+    c.kind = kind;
+    c.field = FIELD_MAPQ;
+    c.min = 0;
+    c.max = 0;
+    c.inverted = false;
+    c.cost = cost;
+    c.tested = 0;
+    c.rejected = 0;
+    m_checks.push_back(c);
+  }
+
+  void CompiledRule::add_range(RuleField f, const Range& r) {
+
+    if (r.isEvery())
+      return;
+
+    // cost of reading the value
+    double cost = 1;
+    switch (f) {
+    case FIELD_MAPQ: cost = 1; break;
+    case FIELD_ISIZE: case FIELD_INS: case FIELD_DEL: cost = 2; break;
+    case FIELD_LEN: case FIELD_CLIP: case FIELD_NM: cost = 4; break;
+    case FIELD_XP: cost = 6; break;
+    case FIELD_NBASES: cost = 8; break;
+    }
+
+    add_check(CHECK_RANGE, cost);
+    _Check& c = m_checks.back();
+    c.field = f;
+    c.min = r.lowerBound();
+    c.max = r.upperBound();
+    c.inverted = r.isInverted();
+  }
+
+  int CompiledRule::quality_sequence_length(const bam1_t* b) {
+    const uint8_t* p = bam_aux_get(b, "GV");
+    if (p && *p == 'Z') {
+      int n = strlen(reinterpret_cast<const char*>(p + 1));
+      if (n)
+	return n;
+    }
+    return b->core.l_qseq;
+  }
+
+  int CompiledRule::field_value(RuleField f, const bam1_t* b, _ReadCache& rc) {
+
+    switch (f) {
+    case FIELD_MAPQ:
+      return b->core.qual;
+    case FIELD_ISIZE:
+      if (b->core.tid != b->core.mtid || !pair_mapped(b))
+	return 0;
+      return std::abs(b->core.pos - b->core.mpos) + query_consumed(b);
+    case FIELD_INS:
+      return max_cigar_op(b, BAM_CINS);
+    case FIELD_DEL:
+      return max_cigar_op(b, BAM_CDEL);
+    case FIELD_LEN:
+      if (rc.len < 0)
+	rc.len = quality_sequence_length(b);
+      return rc.len;
+    case FIELD_CLIP: {
+      if (rc.len < 0)
+	rc.len = quality_sequence_length(b);
+      const uint32_t* c = bam_get_cigar(b);
+      int clip = 0;
+      for (uint32_t i = 0; i < b->core.n_cigar; ++i)
+	if (bam_cigar_op(c[i]) == BAM_CSOFT_CLIP || bam_cigar_op(c[i]) == BAM_CHARD_CLIP)
+	  clip += bam_cigar_oplen(c[i]);
+      return clip - (b->core.l_qseq - rc.len); // less the amount trimmed off
+    }
+    case FIELD_NM: {
+      const uint8_t* p = bam_aux_get(b, "NM");
+      return p ? bam_aux2i(p) : 0;
+    }
+    case FIELD_NBASES: {
+      const uint8_t* s = bam_get_seq(b);
+      int n = 0;
+      for (int32_t i = 0; i < b->core.l_qseq; ++i)
+	n += bam_seqi(s, i) == 15;
+      return n;
+    }
+    case FIELD_XP: {
+      const uint8_t* p = bam_aux_get(b, "XA");
+      if (!p || *p != 'Z')
+	return 0;
+      const char* xa = reinterpret_cast<const char*>(p + 1);
+      return std::count(xa, xa + strlen(xa), ';');
+    }
+    }
+    return 0;
+  }
+
+  bool CompiledRule::pass(const _Check& c, const bam1_t* b, _ReadCache& rc) const {
+
+    switch (c.kind) {
+
+    case CHECK_RANGE: {
+      int v = field_value(c.field, b, rc);
+      return c.inverted ? (v < c.min || v > c.max) : (v >= c.min && v <= c.max);
+    }
+
+    case CHECK_HARDCLIP: {
+      if (b->core.n_cigar <= 1)
+	return true;
+      const uint32_t* cig = bam_get_cigar(b);
+      bool clipped = false;
+      for (uint32_t i = 0; i < b->core.n_cigar; ++i)
+	clipped = clipped || (bam_cigar_op(cig[i]) == BAM_CHARD_CLIP && bam_cigar_oplen(cig[i]));
+      return clipped == (m_hardclip == 1);
+    }
+
+    case CHECK_ORIENTATION: {
+      if (!pair_mapped(b))
+	return false;
+      // orientation is not defined for inter-chromosomal pairs
+      bool ic = b->core.tid != b->core.mtid;
+      if (!ic && !(m_orient >> pair_orientation(b) & 1))
+	return false;
+      return m_ic < 0 || ic == (m_ic == 1);
+    }
+
+    case CHECK_SUBSAMPLE: {
+      uint32_t k = __ac_Wang_hash(__ac_X31_hash_string(bam_get_qname(b)) ^ m_subsam_seed);
+      return (double)(k&0xffffff) / 0x1000000 < m_subsam_frac;
+    }
+
+    // read group from the RG tag, or else from the qname, as BamRecord::ParseReadGroup
+    case CHECK_READ_GROUP: {
+      const char* rg = "NA";
+      size_t n = 2;
+      const uint8_t* p = bam_aux_get(b, "RG");
+      if (p && *p == 'Z') {
+	rg = reinterpret_cast<const char*>(p + 1);
+	n = strlen(rg);
+      } else {
+	const char* q = bam_get_qname(b);
+	const char* col = strchr(q, ':');
+	if (col) {
+	  rg = q;
+	  n = col - q;
+	}
+      }
+      return !n || (n == m_read_group.length() && !m_read_group.compare(0, n, rg, n));
+    }
+
+    // on the trimmed sequence if there is one, as BamRecord::QualitySequence
+    case CHECK_MOTIF: {
+      const uint8_t* p = bam_aux_get(b, "GV");
+      if (p && *p == 'Z' && p[1]) {
+	const char* gv = reinterpret_cast<const char*>(p + 1);
+	return m_motifs.Match(gv, strlen(gv));
+      }
+      return m_motifs.Match(bam_get_seq(b), b->core.l_qseq);
+    }
+
+    case CHECK_READ_NAME:
+      return m_names->Contains(b) != m_names_inv;
+    }
+    return true;
+  }
+
+  // higher is better to run first: the chance of a reject per unit cost,
+  // with a prior of one reject in two tests so that new checks get a turn
+  static double check_score(double rejected, double tested, double cost) {
+    return (rejected + 1) / (tested + 2) / cost;
+  }
+
+  void CompiledRule::reorder() const {
+
+    // insertion sort, as there are few checks and they are usually in order
+    for (size_t i = 1; i < m_checks.size(); ++i) {
+      _Check c = m_checks[i];
+      double sc = check_score(c.rejected, c.tested, c.cost);
+      size_t j = i;
+      for (; j > 0 && check_score(m_checks[j-1].rejected, m_checks[j-1].tested, m_checks[j-1].cost) < sc; --j)
+	m_checks[j] = m_checks[j-1];
+      m_checks[j] = c;
+    }
+
+    // decay the counts, so that the order follows the input
+    for (std::vector<_Check>::iterator c = m_checks.begin(); c != m_checks.end(); ++c) {
+      c->tested >>= 1;
+      c->rejected >>= 1;
+    }
+  }
+
+  bool CompiledRule::isValid(const bam1_t* b, bool adapt) const {
+
+    const uint32_t flag = b->core.flag;
+    if ((flag & m_flag_on) != m_flag_on || (flag & m_flag_off))
+      return false;
+    if (m_all_off && (flag & m_all_off) == m_all_off)
+      return false;
+    if (m_any_on && !(flag & m_any_on))
+      return false;
+
+    return run_checks(b, false, adapt);
+  }
+
+  bool CompiledRule::run_checks(const bam1_t* b, bool skip_mapq, bool adapt) const {
+
+    _ReadCache rc;
+
+    if (!m_adaptive || !adapt) {
+      for (std::vector<_Check>::const_iterator c = m_checks.begin(); c != m_checks.end(); ++c)
+	if (!(skip_mapq && c->kind == CHECK_RANGE && c->field == FIELD_MAPQ) && !pass(*c, b, rc))
+	  return false;
+      return true;
+    }
+
+    // only reads that get past the flags count, as only they see the checks
+    if (m_checks.size() > 1 && ++m_queries >= RULE_ADAPT_INTERVAL) {
+      reorder();
+      m_queries = 0;
+    }
+
+    for (std::vector<_Check>::iterator c = m_checks.begin(); c != m_checks.end(); ++c) {
+      if (skip_mapq && c->kind == CHECK_RANGE && c->field == FIELD_MAPQ)
+	continue;
+      ++c->tested;
+      if (!pass(*c, b, rc)) {
+	++c->rejected;
+	return false;
+      }
+    }
+
+    return true;
+  }
+
+  void CompiledRule::Evaluate(const ReadColumns& c, const uint8_t* test, uint8_t* pass, bool adapt) const {
+
+    const size_t n = c.size();
+    std::vector<uint8_t> ok(n);
+
+    // flag masks, without branches so the loop can be vectorized
+    const uint32_t on = m_flag_on, off = m_flag_off, all_off = m_all_off, any_on = m_any_on;
+    const uint32_t* f = n ? &c.flag[0] : NULL;
+    for (size_t i = 0; i < n; ++i)
+      ok[i] = (test[i] != 0) & ((f[i] & on) == on) & ((f[i] & off) == 0) &
+	(!all_off | ((f[i] & all_off) != all_off)) & (!any_on | ((f[i] & any_on) != 0));
+
+    // MAPQ range, if there is one
+    bool skip_mapq = false;
+    for (std::vector<_Check>::const_iterator ch = m_checks.begin(); ch != m_checks.end(); ++ch) {
+      if (ch->kind != CHECK_RANGE || ch->field != FIELD_MAPQ)
+	continue;
+      const int lo = ch->min, hi = ch->max;
+      const uint8_t* q = n ? &c.mapq[0] : NULL;
+      if (ch->inverted)
+	for (size_t i = 0; i < n; ++i)
+	  ok[i] &= (q[i] < lo) | (q[i] > hi);
+      else
+	for (size_t i = 0; i < n; ++i)
+	  ok[i] &= (q[i] >= lo) & (q[i] <= hi);
+      skip_mapq = true;
+      break;
+    }
+
+    // the rest, read by read
+    for (size_t i = 0; i < n; ++i)
+      if (ok[i] && run_checks(c.reads[i], skip_mapq, adapt))
+	pass[i] = 1;
+  }
+
+  void ReadColumns::Load(const BamRecordVector& batch) {
+
+    const size_t n = batch.size();
+    reads.resize(n);
+    flag.resize(n);
+    mapq.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+      const bam1_t* b = batch[i].raw();
+      reads[i] = b;
+      flag[i] = b->core.flag;
+      mapq[i] = b->core.qual;
+    }
+  }
+
 // define how to print
 std::ostream& operator<<(std::ostream &out, const AbstractRule &ar) {
 
@@ -685,6 +1462,9 @@ std::ostream& operator<<(std::ostream &out, const AbstractRule &ar) {
       out << "del:" << ar.del << " -- ";
     if (ar.subsam_frac < 1)
       out << "sub:" << ar.subsam_frac << " -- ";
+    if (ar.m_names)
+      out << (ar.m_names_inv ? "!qname: " : "qname: ")
+	  << (ar.m_names_file.empty() ? AddCommas(ar.m_names->size()) + " names" : ar.m_names_file) << " -- ";
 #ifdef HAVE_C11
     if (ar.aho.count)
       out << "motif: " << ar.aho.file << " -- ";
@@ -853,6 +1633,30 @@ std::ostream& operator<<(std::ostream &out, const Range &r) {
   }
 #endif
   
+  void AbstractRule::parseNameLine(const Json::Value& value) {
+    Json::Value null(Json::nullValue);
+    if (value.get("qname", null) != null)
+      addReadNameRule(value.get("qname", null).asString(), false);
+    else if (value.get("!qname", null) != null)
+      addReadNameRule(value.get("!qname", null).asString(), true);
+  }
+
+  void AbstractRule::addReadNameRule(const std::string& f, bool inverted) {
+    std::cerr << "...reading read names from " << f << std::endl;
+    SeqPointer<ReadNameSet> names(new ReadNameSet);
+    names->AddFile(f);
+    std::cerr << "...finished reading " << AddCommas(names->size()) << " read names" << std::endl;
+    m_names = names;
+    m_names_inv = inverted;
+    m_names_file = f;
+  }
+
+  void AbstractRule::addReadNameRule(const ReadNameSet& names, bool inverted) {
+    m_names = SeqPointer<ReadNameSet>(new ReadNameSet(names));
+    m_names_inv = inverted;
+    m_names_file.clear();
+  }
+
   void AbstractRule::parseSubLine(const Json::Value& value) {
     Json::Value null(Json::nullValue);
     if (value.get("subsample", null) != null) 
@@ -868,6 +1672,39 @@ GRC ReadFilterCollection::getAllRegions() const
 
   return out;
 }
+
+  bool ReadFilterCollection::GetAcceptedRegions(GRC& grc, int pad) const {
+
+    grc.clear();
+
+    // no filters pass everything
+    if (m_regions.empty())
+      return false;
+
+    for (std::vector<ReadFilter>::const_iterator i = m_regions.begin(); i != m_regions.end(); ++i) {
+      if (i->excluder)
+	continue;
+      // a mate-linked read can be anywhere
+      if (!i->m_grv.size() || i->m_applies_to_mate) {
+	grc.clear();
+	return false;
+      }
+      grc.Concat(i->m_grv);
+    }
+
+    // a read at [p, e] overlaps [pos1, pos2] if p <= pos2 and e >= pos1,
+    // and an index query of [beg, end) returns it if p < end and e > beg
+    for (size_t i = 0; i < grc.size(); ++i) {
+      GenomicRegion& g = grc[i];
+      g.pos1 = std::max(0, g.pos1 - 1 - pad);
+      g.pos2 = g.pos2 + 1 + pad;
+    }
+
+    if (grc.size())
+      grc.MergeOverlappingIntervals();
+
+    return true;
+  }
     
 #ifdef HAVE_C11
     int AhoCorasick::QueryText(const std::string& t) const {
@@ -0,0 +1,126 @@
+#include "SeqLib/ReadNameSet.h"
+
+#include <stdexcept>
+#include <cstring>
+#include <fstream>
+
+namespace SeqLib {
+
+  // smallest table. It is kept at most half full, so probes stay short
+  static const size_t MIN_TABLE_SIZE = 1024;
+
+  // table slots per Bloom word (so 16 to 32 Bloom bits per name)
+  static const size_t SLOTS_PER_BLOOM_WORD = 8;
+
+  static inline uint64_t mix64(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+  }
+
+  ReadNameSet::ReadNameSet() : m_table(MIN_TABLE_SIZE, 0), m_bloom(MIN_TABLE_SIZE / SLOTS_PER_BLOOM_WORD, 0), m_count(0) {}
+
+  uint64_t ReadNameSet::hash(const char* s, size_t n) {
+
+    // eight bytes at a time, then the rest
+    const uint64_t k = 0x9e3779b97f4a7c15ULL;
+    uint64_t h = n * k;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+      uint64_t w;
+      memcpy(&w, s + i, 8);
+      h = (h ^ mix64(w)) * k;
+    }
+    uint64_t w = 0;
+    for (size_t j = 0; i < n; ++i, j += 8)
+      w |= static_cast<uint64_t>(static_cast<uint8_t>(s[i])) << j;
+    h = mix64(h ^ w);
+
+    // 0 marks an empty slot
+    return h ? h : 1;
+  }
+
+  uint64_t ReadNameSet::bloom_bits(uint64_t h) {
+    // the low bits pick the word and the slot, so use the high ones
+    return (1ULL << (h >> 58)) | (1ULL << ((h >> 52) & 63)) |
+      (1ULL << ((h >> 46) & 63)) | (1ULL << ((h >> 40) & 63));
+  }
+
+  void ReadNameSet::insert(uint64_t h) {
+    const size_t mask = m_table.size() - 1;
+    size_t i = h & mask;
+    while (m_table[i])
+      i = (i + 1) & mask;
+    m_table[i] = h;
+    m_bloom[h & (m_bloom.size() - 1)] |= bloom_bits(h);
+  }
+
+  void ReadNameSet::grow() {
+    std::vector<uint64_t> old;
+    old.swap(m_table);
+    m_table.assign(old.size() * 2, 0);
+    m_bloom.assign(m_table.size() / SLOTS_PER_BLOOM_WORD, 0);
+    for (std::vector<uint64_t>::const_iterator h = old.begin(); h != old.end(); ++h)
+      if (*h)
+	insert(*h);
+  }
+
+  void ReadNameSet::Add(const char* name, size_t n) {
+
+    uint64_t h = hash(name, n);
+
+    const size_t mask = m_table.size() - 1;
+    for (size_t i = h & mask; m_table[i]; i = (i + 1) & mask)
+      if (m_table[i] == h)
+	return;
+
+    if (2 * (m_count + 1) > m_table.size())
+      grow();
+    insert(h);
+    ++m_count;
+  }
+
+  void ReadNameSet::AddFile(const std::string& f) {
+
+    std::ifstream iss(f.c_str());
+    if (!iss)
+      throw std::runtime_error("ReadNameSet::AddFile - Cannot read file: " + f);
+
+    std::string line;
+    while (getline(iss, line, '\n')) {
+      size_t e = line.find_first_of(" \t\r");
+      if (e == std::string::npos)
+	e = line.length();
+      if (e)
+	Add(line.data(), e);
+    }
+  }
+
+  bool ReadNameSet::Contains(const char* name, size_t n) const {
+
+    uint64_t h = hash(name, n);
+
+    uint64_t bits = bloom_bits(h);
+    if ((m_bloom[h & (m_bloom.size() - 1)] & bits) != bits)
+      return false;
+
+    const size_t mask = m_table.size() - 1;
+    for (size_t i = h & mask; m_table[i]; i = (i + 1) & mask)
+      if (m_table[i] == h)
+	return true;
+    return false;
+  }
+
+  bool ReadNameSet::Contains(const bam1_t* b) const {
+    // l_qname counts the NUL, and any padding NULs after it
+    const char* q = bam_get_qname(b);
+    size_t n = b->core.l_qname ? b->core.l_qname - 1 : 0;
+    while (n && !q[n - 1])
+      --n;
+    return Contains(q, n);
+  }
+
+}
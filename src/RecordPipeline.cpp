@@ -0,0 +1,171 @@
+#include "SeqLib/RecordPipeline.h"
+
+#ifdef HAVE_C11
+
+#include <stdexcept>
+
+namespace SeqLib {
+
+  RecordPipeline::RecordPipeline(ThreadPool tp, size_t batch_size, size_t max_batches)
+    : m_pool(tp), m_batch_size(batch_size), m_max_batches(max_batches),
+      m_next_out(0), m_in_flight(0) {
+
+    if (!batch_size)
+      throw std::invalid_argument("RecordPipeline: batch_size must be > 0");
+
+    if (!m_max_batches)
+      m_max_batches = 4 * (m_pool.IsOpen() ? m_pool.nthreads : 1);
+  }
+
+  bool RecordPipeline::Run(BamReader& r, BatchFunction f, BamWriter& w) {
+    return Run(r, f, [&w](const BamRecordVector& batch) {
+	for (BamRecordVector::const_iterator i = batch.begin(); i != batch.end(); ++i)
+	  if (!w.WriteRecord(*i))
+	    return false;
+	return true;
+      });
+  }
+
+  bool RecordPipeline::RunFilter(BamReader& r, const Filter::ReadFilterCollection& rfc, BamWriter& w) {
+    return RunFilter(r, rfc, [&w](const BamRecordVector& batch) {
+	for (BamRecordVector::const_iterator i = batch.begin(); i != batch.end(); ++i)
+	  if (!w.WriteRecord(*i))
+	    return false;
+	return true;
+      });
+  }
+
+  bool RecordPipeline::RunFilter(BamReader& r, const Filter::ReadFilterCollection& rfc, SinkFunction sink) {
+
+    // compile a copy up front, so that the workers only read it
+    Filter::ReadFilterCollection filters(rfc);
+    filters.Compile();
+    const Filter::ReadFilterCollection& shared = filters;
+
+    return Run(r, [&shared](BamRecordVector& batch) {
+	std::vector<uint64_t> mask;
+	shared.Evaluate(batch, mask);
+
+	// keep the passing reads, in order
+	size_t k = 0;
+	for (size_t i = 0; i < batch.size(); ++i)
+	  if (mask[i / 64] >> (i % 64) & 1) {
+	    if (k != i)
+	      batch[k] = batch[i];
+	    ++k;
+	  }
+	batch.resize(k);
+      }, sink);
+  }
+
+  bool RecordPipeline::Run(BamReader& r, BatchFunction f, SinkFunction sink) {
+
+    m_done.clear();
+    m_next_out = 0;
+    m_in_flight = 0;
+    m_err = std::exception_ptr();
+
+    bool success = true;
+    bool more = true;
+    size_t seq = 0;
+    BamRecord rec;
+
+    while (success && more) {
+
+      SeqPointer<BamRecordVector> batch(new BamRecordVector());
+      batch->reserve(m_batch_size);
+      while (batch->size() < m_batch_size && (more = r.GetNextRecord(rec)))
+	batch->push_back(rec);
+      if (batch->empty())
+	break;
+
+      // write what is ready, then wait until there is room for another batch
+      success = drain(sink, false);
+      while (success) {
+	{
+	  std::lock_guard<std::mutex> lock(m_mtx);
+	  if (m_in_flight < m_max_batches) {
+	    ++m_in_flight;
+	    break;
+	  }
+	}
+	success = drain(sink, true);
+      }
+      if (!success)
+	break;
+
+      m_pool.Submit([this, seq, batch, &f]() { process(seq, batch, f); });
+      ++seq;
+    }
+
+    // write the rest
+    while (success) {
+      {
+	std::lock_guard<std::mutex> lock(m_mtx);
+	if (!m_in_flight)
+	  break;
+      }
+      success = drain(sink, true);
+    }
+
+    // on a stop, batches may still be running. Wait for them before returning
+    std::unique_lock<std::mutex> lock(m_mtx);
+    m_cv.wait(lock, [this] { return m_done.size() == m_in_flight; });
+    m_done.clear();
+    m_in_flight = 0;
+
+    if (m_err)
+      std::rethrow_exception(m_err);
+
+    return success;
+  }
+
+  void RecordPipeline::process(size_t seq, SeqPointer<BamRecordVector> batch, const BatchFunction& f) {
+
+    std::exception_ptr ex;
+    try {
+      f(*batch);
+    } catch (...) {
+      ex = std::current_exception();
+    }
+
+    std::lock_guard<std::mutex> lock(m_mtx);
+    if (ex && !m_err)
+      m_err = ex;
+    m_done[seq] = batch;
+    m_cv.notify_all();
+  }
+
+  bool RecordPipeline::drain(const SinkFunction& sink, bool block) {
+
+    while (true) {
+
+      SeqPointer<BamRecordVector> batch;
+      {
+	std::unique_lock<std::mutex> lock(m_mtx);
+	if (block)
+	  m_cv.wait(lock, [this] { return m_err || m_done.count(m_next_out); });
+	if (m_err)
+	  return false;
+	std::map<size_t, SeqPointer<BamRecordVector> >::iterator ff = m_done.find(m_next_out);
+	if (ff == m_done.end())
+	  return true;
+	batch = ff->second;
+	m_done.erase(ff);
+      }
+
+      // write outside the lock, so workers can keep adding to the buffer
+      bool ok = sink(*batch);
+
+      std::lock_guard<std::mutex> lock(m_mtx);
+      ++m_next_out;
+      --m_in_flight;
+      if (!ok)
+	return false;
+      block = false;
+    }
+  }
+
+}
+
+#endif
@@ -0,0 +1,186 @@
+#include "SeqLib/RegionScheduler.h"
+
+#ifdef HAVE_C11
+
+#include <stdexcept>
+#include <algorithm>
+
+namespace SeqLib {
+
+  bool RegionTask::Progress(int32_t pos) {
+
+    if (pos > m_region.pos2)
+      return false;
+
+    if (m_sched && m_sched->want_split())
+      m_sched->split(*this, pos);
+
+    return true;
+  }
+
+  RegionScheduler::RegionScheduler(ThreadPool tp, int32_t min_width)
+    : m_pool(tp), m_min_width(min_width), m_max(1), m_active(0),
+      m_queued(0), m_steals(0), m_splits(0) {
+
+    if (min_width < 1)
+      throw std::invalid_argument("RegionScheduler: min_width must be > 0");
+
+    if (m_pool.IsOpen())
+      m_max = m_pool.nthreads;
+  }
+
+  void RegionScheduler::Run(const GRC& regions, RegionFunction f) {
+
+    m_steals = 0;
+    m_splits = 0;
+    m_err = std::exception_ptr();
+
+    if (regions.IsEmpty())
+      return;
+
+    m_func = f;
+
+    // give each worker a contiguous block of regions, to keep reads local
+    m_queues.clear();
+    for (size_t i = 0; i < m_max; ++i)
+      m_queues.push_back(SeqPointer<_WorkQueue>(new _WorkQueue()));
+    size_t n = regions.size();
+    for (size_t i = 0; i < n; ++i)
+      m_queues[i * m_max / n]->q.push_back(regions[i]);
+    m_queued = n;
+
+    // calling thread is the worker on slot 0
+    m_free_slots.clear();
+    for (size_t i = m_max; i > 1; --i)
+      m_free_slots.push_back(i - 1);
+    m_active = 1;
+
+    for (size_t i = 1; i < std::min(m_max, n); ++i)
+      launch();
+
+    worker(0);
+
+    std::unique_lock<std::mutex> lock(m_mtx);
+    m_done.wait(lock, [this] { return m_active == 0; });
+
+    m_func = RegionFunction();
+    if (m_err)
+      std::rethrow_exception(m_err);
+  }
+
+  void RegionScheduler::Run(const GenomicTiling& tiles, RegionFunction f) {
+
+    size_t steals = 0, splits = 0;
+    const size_t batch = REGION_SCHEDULER_TILE_BATCH * m_max;
+    for (size_t i = 0; i < tiles.size(); i += batch) {
+      Run(tiles.Slice(i, std::min(tiles.size(), i + batch)), f);
+      steals += m_steals;
+      splits += m_splits;
+    }
+    m_steals = steals;
+    m_splits = splits;
+  }
+
+  void RegionScheduler::worker(size_t slot) {
+
+    RegionTask t;
+    t.m_sched = this;
+    t.m_slot = slot;
+
+    while (true) {
+
+      while (next_region(slot, t.m_region)) {
+
+	// bisect before starting, if another worker could take half
+	t.Progress(t.m_region.pos1);
+
+	try {
+	  m_func(t);
+	} catch (...) {
+	  std::lock_guard<std::mutex> lock(m_mtx);
+	  if (!m_err)
+	    m_err = std::current_exception();
+	}
+      }
+
+      // regions queued since the last look are taken by this worker,
+      // otherwise whoever queued them will see the free slot
+      std::lock_guard<std::mutex> lock(m_mtx);
+      if (m_queued > 0)
+	continue;
+      --m_active;
+      m_free_slots.push_back(slot);
+      m_done.notify_all();
+      return;
+    }
+  }
+
+  bool RegionScheduler::next_region(size_t slot, GenomicRegion& gr) {
+
+    // own queue, from the front
+    {
+      _WorkQueue& wq = *m_queues[slot];
+      std::lock_guard<std::mutex> lock(wq.mtx);
+      if (!wq.q.empty()) {
+	gr = wq.q.front();
+	wq.q.pop_front();
+	--m_queued;
+	return true;
+      }
+    }
+
+    // steal from the back of the others
+    for (size_t i = 1; i < m_queues.size(); ++i) {
+      _WorkQueue& wq = *m_queues[(slot + i) % m_queues.size()];
+      std::lock_guard<std::mutex> lock(wq.mtx);
+      if (!wq.q.empty()) {
+	gr = wq.q.back();
+	wq.q.pop_back();
+	--m_queued;
+	++m_steals;
+	return true;
+      }
+    }
+
+    return false;
+  }
+
+  void RegionScheduler::launch() {
+
+    size_t slot;
+    {
+      std::lock_guard<std::mutex> lock(m_mtx);
+      if (m_free_slots.empty())
+	return;
+      slot = m_free_slots.back();
+      m_free_slots.pop_back();
+      ++m_active;
+    }
+
+    m_pool.Submit([this, slot]() { worker(slot); });
+  }
+
+  void RegionScheduler::split(RegionTask& t, int32_t pos) {
+
+    GenomicRegion& gr = t.m_region;
+    if (gr.pos2 - pos < 2 * m_min_width)
+      return;
+
+    int32_t mid = pos + (gr.pos2 - pos) / 2;
+    GenomicRegion upper(gr.chr, mid + 1, gr.pos2, gr.strand);
+    gr.pos2 = mid;
+
+    {
+      _WorkQueue& wq = *m_queues[t.m_slot];
+      std::lock_guard<std::mutex> lock(wq.mtx);
+      wq.q.push_back(upper);
+      ++m_queued;
+    }
+    ++m_splits;
+
+    launch();
+  }
+
+}
+
+#endif
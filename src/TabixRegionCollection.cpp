@@ -0,0 +1,174 @@
+#include "SeqLib/TabixRegionCollection.h"
+
+#include <stdexcept>
+#include <algorithm>
+
+namespace SeqLib {
+
+  TabixRegionCollection::TabixRegionCollection(size_t max_windows, int32_t window_width)
+    : m_max_windows(max_windows), m_window_width(window_width), m_vcf(false), m_loads(0) {
+
+    if (!max_windows)
+      throw std::invalid_argument("TabixRegionCollection: max_windows must be > 0");
+    if (window_width < 0)
+      throw std::invalid_argument("TabixRegionCollection: window_width must be >= 0");
+  }
+
+  bool TabixRegionCollection::Open(const std::string& file, const BamHeader& hdr) {
+
+    Close();
+
+    m_fp = SeqPointer<htsFile>(hts_open(file.c_str(), "r"), htsFile_delete());
+    if (!m_fp) {
+      std::cerr << "TabixRegionCollection: Cannot open " << file << std::endl;
+      return false;
+    }
+
+    m_tbx = SeqPointer<tbx_t>(tbx_index_load(file.c_str()), tbx_delete());
+    if (!m_tbx) {
+      std::cerr << "TabixRegionCollection: Cannot load tabix index for " << file << std::endl;
+      m_fp = SeqPointer<htsFile>();
+      return false;
+    }
+
+    m_hdr = hdr;
+    m_vcf = (m_tbx->conf.preset & 0xffff) == TBX_VCF;
+
+    // match the sequence names of the index to the dictionary,
+    // the same way the names of the lines are matched
+    _ChrNameCache chrs(m_hdr);
+    int n = 0;
+    const char** names = tbx_seqnames(m_tbx.get(), &n);
+    for (int i = 0; i < n; ++i) {
+      int id = -1;
+      try {
+	id = chrs.ID(names[i], names[i] + strlen(names[i]));
+      } catch (...) {
+	continue;
+      }
+      if (id < 0)
+	continue;
+      if (static_cast<size_t>(id) >= m_tid.size())
+	m_tid.resize(id + 1, -1);
+      m_tid[id] = i;
+    }
+    free(names);
+
+    return true;
+  }
+
+  void TabixRegionCollection::Close() {
+    m_windows.clear();
+    m_tid.clear();
+    m_tbx = SeqPointer<tbx_t>();
+    m_fp = SeqPointer<htsFile>();
+    m_loads = 0;
+  }
+
+  const GRC& TabixRegionCollection::Window(int32_t chr, int32_t pos) {
+
+    if (!IsOpen())
+      throw std::runtime_error("TabixRegionCollection: No file is open");
+
+    pos = std::max(pos, 0);
+    for (std::list<_Window>::iterator w = m_windows.begin(); w != m_windows.end(); ++w)
+      if (w->chr == chr && w->start <= pos && pos <= w->end) {
+	m_windows.splice(m_windows.begin(), m_windows, w);
+	return w->grc;
+      }
+
+    if (m_windows.size() >= m_max_windows)
+      m_windows.pop_back();
+
+    m_windows.push_front(_Window());
+    _Window& w = m_windows.front();
+    w.chr = chr;
+    window_bounds(pos, w.start, w.end);
+    try {
+      load(chr, w.start, w.end, w.grc);
+    } catch (...) {
+      m_windows.pop_front();
+      throw;
+    }
+    return w.grc;
+  }
+
+  GRC TabixRegionCollection::FindOverlaps(const GenomicRegion& gr, bool ignore_strand) {
+    GRC tmp;
+    return intervals_for(gr, tmp).FindOverlaps(gr, ignore_strand);
+  }
+
+  size_t TabixRegionCollection::CountOverlaps(const GenomicRegion& gr) {
+    GRC tmp;
+    return intervals_for(gr, tmp).CountOverlaps(gr);
+  }
+
+  bool TabixRegionCollection::AnyOverlap(const GenomicRegion& gr, bool ignore_strand) {
+    GRC tmp;
+    return intervals_for(gr, tmp).AnyOverlap(gr, ignore_strand);
+  }
+
+  void TabixRegionCollection::window_bounds(int32_t pos, int32_t& start, int32_t& end) const {
+
+    const int32_t max_end = INT32_MAX - 1;
+    if (!m_window_width) {
+      start = 0;
+      end = max_end;
+      return;
+    }
+    int64_t s = static_cast<int64_t>(std::max(pos, 0) / m_window_width) * m_window_width;
+    start = s;
+    end = std::min<int64_t>(s + m_window_width - 1, max_end);
+  }
+
+  const GRC& TabixRegionCollection::intervals_for(const GenomicRegion& gr, GRC& tmp) {
+
+    if (!IsOpen())
+      throw std::runtime_error("TabixRegionCollection: No file is open");
+
+    int32_t start, end;
+    window_bounds(gr.pos1, start, end);
+    if (gr.pos2 <= end)
+      return Window(gr.chr, gr.pos1);
+
+    // spans windows, so read just what it needs
+    load(gr.chr, gr.pos1, gr.pos2, tmp);
+    return tmp;
+  }
+
+  void TabixRegionCollection::load(int32_t chr, int32_t start, int32_t end, GRC& grc) {
+
+    grc.clear();
+    ++m_loads;
+
+    if (chr < 0 || static_cast<size_t>(chr) >= m_tid.size() || m_tid[chr] < 0)
+      return;
+
+    // tabix ranges are 0-based, half open. Widen by one on each side, so
+    // every line whose interval (as read by ReadBED / ReadVCF) touches
+    // [start, end] is returned
+    int beg = std::max(start, 1) - 1;
+    int stop = end >= INT32_MAX - 1 ? INT32_MAX : end + 1;
+    SeqPointer<hts_itr_t> itr(tbx_itr_queryi(m_tbx.get(), m_tid[chr], beg, stop), hts_itr_delete());
+    if (!itr)
+      return;
+
+    _ChrNameCache chrs(m_hdr);
+    kstring_t str = {0, 0, NULL};
+    try {
+      while (tbx_itr_next(m_fp.get(), m_tbx.get(), itr.get(), &str) >= 0) {
+	if (m_vcf)
+	  grc.parse_vcf_line(str.s, str.s + str.l, chrs);
+	else
+	  grc.parse_bed_line(str.s, str.s + str.l, chrs);
+      }
+    } catch (...) {
+      free(str.s);
+      throw;
+    }
+    free(str.s);
+
+    grc.CreateIntervalArrayMap();
+  }
+
+}
@@ -0,0 +1,106 @@
+#include "SeqLib/ThreadPool.h"
+
+#ifdef HAVE_C11
+
+#include <cstdio>
+#include "json/json.h"
+
+namespace SeqLib {
+
+  std::string ThreadPoolStats::AsJSON() const {
+
+    Json::Value v;
+    v["nthreads"] = static_cast<Json::UInt64>(nthreads);
+    v["queued"] = static_cast<Json::UInt64>(queued);
+    v["completed"] = static_cast<Json::UInt64>(completed);
+    v["running"] = static_cast<Json::UInt64>(running);
+    v["waiting"] = static_cast<Json::UInt64>(waiting);
+    v["elapsed"] = elapsed;
+    v["mean_wait"] = mean_wait;
+    v["task_time"] = task_time;
+    v["other_time"] = other_time;
+    v["busy"] = Json::Value(Json::arrayValue);
+    for (std::vector<double>::const_iterator i = busy.begin(); i != busy.end(); ++i)
+      v["busy"].append(*i);
+
+    Json::StreamWriterBuilder builder;
+    builder["indentation"] = "";
+    return Json::writeString(builder, v);
+  }
+
+  ThreadPoolStats _ThreadPoolStats::snapshot() {
+
+    ThreadPoolStats s;
+    s.nthreads = nthreads;
+
+    // read in reverse order of update, so waiting can't go negative
+    s.completed = completed;
+    s.running = running;
+    s.queued = queued;
+    size_t started = s.completed + s.running;
+    s.waiting = s.queued > started ? s.queued - started : 0;
+
+    uint64_t elapsed_ns = now() - start;
+    s.elapsed = elapsed_ns * 1e-9;
+    s.mean_wait = started ? wait_ns * 1e-9 / started : 0;
+
+    uint64_t total_ns = 0;
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      for (std::map<std::thread::id, uint64_t>::const_iterator i = busy_ns.begin(); i != busy_ns.end(); ++i) {
+	s.busy.push_back(elapsed_ns ? static_cast<double>(i->second) / elapsed_ns : 0);
+	total_ns += i->second;
+      }
+    }
+    // threads that have not run a task yet
+    while (s.busy.size() < nthreads)
+      s.busy.push_back(0);
+
+    s.task_time = total_ns * 1e-9;
+    s.other_time = std::max(0.0, nthreads * s.elapsed - s.task_time);
+
+    return s;
+  }
+
+  bool _ThreadPoolStats::start_dump(const std::string& file, double seconds) {
+
+    if (seconds <= 0)
+      return false;
+
+    stop_dump();
+
+    FILE* fp = file == "-" ? stderr : fopen(file.c_str(), "a");
+    if (!fp) {
+      std::cerr << "ThreadPool: Cannot open " << file << " for stats" << std::endl;
+      return false;
+    }
+
+    dump_stop = false;
+    dump_thread = std::thread([this, fp, seconds]() {
+	std::unique_lock<std::mutex> lock(dump_mtx);
+	while (!dump_cv.wait_for(lock, std::chrono::duration<double>(seconds), [this] { return dump_stop; })) {
+	  fprintf(fp, "%s\n", snapshot().AsJSON().c_str());
+	  fflush(fp);
+	}
+	if (fp != stderr)
+	  fclose(fp);
+      });
+
+    return true;
+  }
+
+  void _ThreadPoolStats::stop_dump() {
+
+    {
+      std::lock_guard<std::mutex> lock(dump_mtx);
+      dump_stop = true;
+    }
+    dump_cv.notify_all();
+
+    if (dump_thread.joinable())
+      dump_thread.join();
+  }
+
+}
+
+#endif